@@ -0,0 +1,219 @@
+// Benchmark harness: generates inputs with gensort for every distribution and size, runs the sort on each
+// with every thread count and sort mode and writes one CSV row per phase with its time, throughput, peak RSS
+// and the validation result. Sizes are given as multiples of the memory budget, so that one sweep covers the
+// in-memory path (phase_small_file) as well as the external sort (phase1 + phase2) with few or many runs.
+// The default sort modes pit the radix sort against the counting sort's splitter classification, which the
+// equal and zipf distributions run into with heavily repeated splitters.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define RECORD_SIZE (100)
+
+using namespace std;
+
+typedef struct phase_result {
+  string name;
+  long long milliseconds;
+  size_t peak_rss; // Kilobytes
+} phase_result_t;
+
+static vector<string> split(const string &list) {
+  vector<string> items;
+  size_t head = 0;
+  while (head <= list.size()) {
+    size_t tail = list.find(',', head);
+    if (tail == string::npos) {
+      tail = list.size();
+    }
+    if (tail > head) {
+      items.push_back(list.substr(head, tail - head));
+    }
+    head = tail + 1;
+  }
+  return items;
+}
+
+// "100000000", "100M", "2G", ... with decimal suffixes, as run -M takes them
+static size_t parse_size(const char *str) {
+  char *end;
+  double size = strtod(str, &end);
+  switch (*end) {
+    case 'K':
+    case 'k':
+      return size * 1e3;
+    case 'M':
+    case 'm':
+      return size * 1e6;
+    case 'G':
+    case 'g':
+      return size * 1e9;
+    default:
+      return size;
+  }
+}
+
+// Phase times and peak RSS as printed by run, plus the number of tuples it found out of order
+static bool run_sort(const string &command, vector<phase_result_t> &phases, long long &wrong_tuples) {
+  FILE *pipe = popen(command.c_str(), "r");
+  if (pipe == NULL) {
+    return false;
+  }
+  char line[1024];
+  wrong_tuples = -1;
+  while (fgets(line, sizeof(line), pipe) != NULL) {
+    char name[64];
+    long long value;
+    if (sscanf(line, "[%63[^]]] took: %lld", name, &value) == 2) {
+      phases.push_back({name, value, 0});
+    } else if (sscanf(line, "[%63[^]]] peak RSS: %lld", name, &value) == 2) {
+      for (size_t i = 0; i < phases.size(); i++) {
+        if (phases[i].name == name) {
+          phases[i].peak_rss = value;
+        }
+      }
+    } else if (sscanf(line, "[Validation] Total of %lld", &value) == 1) {
+      wrong_tuples = value;
+    }
+  }
+  return pclose(pipe) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  string run_binary = "./run";
+  string gensort_binary = "./bench/gensort";
+  string work_directory = "./bench_data";
+  string memory_budget = "100M";
+  string distributions = "uniform,sorted,reverse,equal,zipf,prefix,nearly";
+  string multiples = "0.5,2,8";
+  string thread_counts = "1";
+  string sort_modes = "inplace,counting";
+  string run_args;
+  string output_filename;
+  size_t repeats = 1;
+  bool keep_inputs = false;
+  if (thread::hardware_concurrency() > 1) {
+    thread_counts += "," + to_string(thread::hardware_concurrency());
+  }
+
+  int opt;
+  bool usage_error = false;
+  while ((opt = getopt(argc, argv, "r:g:w:M:d:x:t:m:a:o:n:k")) != -1) {
+    switch (opt) {
+      case 'r':
+        run_binary = optarg;
+        break;
+      case 'g':
+        gensort_binary = optarg;
+        break;
+      case 'w':
+        work_directory = optarg;
+        break;
+      case 'M':
+        memory_budget = optarg;
+        break;
+      case 'd':
+        distributions = optarg;
+        break;
+      case 'x':
+        multiples = optarg;
+        break;
+      case 't':
+        thread_counts = optarg;
+        break;
+      case 'm':
+        sort_modes = optarg;
+        break;
+      case 'a':
+        run_args = optarg;
+        break;
+      case 'o':
+        output_filename = optarg;
+        break;
+      case 'n':
+        repeats = strtoul(optarg, NULL, 10);
+        break;
+      case 'k':
+        keep_inputs = true;
+        break;
+      default:
+        usage_error = true;
+        break;
+    }
+  }
+  size_t budget = parse_size(memory_budget.c_str());
+  if (usage_error || budget == 0 || repeats == 0) {
+    printf("Program usage: ./bench/bench [-r run_binary] [-g gensort_binary] [-w work_directory] [-M memory_budget]\n"
+           "    [-d distribution,...] [-x size_multiple_of_budget,...] [-t num_threads,...]\n"
+           "    [-m inplace|indirect|counting,...] [-a \"run options\"]\n"
+           "    [-n repeats] [-k (keep inputs)] [-o output.csv]\n");
+    return 1;
+  }
+
+  FILE *out = output_filename.empty() ? stdout : fopen(output_filename.c_str(), "w");
+  if (out == NULL) {
+    printf("[Error] failed to open output file %s\n", output_filename.c_str());
+    return 1;
+  }
+  mkdir(work_directory.c_str(), 0755);
+  string output_path = work_directory + "/output.data";
+
+  fprintf(out, "distribution,records,bytes,memory_budget,threads,sort_mode,repeat,phase,milliseconds,mb_per_s,peak_rss_kb,"
+               "wrong_tuples\n");
+  fflush(out);
+  bool failed = false;
+  for (const string &dist : split(distributions)) {
+    for (const string &multiple : split(multiples)) {
+      size_t records = strtod(multiple.c_str(), NULL) * budget / RECORD_SIZE;
+      size_t bytes = records * RECORD_SIZE;
+      string input_path = work_directory + "/" + dist + "_" + to_string(records) + ".data";
+
+      struct stat st;
+      if (stat(input_path.c_str(), &st) != 0 || (size_t) st.st_size != bytes) {
+        string command = gensort_binary + " -d " + dist + " " + to_string(records) + " " + input_path;
+        if (system(command.c_str()) != 0) {
+          fprintf(stderr, "[Error] %s failed\n", command.c_str());
+          failed = true;
+          continue;
+        }
+      }
+
+      for (const string &threads : split(thread_counts)) {
+        for (const string &sort_mode : split(sort_modes)) {
+          for (size_t repeat = 0; repeat < repeats; repeat++) {
+            string command = run_binary + " -M " + memory_budget + " -t " + threads + " -m " + sort_mode + " " +
+                             run_args + " " + input_path + " " + output_path;
+            vector<phase_result_t> phases;
+            long long wrong_tuples = -1;
+            if (!run_sort(command, phases, wrong_tuples) || wrong_tuples != 0) {
+              fprintf(stderr, "[Error] %s failed or sorted incorrectly\n", command.c_str());
+              failed = true;
+            }
+            for (const phase_result_t &phase : phases) {
+              double mb_per_s = phase.milliseconds > 0 ? bytes / 1e3 / phase.milliseconds : 0;
+              fprintf(out, "%s,%zu,%zu,%zu,%s,%s,%zu,%s,%lld,%.1f,%zu,%lld\n", dist.c_str(), records, bytes, budget,
+                      threads.c_str(), sort_mode.c_str(), repeat, phase.name.c_str(), phase.milliseconds, mb_per_s,
+                      phase.peak_rss, wrong_tuples);
+            }
+            fflush(out);
+          }
+        }
+      }
+      unlink(output_path.c_str());
+      if (!keep_inputs) {
+        unlink(input_path.c_str());
+      }
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+// Key comparison micro-benchmark: the memcmp comparisons the sort used to make against the normalized
+// integer ones of record_layout (compare, count_pairs), on the default 100 byte, 10 byte key layout.
+// Each test runs on the same records and prints its time and a checksum, which has to agree between the two.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+
+#include "../src/record_layout.h"
+
+typedef record_layout<100, 0, 10, KEY_BYTES> layout_t;
+typedef record<layout_t> record_t;
+
+using namespace std;
+
+static bool memcmp_less(const record_t &a, const record_t &b) {
+  return memcmp(a.key(), b.key(), layout_t::key_length) < 0;
+}
+
+static bool normalized_less(const record_t &a, const record_t &b) {
+  return layout_t::compare(a.key(), b.key()) < 0;
+}
+
+template<class F>
+static void measure(const char *name, F f) {
+  chrono::time_point<chrono::steady_clock> t1 = chrono::steady_clock::now();
+  size_t checksum = f();
+  chrono::time_point<chrono::steady_clock> t2 = chrono::steady_clock::now();
+  printf("%-32s %8lld (milliseconds) checksum %zu\n", name,
+         (long long) chrono::duration_cast<chrono::milliseconds>(t2 - t1).count(), checksum);
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_records = 4000000;
+  size_t distinct = 0;  // Distinct keys, 0 for uniformly random ones
+
+  int opt;
+  bool usage_error = false;
+  while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+    switch (opt) {
+      case 'n':
+        num_records = strtoul(optarg, NULL, 10);
+        break;
+      case 'd':
+        distinct = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage_error = true;
+        break;
+    }
+  }
+  if (usage_error || num_records < 2) {
+    printf("Program usage: ./bench/compare [-n num_records] [-d num_distinct_keys]\n");
+    return 1;
+  }
+
+  vector<record_t> records(num_records);
+  mt19937_64 generator(20191025);
+  for (size_t i = 0; i < num_records; i++) {
+    uint64_t x = distinct > 0 ? generator() % distinct * 0x9e3779b97f4a7c15ULL : generator();
+    memset(records[i].data, 0, sizeof(records[i].data));
+    memcpy(records[i].data, &x, sizeof(x));
+    records[i].data[8] = distinct > 0 ? 0 : (char) generator();
+    records[i].data[9] = distinct > 0 ? 0 : (char) generator();
+  }
+
+  vector<record_t> sorted(records);
+  measure("sort (memcmp)", [&] {
+    sort(sorted.begin(), sorted.end(), memcmp_less);
+    return (size_t) (uint8_t) sorted[num_records / 2].data[0];
+  });
+  sorted = records;
+  measure("sort (normalized)", [&] {
+    sort(sorted.begin(), sorted.end(), normalized_less);
+    return (size_t) (uint8_t) sorted[num_records / 2].data[0];
+  });
+
+  measure("validate (memcmp)", [&] {
+    size_t descents = 0, duplicates = 0;
+    for (size_t i = 1; i < num_records; i++) {
+      int cmp = memcmp(sorted[i - 1].key(), sorted[i].key(), layout_t::key_length);
+      descents += cmp > 0;
+      duplicates += cmp == 0;
+    }
+    return descents * num_records + duplicates;
+  });
+  measure("validate (count_pairs)", [&] {
+    size_t descents, duplicates;
+    layout_t::count_pairs(sorted[0].data, num_records, descents, duplicates);
+    return descents * num_records + duplicates;
+  });
+
+  return 0;
+}
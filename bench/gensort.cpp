@@ -0,0 +1,175 @@
+// Input generator for the benchmark: num_records records of 100 bytes with a 10 byte key, in the layout
+// of gensort (key, two spaces, 32 hex digit record number, two spaces, 52 filler characters, CR LF).
+// The same distribution, seed and record count always produce the same file.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <unistd.h>
+
+#define RECORD_SIZE (100)
+#define KEY_SIZE (10)
+#define RECORDS_PER_WRITE (100000)
+#define ZIPF_UNIVERSE (1 << 20)     // Most distinct keys of the Zipf distribution
+#define NUM_PREFIXES (4)            // Distinct 8 byte prefixes of the shared prefix distribution
+#define NEARLY_DISPLACED (0.1)      // Share of the nearly sorted records that are out of place
+#define NEARLY_DISTANCE (100000)    // Most records a nearly sorted record is displaced by
+
+enum distribution {
+  UNIFORM,   // Random key bytes
+  SORTED,    // Strictly increasing keys
+  REVERSE,   // Strictly decreasing keys
+  EQUAL,     // A single key
+  ZIPF,      // Keys drawn with Zipf-skewed frequencies from ZIPF_UNIVERSE keys
+  PREFIX,    // One of NUM_PREFIXES 8 byte prefixes, random last 2 bytes
+  NEARLY,    // Sorted keys, NEARLY_DISPLACED of them moved by up to NEARLY_DISTANCE records
+};
+
+static const char *distribution_names[] = {"uniform", "sorted", "reverse", "equal", "zipf", "prefix", "nearly"};
+
+static int parse_distribution(const char *name) {
+  for (size_t i = 0; i < sizeof(distribution_names) / sizeof(distribution_names[0]); i++) {
+    if (strcmp(name, distribution_names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void put_be64(unsigned char *key, uint64_t value) {
+  for (int i = 7; i >= 0; i--) {
+    key[i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+// Random bytes derived from a rank, so that ranks map to scattered, distinct keys
+static void hashed_key(unsigned char *key, uint64_t rank) {
+  uint64_t x = rank + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  put_be64(key, x);
+  key[8] = rank >> 8;
+  key[9] = rank;
+}
+
+int main(int argc, char *argv[]) {
+  int dist = UNIFORM;
+  uint64_t seed = 20191022;
+  double skew = 1.0;
+
+  int opt;
+  bool usage_error = false;
+  while ((opt = getopt(argc, argv, "d:s:a:")) != -1) {
+    switch (opt) {
+      case 'd':
+        usage_error |= (dist = parse_distribution(optarg)) == -1;
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'a':
+        skew = strtod(optarg, NULL);
+        break;
+      default:
+        usage_error = true;
+        break;
+    }
+  }
+  if (usage_error || argc - optind < 2) {
+    printf("Program usage: ./gensort [-d uniform|sorted|reverse|equal|zipf|prefix|nearly] [-s seed] [-a zipf_skew] "
+           "num_records output_file_name\n");
+    return 1;
+  }
+  size_t num_records = strtoull(argv[optind], NULL, 10);
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (out == NULL) {
+    printf("[Error] failed to open output file %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  std::mt19937_64 rng(seed);
+
+  // Zipf: cumulative weights 1 / rank^skew, sampled by binary search
+  std::vector<double> zipf_cdf;
+  if (dist == ZIPF) {
+    size_t universe = std::min<size_t>(std::max<size_t>(num_records, 1), ZIPF_UNIVERSE);
+    zipf_cdf.resize(universe);
+    double sum = 0;
+    for (size_t i = 0; i < universe; i++) {
+      sum += 1.0 / pow(i + 1, skew);
+      zipf_cdf[i] = sum;
+    }
+    for (size_t i = 0; i < universe; i++) {
+      zipf_cdf[i] /= sum;
+    }
+  }
+  unsigned char prefixes[NUM_PREFIXES][8];
+  for (size_t i = 0; i < NUM_PREFIXES; i++) {
+    put_be64(prefixes[i], rng());
+  }
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  // Spread sorted and reverse keys over the whole key space
+  uint64_t step = num_records > 0 ? UINT64_MAX / num_records : 0;
+  std::vector<unsigned char> buffer(RECORDS_PER_WRITE * RECORD_SIZE);
+  for (size_t written = 0; written < num_records;) {
+    size_t count = std::min<size_t>(num_records - written, RECORDS_PER_WRITE);
+    for (size_t j = 0; j < count; j++) {
+      size_t i = written + j;
+      unsigned char *record = &buffer[j * RECORD_SIZE];
+      uint64_t random = rng();
+      switch (dist) {
+        case UNIFORM:
+          put_be64(record, random);
+          record[8] = rng();
+          record[9] = rng();
+          break;
+        case SORTED:
+        case REVERSE:
+          put_be64(record, (dist == SORTED ? i : num_records - 1 - i) * step);
+          record[8] = record[9] = 0;
+          break;
+        case EQUAL:
+          memset(record, 'x', KEY_SIZE);
+          break;
+        case ZIPF:
+          hashed_key(record, std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), unit(rng)) - zipf_cdf.begin());
+          break;
+        case NEARLY: {
+          size_t rank = i;
+          if (unit(rng) < NEARLY_DISPLACED) {
+            size_t distance = random % (2 * NEARLY_DISTANCE + 1);
+            rank = i + distance < NEARLY_DISTANCE ? 0 : std::min(i + distance - NEARLY_DISTANCE, num_records - 1);
+          }
+          put_be64(record, rank * step);
+          record[8] = record[9] = 0;
+          break;
+        }
+        case PREFIX:
+          memcpy(record, prefixes[random % NUM_PREFIXES], 8);
+          record[8] = random >> 8;
+          record[9] = random >> 16;
+          break;
+      }
+      char payload[RECORD_SIZE - KEY_SIZE + 1];
+      snprintf(payload, sizeof(payload), "  %032zX  %052d\r\n", i, 0);
+      memset(payload + 36, "0123456789ABCDEF"[i % 16], 52);
+      memcpy(record + KEY_SIZE, payload, RECORD_SIZE - KEY_SIZE);
+    }
+    if (fwrite(buffer.data(), RECORD_SIZE, count, out) != count) {
+      printf("[Error] failed to write output file\n");
+      fclose(out);
+      return 1;
+    }
+    written += count;
+  }
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,243 @@
+#include "arena.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+#ifdef __has_include
+#if __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#define HAVE_MBIND
+#endif
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+
+#define NODE_DIRECTORY ("/sys/devices/system/node/")
+#define MAX_NODES (1024)
+
+namespace arena {
+
+  static const char *page_names[] = {"huge", "thp", "small"};
+  static const char *placement_names[] = {"interleave", "local", "none"};
+
+  // "0-3,8-11" as in the node and cpu lists of sysfs
+  static std::vector<size_t> parse_list(const char *list) {
+    std::vector<size_t> items;
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+      char *end;
+      size_t first = strtoul(p, &end, 10), last = first;
+      if (end == p) {
+        break;
+      }
+      if (*end == '-') {
+        p = end + 1;
+        last = strtoul(p, &end, 10);
+      }
+      for (size_t i = first; i <= last; i++) {
+        items.push_back(i);
+      }
+      p = *end == ',' ? end + 1 : end;
+    }
+    return items;
+  }
+
+  static std::vector<size_t> read_list(const std::string &filename) {
+    std::vector<size_t> items;
+    FILE *f = fopen(filename.c_str(), "r");
+    if (f == NULL) {
+      return items;
+    }
+    char line[4096];
+    if (fgets(line, sizeof(line), f) != NULL) {
+      items = parse_list(line);
+    }
+    fclose(f);
+    return items;
+  }
+
+  static std::vector<size_t> nodes() {
+    return read_list(std::string(NODE_DIRECTORY) + "has_memory");
+  }
+
+  size_t num_nodes() {
+    size_t n = nodes().size();
+    return n > 0 ? n : 1;
+  }
+
+  static char *map(size_t size, int flags) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    return p == MAP_FAILED ? NULL : (char *) p;
+  }
+
+  static bool interleave(char *base, size_t size) {
+#ifdef HAVE_MBIND
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    for (size_t node : nodes()) {
+      if (node < MAX_NODES) {
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+      }
+    }
+    return syscall(SYS_mbind, base, size, MPOL_INTERLEAVE, mask, MAX_NODES, 0) == 0;
+#else
+    (void) base;
+    (void) size;
+    return false;
+#endif
+  }
+
+  bool create(arena_t &arena, size_t size, int pages, int placement, size_t num_threads) {
+    arena.base = NULL;
+    arena.size = size;
+    arena.page_size = IO_BLOCK_SIZE;
+    arena.pages = PAGES_SMALL;
+    arena.placement = num_nodes() > 1 ? placement : NUMA_NONE;
+
+    // Reserved huge pages, the largest first; most systems have none unless configured
+    if (pages == PAGES_HUGE) {
+      size_t sizes[] = {GIGANTIC_PAGE_SIZE, HUGE_PAGE_SIZE};
+      for (size_t i = 0; i < 2 && arena.base == NULL; i++) {
+        if (size < sizes[i] / 2) {
+          continue; // Would waste most of the page
+        }
+        int shift = __builtin_ctzll(sizes[i]);
+        arena.mapped_size = align_up(size, sizes[i]);
+        if ((arena.base = map(arena.mapped_size, MAP_HUGETLB | (shift << MAP_HUGE_SHIFT))) != NULL) {
+          arena.page_size = sizes[i];
+          arena.pages = PAGES_HUGE;
+        }
+      }
+    }
+    if (arena.base == NULL) {
+      arena.mapped_size = pages == PAGES_SMALL ? align_up(size, IO_BLOCK_SIZE) : align_up(size, HUGE_PAGE_SIZE);
+      if ((arena.base = map(arena.mapped_size, 0)) == NULL) {
+        return false;
+      }
+      if (pages != PAGES_SMALL && madvise(arena.base, arena.mapped_size, MADV_HUGEPAGE) == 0) {
+        arena.pages = PAGES_THP;
+      }
+    }
+
+    // The placement only takes effect at the first touch of each page
+    if (arena.placement == NUMA_INTERLEAVE && !interleave(arena.base, arena.mapped_size)) {
+      arena.placement = NUMA_NONE;
+    }
+    if (arena.placement == NUMA_LOCAL) {
+      char *base = arena.base;
+      size_t mapped_size = arena.mapped_size, page_size = arena.page_size;
+      #pragma omp parallel for schedule(static) num_threads(num_threads) \
+          shared(base, mapped_size, page_size) default(none)
+      for (size_t offset = 0; offset < mapped_size; offset += page_size) {
+        base[offset] = 0;
+      }
+    }
+    return true;
+  }
+
+  void destroy(arena_t &arena) {
+    if (arena.base != NULL) {
+      munmap(arena.base, arena.mapped_size);
+      arena.base = NULL;
+    }
+  }
+
+  void print(const arena_t &arena) {
+    printf("[Plan] buffer arena: %zu bytes, %s pages", arena.size, page_names[arena.pages]);
+    if (arena.pages == PAGES_HUGE) {
+      printf(" of %zu MB", arena.page_size >> 20);
+    }
+    printf(", NUMA placement: %s (%zu nodes)\n", placement_names[arena.placement], num_nodes());
+  }
+
+  bool pin_threads(size_t num_threads) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+      return false;
+    }
+
+    // The allowed CPUs of every node, then one of each node in turn
+    std::vector<std::vector<size_t>> node_cpus;
+    for (size_t node : nodes()) {
+      std::vector<size_t> cpus;
+      for (size_t cpu : read_list(std::string(NODE_DIRECTORY) + "node" + std::to_string(node) + "/cpulist")) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      if (!cpus.empty()) {
+        node_cpus.push_back(cpus);
+      }
+    }
+    if (node_cpus.empty()) {
+      std::vector<size_t> cpus;
+      for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+          cpus.push_back(cpu);
+        }
+      }
+      node_cpus.push_back(cpus);
+    }
+    size_t longest = 0;
+    for (const std::vector<size_t> &cpus : node_cpus) {
+      longest = cpus.size() > longest ? cpus.size() : longest;
+    }
+    std::vector<size_t> order;
+    for (size_t i = 0; i < longest; i++) {
+      for (const std::vector<size_t> &cpus : node_cpus) {
+        if (i < cpus.size()) {
+          order.push_back(cpus[i]);
+        }
+      }
+    }
+    if (order.empty()) {
+      return false;
+    }
+
+    bool pinned = true;
+    #pragma omp parallel num_threads(num_threads) shared(order, pinned) default(none)
+    {
+      size_t thread_id = omp_get_thread_num();
+      if (thread_id > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(order[thread_id % order.size()], &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+          #pragma omp atomic write
+          pinned = false;
+        }
+      }
+    }
+    return pinned;
+  }
+
+  int parse_pages(const char *name) {
+    for (int i = 0; i < 3; i++) {
+      if (strcmp(name, page_names[i]) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  int parse_placement(const char *name) {
+    for (int i = 0; i < 3; i++) {
+      if (strcmp(name, placement_names[i]) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+}
@@ -0,0 +1,49 @@
+#ifndef MULTICORE_EXTERNAL_SORT_ARENA_H
+#define MULTICORE_EXTERNAL_SORT_ARENA_H
+
+#include <cstddef>
+#include "global.h"
+
+#define PAGES_HUGE (0)   // MAP_HUGETLB pages (1 GB, then 2 MB), else transparent huge pages, else small pages
+#define PAGES_THP (1)    // Transparent huge pages (madvise), else small pages
+#define PAGES_SMALL (2)
+
+#define NUMA_INTERLEAVE (0)  // Pages spread round-robin over the nodes
+#define NUMA_LOCAL (1)       // Every sort thread first touches its static share, which lands on its node
+#define NUMA_NONE (2)        // Wherever the first touch happens
+
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#define GIGANTIC_PAGE_SIZE ((size_t) 1 << 30)
+
+// The memory budget as one mapping, allocated once in main() and shared by every phase: phase1's run
+// buffers, the merge's chunks and output buffers and the validator all live in it (param.buffer).
+// Huge pages keep the radix permutation's scattered writes from thrashing the TLB, and on a multi-socket
+// machine the pages are placed so that no single node serves all the sort threads.
+namespace arena {
+  typedef struct arena {
+    char *base;         // size bytes, IO_BLOCK_SIZE aligned
+    size_t size;
+    size_t mapped_size; // size rounded up to the page size
+    size_t page_size;   // Of the mapping, 4096 unless MAP_HUGETLB pages were had
+    int pages;          // What was had, not what was asked for: PAGES_*
+    int placement;      // NUMA_*, NUMA_NONE on a single node
+  } arena_t;
+
+  // Returns false if not even small pages could be mapped. With NUMA_LOCAL, num_threads OpenMP threads
+  // fault the pages in, so pin_threads() should come first.
+  bool create(arena_t &arena, size_t size, int pages, int placement, size_t num_threads);
+  void destroy(arena_t &arena);
+  void print(const arena_t &arena);
+
+  // NUMA nodes with memory, 1 without NUMA
+  size_t num_nodes();
+  // Pins the worker threads of the calling thread's OpenMP teams one per CPU, taking the nodes in turn.
+  // The calling thread itself stays unpinned, as do the threads it starts later, e.g. phase1's reader
+  // and writer. Returns false if the CPUs couldn't be found or set.
+  bool pin_threads(size_t num_threads);
+
+  int parse_pages(const char *name);
+  int parse_placement(const char *name);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_ARENA_H
@@ -0,0 +1,364 @@
+#include "async_io.h"
+#include "bounded_queue.h"
+#include "telemetry.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>) && !defined(DISABLE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define RING_MAX_TRANSFER ((size_t) 1 << 30)  // Longer pieces are issued in several transfers
+
+namespace io {
+
+  // The whole request as a single piece, for the engines that go through read_fully/write_fully
+  static void whole(async_request_t &request, int fd, size_t size, size_t offset) {
+    request.num_pieces = 1;
+    request.pieces[0].fd = fd;
+    request.pieces[0].buffer_offset = 0;
+    request.pieces[0].size = size;
+    request.pieces[0].offset = offset;
+  }
+
+  static void execute(async_request_t &request) {
+    const piece_t &p = request.pieces[0];
+    if (request.write) {
+      request.transferred[0] = write_fully(p.fd, request.buffer, p.size, p.offset) ? p.size : 0;
+    } else {
+      request.transferred[0] = read_fully(p.fd, request.buffer, p.size, p.offset);
+    }
+  }
+
+  // Bytes transferred up to the first piece that came up short
+  static size_t result(const async_request_t &request) {
+    size_t done = 0;
+    for (size_t i = 0; i < request.num_pieces; i++) {
+      done += request.transferred[i];
+      if (request.transferred[i] < request.pieces[i].size) {
+        break;
+      }
+    }
+    return done;
+  }
+
+  /// Thread engine: workers take whole requests off a bounded queue of `depth` entries.
+  struct async_pool {
+    explicit async_pool(size_t depth) : requests(depth) {}
+
+    bounded_queue<async_request_t *> requests;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable completed;
+  };
+
+  static void work(async_pool *pool) {
+    telemetry::name_thread("io");
+    async_request_t *request;
+    while (pool->requests.pop(request)) {
+      execute(*request);
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      request->complete = true;
+      pool->completed.notify_all();
+    }
+  }
+
+  static async_pool *create_pool(size_t depth) {
+    async_pool *pool = new async_pool(depth);
+    size_t num_threads = depth < ASYNC_IO_WORKERS ? depth : ASYNC_IO_WORKERS;
+    for (size_t i = 0; i < num_threads; i++) {
+      pool->threads.push_back(std::thread(work, pool));
+    }
+    return pool;
+  }
+
+  static void destroy_pool(async_pool *pool) {
+    pool->requests.close();
+    for (size_t i = 0; i < pool->threads.size(); i++) {
+      pool->threads[i].join();
+    }
+    delete pool;
+  }
+
+  /// io_uring engine, through the raw system calls. Every piece of a request is one submission;
+  /// user_data is the request address with the piece index in its low bits.
+  struct async_ring {
+    int fd;
+    size_t in_flight;  // Requests submitted and not complete yet
+#ifdef HAVE_IO_URING
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+#endif
+  };
+
+#ifdef HAVE_IO_URING
+  static int ring_enter(async_ring *ring, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+      ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      perror("[Error] io_uring_enter");
+    }
+    return ret;
+  }
+
+  static void destroy_ring(async_ring *ring) {
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    delete ring;
+  }
+
+  static async_ring *create_ring(size_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+      return NULL;
+    }
+
+    async_ring *ring = new async_ring;
+    ring->fd = fd;
+    ring->in_flight = 0;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      ring->sq_ring_size = ring->cq_ring_size = std::max(ring->sq_ring_size, ring->cq_ring_size);
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = single_mmap ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    // IORING_OP_READ/WRITE came with the same kernel (5.6) as IORING_FEAT_RW_CUR_POS
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED ||
+        !(params.features & IORING_FEAT_RW_CUR_POS)) {
+      destroy_ring(ring);
+      return NULL;
+    }
+
+    char *sq = (char *) ring->sq_ring;
+    char *cq = (char *) ring->cq_ring;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return ring;
+  }
+
+  // Queue the rest of a piece; submitted by the next ring_enter()
+  static void prepare(async_ring *ring, async_request_t &request, size_t i) {
+    const piece_t &p = request.pieces[i];
+    size_t done = request.transferred[i];
+    size_t remaining = p.size - done;
+
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = p.fd;
+    sqe->addr = (uint64_t) (uintptr_t) (request.buffer + p.buffer_offset + done);
+    sqe->len = remaining < RING_MAX_TRANSFER ? remaining : RING_MAX_TRANSFER;
+    sqe->off = p.offset + done;
+    sqe->user_data = (uint64_t) (uintptr_t) &request | i;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  // Handle every completion there is, waiting for at least one if `block`.
+  // Short transfers are continued; a piece ends when it's whole, at the end of the file or on an error.
+  static void reap(async_ring *ring, bool block) {
+    for (;;) {
+      unsigned head = *ring->cq_head;
+      unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        if (!block || ring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+          return;
+        }
+        continue;
+      }
+
+      unsigned resubmitted = 0;
+      for (; head != tail; head++) {
+        const struct io_uring_cqe &cqe = ring->cqes[head & *ring->cq_mask];
+        async_request_t &request = *(async_request_t *) (uintptr_t) (cqe.user_data & ~(uint64_t) 3);
+        size_t i = cqe.user_data & 3;
+        if (cqe.res > 0) {
+          request.transferred[i] += cqe.res;
+          telemetry::add(request.write ? telemetry::BYTES_WRITTEN : telemetry::BYTES_READ, cqe.res);
+        }
+        if ((cqe.res > 0 && request.transferred[i] < request.pieces[i].size) || cqe.res == -EAGAIN) {
+          prepare(ring, request, i);
+          resubmitted++;
+          continue;
+        }
+        if (cqe.res < 0) {
+          printf("[Error] async %s failed: %s\n", request.write ? "write" : "read", strerror(-cqe.res));
+        }
+        if (--request.pending == 0) {
+          request.complete = true;
+          ring->in_flight--;
+        }
+      }
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+      if (resubmitted > 0) {
+        ring_enter(ring, resubmitted, 0, 0);
+      }
+      return;
+    }
+  }
+#else
+  static async_ring *create_ring(size_t) {
+    return NULL;
+  }
+
+  static void destroy_ring(async_ring *ring) {
+    delete ring;
+  }
+
+  static void prepare(async_ring *, async_request_t &, size_t) {}
+
+  static int ring_enter(async_ring *, unsigned, unsigned, unsigned) {
+    return -1;
+  }
+
+  static void reap(async_ring *, bool) {}
+#endif
+
+  async_queue::async_queue(size_t depth) : depth(depth), uring(NULL), workers(NULL) {
+    if (depth == 0) {
+      return;
+    }
+    if ((uring = create_ring(depth * IO_MAX_PIECES)) == NULL) {
+      workers = create_pool(depth);
+    }
+  }
+
+  async_queue::~async_queue() {
+    if (uring != NULL) {
+      while (uring->in_flight > 0) {
+        reap(uring, true);
+      }
+      destroy_ring(uring);
+    }
+    if (workers != NULL) {
+      destroy_pool(workers);
+    }
+  }
+
+  void async_queue::read(async_request_t &request, int fd, char *buffer, size_t size, size_t offset) {
+    submit(request, fd, buffer, size, offset, false);
+  }
+
+  void async_queue::write(async_request_t &request, int fd, const char *buffer, size_t size, size_t offset) {
+    // Only ever read from for a write
+    submit(request, fd, const_cast<char *>(buffer), size, offset, true);
+  }
+
+  void async_queue::submit(async_request_t &request, int fd, char *buffer, size_t size, size_t offset, bool write) {
+    request.buffer = buffer;
+    request.write = write;
+    request.complete = false;
+    for (size_t i = 0; i < IO_MAX_PIECES; i++) {
+      request.transferred[i] = 0;
+    }
+
+    // Mapped files are copied by the thread engine, or right away by the others.
+    // Streams have no offsets, so their requests are done right away, in order.
+    request.num_pieces = uring != NULL && size > 0 ? split_request(fd, buffer, size, offset, request.pieces) : 0;
+    if (request.num_pieces == 0) {
+      whole(request, fd, size, offset);
+      if (workers != NULL && size > 0 && !is_stream(fd)) {
+        workers->requests.push(&request);
+      } else {
+        execute(request);
+        request.complete = true;
+      }
+      return;
+    }
+
+    if (uring->in_flight >= depth) {
+      telemetry::scoped_timer timer(telemetry::IO_NS);
+      while (uring->in_flight >= depth) {
+        reap(uring, true);
+      }
+    }
+    for (size_t i = 0; i < request.num_pieces; i++) {
+      prepare(uring, request, i);
+    }
+    request.pending = request.num_pieces;
+    uring->in_flight++;
+    ring_enter(uring, request.num_pieces, 0, 0);
+  }
+
+  size_t async_queue::wait(async_request_t &request) {
+    telemetry::scoped_timer timer(telemetry::IO_NS);
+    if (uring != NULL) {
+      while (!request.complete) {
+        reap(uring, true);
+      }
+    } else if (workers != NULL) {
+      std::unique_lock<std::mutex> lock(workers->mutex);
+      workers->completed.wait(lock, [&request] { return request.complete; });
+    }
+    return result(request);
+  }
+
+  const char *async_engine(size_t depth) {
+    if (depth == 0) {
+      return "sync";
+    }
+    // Probed once, with the same kind of ring a queue sets up
+    static const bool has_io_uring = [] {
+      async_ring *ring = create_ring(IO_MAX_PIECES);
+      if (ring == NULL) {
+        return false;
+      }
+      destroy_ring(ring);
+      return true;
+    }();
+    return has_io_uring ? "io_uring" : "threads";
+  }
+
+}
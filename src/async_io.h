@@ -0,0 +1,55 @@
+#ifndef MULTICORE_EXTERNAL_SORT_ASYNC_IO_H
+#define MULTICORE_EXTERNAL_SORT_ASYNC_IO_H
+
+#include <cstddef>
+#include "global.h"
+#include "io_backend.h"
+
+#define IO_QUEUE_DEPTH (64)   // Default number of requests in flight per queue, overridden with -q
+#define ASYNC_IO_WORKERS (4)  // Most threads of the fallback engine per queue
+
+namespace io {
+  // A read or write in flight. Must stay in place from submission until wait() returns.
+  typedef struct async_request {
+    char *buffer;
+    bool write;
+    bool complete;
+    size_t num_pieces;
+    size_t pending;  // Pieces still in flight
+    piece_t pieces[IO_MAX_PIECES];
+    size_t transferred[IO_MAX_PIECES];
+  } async_request_t;
+
+  struct async_ring;
+  struct async_pool;
+
+  // Queue of asynchronous reads and writes through the io backends, for overlapping the merge
+  // with its I/O. Uses io_uring when the kernel has it, a few worker threads otherwise, and does
+  // everything synchronously on submission with a depth of 0. A queue is used by one thread.
+  class async_queue {
+  public:
+    explicit async_queue(size_t depth);
+    // Waits for every request still in flight
+    ~async_queue();
+    async_queue(const async_queue &) = delete;
+    async_queue &operator=(const async_queue &) = delete;
+
+    // Blocks while `depth` requests are in flight
+    void read(async_request_t &request, int fd, char *buffer, size_t size, size_t offset);
+    void write(async_request_t &request, int fd, const char *buffer, size_t size, size_t offset);
+    // Returns the number of bytes transferred, less than requested at the end of the file or on error
+    size_t wait(async_request_t &request);
+
+  private:
+    size_t depth;
+    async_ring *uring;    // NULL unless the io_uring engine is used
+    async_pool *workers;  // NULL unless the thread engine is used
+
+    void submit(async_request_t &request, int fd, char *buffer, size_t size, size_t offset, bool write);
+  };
+
+  // Name of the engine a queue of this depth uses: "io_uring", "threads" or "sync"
+  const char *async_engine(size_t depth);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_ASYNC_IO_H
@@ -0,0 +1,51 @@
+#ifndef MULTICORE_EXTERNAL_SORT_BOUNDED_QUEUE_H
+#define MULTICORE_EXTERNAL_SORT_BOUNDED_QUEUE_H
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// Blocking FIFO with a fixed capacity, used to hand buffers between pipeline stages.
+// push() blocks while full; pop() blocks while empty and returns false once closed and drained.
+template<typename T>
+class bounded_queue {
+public:
+  explicit bounded_queue(size_t capacity) : capacity(capacity), closed(false) {}
+
+  void push(const T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return items.size() < capacity; });
+    items.push_back(item);
+    not_empty.notify_one();
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return !items.empty() || closed; });
+    if (items.empty()) {
+      return false;
+    }
+    item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  // No more pushes; wakes up every consumer.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+};
+
+#endif //MULTICORE_EXTERNAL_SORT_BOUNDED_QUEUE_H
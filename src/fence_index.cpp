@@ -0,0 +1,173 @@
+#include "fence_index.h"
+#include "io_backend.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/stat.h>
+
+namespace fence {
+
+  typedef struct header {
+    uint64_t magic;
+    uint64_t num_records;
+    uint64_t interval;
+    uint64_t record_size;
+    uint64_t key_offset;
+    uint64_t key_length;
+    uint64_t sum_records;
+    uint64_t sum_low;
+    uint64_t sum_high;
+    uint64_t file_size;      // Of the indexed file as the index was written, which it is only good for
+    uint64_t file_mtime_ns;
+  } header_t;
+
+  // Size and modification time of the indexed file, false if it can't be looked at
+  static bool identify(const std::string &filename, uint64_t &file_size, uint64_t &file_mtime_ns) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+      return false;
+    }
+    file_size = st.st_size;
+    file_mtime_ns = (uint64_t) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    return true;
+  }
+
+  void init(index_t &index, const layout_engine_t *engine, size_t interval) {
+    index.num_records = 0;
+    index.interval = interval;
+    index.record_size = engine->record_size;
+    index.keys.clear();
+    memset(&index.sum, 0, sizeof(index.sum));
+  }
+
+  static void push_key(index_t &index, const layout_engine_t *engine, const char *key) {
+    index.keys.resize(index.keys.size() + index.record_size, 0);
+    memcpy(index.keys.data() + index.keys.size() - index.record_size + engine->key_offset, key, engine->key_length);
+  }
+
+  void add(index_t &index, const layout_engine_t *engine, const char *records, size_t num_records) {
+    size_t record_size = engine->record_size;
+    // The first fence at or after the records
+    size_t next = (index.num_records + index.interval - 1) / index.interval * index.interval;
+    for (; next < index.num_records + num_records; next += index.interval) {
+      push_key(index, engine, records + (next - index.num_records) * record_size + engine->key_offset);
+    }
+    index.num_records += num_records;
+  }
+
+  void truncate(index_t &index, size_t num_records) {
+    if (num_records < index.num_records) {
+      index.keys.resize((num_records + index.interval - 1) / index.interval * index.record_size);
+      index.num_records = num_records;
+      memset(&index.sum, 0, sizeof(index.sum)); // That of the whole file
+    }
+  }
+
+  bool write(const index_t &index, const layout_engine_t *engine, const std::string &filename) {
+    header_t h = {FENCE_MAGIC, index.num_records, index.interval, engine->record_size, engine->key_offset,
+                  engine->key_length, index.sum.records, index.sum.low, index.sum.high, 0, 0};
+    if (!identify(filename, h.file_size, h.file_mtime_ns)) {
+      return false;
+    }
+    FILE *f = fopen((filename + FENCE_SUFFIX).c_str(), "wb");
+    if (f == NULL) {
+      return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t j = 0; ok && j < size(index); j++) {
+      ok = fwrite(slot(index, j) + engine->key_offset, engine->key_length, 1, f) == 1;
+    }
+    return fclose(f) == 0 && ok;
+  }
+
+  bool read(index_t &index, const layout_engine_t *engine, const std::string &filename, size_t num_records) {
+    uint64_t file_size, file_mtime_ns;
+    if (!identify(filename, file_size, file_mtime_ns)) {
+      return false;
+    }
+    FILE *f = fopen((filename + FENCE_SUFFIX).c_str(), "rb");
+    if (f == NULL) {
+      return false;
+    }
+    header_t h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && h.magic == FENCE_MAGIC && h.num_records == num_records &&
+              h.interval > 0 && h.record_size == engine->record_size && h.key_offset == engine->key_offset &&
+              h.key_length == engine->key_length && h.file_size == file_size && h.file_mtime_ns == file_mtime_ns;
+    if (ok) {
+      init(index, engine, h.interval);
+      char key[engine->key_length];
+      size_t num_fences = (num_records + h.interval - 1) / h.interval;
+      for (size_t j = 0; ok && j < num_fences; j++) {
+        if ((ok = fread(key, engine->key_length, 1, f) == 1)) {
+          push_key(index, engine, key);
+        }
+      }
+      index.num_records = num_records;
+      index.sum.records = h.sum_records;
+      index.sum.low = h.sum_low;
+      index.sum.high = h.sum_high;
+    }
+    fclose(f);
+    return ok;
+  }
+
+  bool sample(int fd, size_t file_size, const layout_engine_t *engine, size_t interval, index_t &index) {
+    init(index, engine, interval);
+    size_t num_records = file_size / engine->record_size;
+    char key[engine->key_length];
+    for (size_t i = 0; i < num_records; i += interval) {
+      size_t offset = i * engine->record_size + engine->key_offset;
+      if (io::read_fully(fd, key, engine->key_length, offset) != engine->key_length) {
+        return false;
+      }
+      push_key(index, engine, key);
+    }
+    index.num_records = num_records;
+    return true;
+  }
+
+  bool rank(int fd, const index_t &index, const layout_engine_t *engine, const char *record, bool upper,
+            char *scratch, size_t &position) {
+    // Fences ordering before the key (upper: not after it); the answer lies in the interval below the next
+    size_t low = 0, high = size(index);
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      int c = engine->compare(slot(index, mid), record);
+      if (c < 0 || (upper && c == 0)) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low == 0) {
+      position = 0;
+      return true;
+    }
+
+    // Record (low - 1) * interval is counted; the ones up to the next fence have to be read
+    size_t first = (low - 1) * index.interval + 1;
+    size_t last = low * index.interval < index.num_records ? low * index.interval : index.num_records;
+    size_t record_size = engine->record_size;
+    if (first < last) {
+      size_t bytes = (last - first) * record_size;
+      if (io::read_fully(fd, scratch, bytes, first * record_size) != bytes) {
+        return false;
+      }
+    }
+    low = 0;
+    high = last > first ? last - first : 0;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      int c = engine->compare(scratch + mid * record_size, record);
+      if (c < 0 || (upper && c == 0)) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    position = first + low;
+    return true;
+  }
+
+}
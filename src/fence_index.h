@@ -0,0 +1,54 @@
+#ifndef MULTICORE_EXTERNAL_SORT_FENCE_INDEX_H
+#define MULTICORE_EXTERNAL_SORT_FENCE_INDEX_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "global.h"
+#include "layout_engine.h"
+
+#define FENCE_INTERVAL (1024)      // Records between the fence keys of a run
+#define FENCE_SUFFIX (".fence")    // Of the index file next to a run file
+#define FENCE_MAGIC (0x3265636e6546ULL)
+
+// Sparse indexes of sorted files: the key of every interval-th record, so that the position of any key
+// can be found by a search of the fences and one read of the interval it falls in. Phase1 writes one
+// next to each run file as the run is written; files without one are sampled instead. The index of a
+// sorted output (-F) also holds the output's checksum, so that it can be appended to (-a) without a
+// read of the whole file.
+namespace fence {
+  typedef struct fence_index {
+    size_t num_records;      // Of the file
+    size_t interval;         // Fence j is the key of record j * interval
+    size_t record_size;
+    std::vector<char> keys;  // A record-sized slot per fence, holding the key at its key offset, the rest zero
+    record_sum_t sum;        // Of the file's records, if sum.records == num_records
+  } index_t;
+
+  void init(index_t &index, const layout_engine_t *engine, size_t interval);
+  // Takes the fences among the next num_records records of the file
+  void add(index_t &index, const layout_engine_t *engine, const char *records, size_t num_records);
+  // Drops the fences of all but the first num_records records, to index only that prefix of the file
+  void truncate(index_t &index, size_t num_records);
+  inline size_t size(const index_t &index) {
+    return index.keys.size() / index.record_size;
+  }
+  inline const char *slot(const index_t &index, size_t j) {
+    return index.keys.data() + j * index.record_size;
+  }
+
+  // Writes the index of the file filename, once that is written, next to it (filename + FENCE_SUFFIX)
+  bool write(const index_t &index, const layout_engine_t *engine, const std::string &filename);
+  // Returns false if the file filename has no index next to it, or it was made for another layout, or
+  // the file was written again since (its size or modification time changed)
+  bool read(index_t &index, const layout_engine_t *engine, const std::string &filename, size_t num_records);
+  // Builds the index of a sorted file that has none by reading its keys one by one
+  bool sample(int fd, size_t file_size, const layout_engine_t *engine, size_t interval, index_t &index);
+
+  // The number of records of fd whose keys order before (upper: not after) the key of record, reading
+  // at most one interval of records into scratch. Returns false on a read error.
+  bool rank(int fd, const index_t &index, const layout_engine_t *engine, const char *record, bool upper,
+            char *scratch, size_t &position);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_FENCE_INDEX_H
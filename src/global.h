@@ -6,61 +6,104 @@
 #define MULTICORE_EXTERNAL_SORT_GLOBAL_H
 
 #include <cstring>
+#include <cstdint>
+#include "record_layout.h"
 
-#define MAX_BUFFER (1800000000)
-#define NUM_THREADS (40)
+#define MAX_BUFFER (1800000000)  // Default memory budget, overridden with -M
 
 #define TUPLE_SIZE (100)
 #define KEY_SIZE (10)
-#define READ_BUFFER_SIZE (1000000000)  // 1GB
-#define WRITE_BUFFER_SIZE (500000000)
+#define MIN_MERGE_CHUNK (4000000)  // Smallest run read worth issuing in the merge; bounds the fan-in
 
-#define NUM_BUCKETS (256)
-
-#define TMP_DIRECTORY ("./tmp/")
-#define TMP_FILE_SUFFIX (".data")
-
-typedef struct tuple {
-  char data[100];
+#define CACHE_LINE_SIZE (64)
+#define IO_BLOCK_SIZE (4096)  // Alignment of O_DIRECT buffers, offsets and lengths
+#define IO_UNIT (102400)      // Smallest size that is a whole number of both tuples and I/O blocks
 
-  bool operator<(const struct tuple &op) const {
-    return memcmp(data, &op, KEY_SIZE) < 0;
-  }
+#define NUM_BUCKETS (256)
+#define PARALLEL_PARTITION_THRESHOLD (100000)  // Fewer records than this are partitioned by one thread
+#define TASK_CUTOFF (16384)  // Smaller radix sort partitions are sorted by the task that made them, not as tasks
+#define SMALL_SORT_THRESHOLD (64)  // Fewer records than this are insertion sorted on their normalized keys
 
-  bool operator>(const struct tuple &op) const {
-    return memcmp(data, &op, KEY_SIZE) > 0;
-  }
-} tuple_t;
+#define NUM_PIPELINE_BUFFERS (3)  // Run buffers shared by the phase1 read/sort/write stages
+#define GATHER_BUFFER_SIZE (16384000)  // Staging buffer for writing an indirectly sorted run
 
-typedef struct tuple_key {
-  char key[10];
+#define SAMPLE_OVERSAMPLING (64)  // Sampled keys per key range when choosing splitters
+#define SAMPLE_SEED (20191014)
 
-  bool operator<(const struct tuple_key &op) const {
-    return memcmp(key, &op, KEY_SIZE) < 0;
-  }
+#define SORT_IN_PLACE (0)  // Radix sort moves whole tuples at every level
+#define SORT_INDIRECT (1)  // Radix sort (key, index) entries, then gather the tuples once
+#define SORT_COUNTING (2)  // Partition by sampled splitters (counting sort), then radix sort each bucket
 
-  bool operator>(const struct tuple_key &op) const {
-    return memcmp(key, &op, KEY_SIZE) > 0;
-  }
+#define RUN_AUTO (0)         // Replacement selection if a sample finds the input nearly sorted, else RUN_RADIX
+#define RUN_RADIX (1)        // Radix sorted run buffers; sorted ones pass through and extend the run before them
+#define RUN_REPLACEMENT (2)  // Replacement selection, runs of about twice the memory budget or longer
 
-  bool operator==(const struct tuple_key &op) const {
-    return memcmp(key, &op, KEY_SIZE) == 0;
-  }
+#define TMP_DIRECTORY ("./tmp/")  // Default temporary directory, replaced by a list with -d
+#define TMP_FILE_SUFFIX (".data")
 
-  bool operator!=(const struct tuple_key &op) const {
-    return memcmp(key, &op, KEY_SIZE) != 0;
-  }
-} tuple_key_t;
+// The default layout, that of the sort benchmark: 100 byte tuples led by a 10 byte key.
+// Other layouts (-l) use the same templates, see record_layout.h.
+typedef record_layout<TUPLE_SIZE, 0, KEY_SIZE, KEY_BYTES> tuple_layout_t;
+typedef record<tuple_layout_t> tuple_t;
+typedef record_key<tuple_layout_t> tuple_key_t;
+typedef record_ref<tuple_layout_t> tuple_ref_t;
+
+static inline size_t align_up(size_t size, size_t unit) {
+  return (size + unit - 1) / unit * unit;
+}
+
+// A tuple key as one unsigned integer: its first 8 bytes byte-swapped, followed by the other 2
+static inline normalized_key_t normalize_key(const void *key) {
+  return tuple_layout_t::normalize(static_cast<const char *>(key));
+}
+
+// Order independent checksum of a set of records, valsort's: the 128-bit sum of their CRC-32s
+typedef struct record_sum {
+  size_t records;
+  uint64_t low;
+  uint64_t high;
+} record_sum_t;
 
 typedef struct param {
   int input_fd;
   int output_fd;
-  size_t file_size;
+  size_t file_size;      // Unknown until phase1 has read all of a streamed input
+  bool streaming;        // Input is a pipe or stdin, read until it ends
   size_t num_partitions;
   size_t num_tuples;
+  size_t memory_budget;
+  size_t num_threads;
+  size_t num_buffers;
+  int io_backend;
+  size_t queue_depth;    // Merge reads and writes in flight at once, 0 for synchronous I/O
+  // Filled in by planner::plan()
+  bool in_memory;
+  size_t run_size;
+  size_t merge_buffer_size;
+  size_t output_buffer_size;
+  size_t fan_in;
+  size_t merge_passes;
+  size_t merge_workers;
+  bool compress;         // Write runs as compressed blocks
+  size_t block_size;     // Tuple bytes per compressed block, fits a merge read chunk
+  int sort_mode;
+  int run_mode;          // RUN_*, how phase1 generates runs
+  size_t num_ranges;     // Sample sort key ranges, 0 or 1 for a single global merge
   tuple_key_t *thresholds;
-  char *buffer;
-  tuple_key_t *sorted_keys;
+  size_t *segments;      // Key range boundaries of each run, num_partitions x (num_ranges + 1) byte offsets
+  struct run_blocks *run_blocks;  // Block index of each compressed run, NULL unless compress
+  const struct layout_engine *engine;  // Record layout and the sort and merge code compiled for it
+  char *buffer;          // memory_budget bytes, shared by all phases
+  const char **tmp_directories;  // Run files are striped over these, see run_filename()
+  size_t num_tmp_directories;
+  record_sum_t input_sum;  // Of the records read, taken before they are sorted
+  const char *base_filename;  // Sorted file the input is merged into (-a), NULL to sort the input alone
+  int base_fd;
+  size_t base_size;
+  size_t top_k;          // Only the top_k smallest records are output (-k), 0 for all of them
+  bool heap_select;      // The top_k records fit the memory budget, so they are selected by a heap in one pass
+  size_t num_outputs;    // Key-range output files (-P), 0 for a single output file
+  int *output_fds;       // Of the key-range files, NULL unless num_outputs
 } param_t;
 
 typedef struct section {
@@ -68,5 +111,12 @@ typedef struct section {
   size_t tail;
 } section_t;
 
+// Block index of a compressed run file
+typedef struct run_blocks {
+  size_t num_blocks;
+  size_t *raw_offsets;   // num_blocks + 1 offsets into the sorted run
+  size_t *file_offsets;  // num_blocks + 1 offsets into the run file
+} run_blocks_t;
+
 
 #endif //MULTICORE_EXTERNAL_SORT_GLOBAL_H
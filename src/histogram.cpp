@@ -0,0 +1,46 @@
+#include "histogram.h"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace histogram {
+
+  size_t row_size(size_t num_buckets) {
+    const size_t per_line = CACHE_LINE_SIZE / sizeof(size_t);
+    return (num_buckets + per_line - 1) / per_line * per_line;
+  }
+
+  size_t *allocate(size_t num_threads, size_t num_buckets) {
+    void *counts;
+    size_t size = sizeof(size_t) * row_size(num_buckets) * num_threads;
+    if (posix_memalign(&counts, CACHE_LINE_SIZE, size) != 0) {
+      return NULL;
+    }
+    memset(counts, 0, size);
+    return (size_t *) counts;
+  }
+
+  void release(size_t *counts) {
+    free(counts);
+  }
+
+  void prefix_sum(const size_t *counts, size_t num_threads, size_t num_buckets,
+                  size_t *totals, section_t *g, section_t *p) {
+    size_t stride = row_size(num_buckets);
+    size_t sum = 0;
+    for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
+      g[bucket_id].head = sum;
+      for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
+        size_t count = counts[thread_id * stride + bucket_id];
+        if (p != NULL) {
+          p[bucket_id * num_threads + thread_id].head = sum;
+          p[bucket_id * num_threads + thread_id].tail = sum + count;
+        }
+        sum += count;
+      }
+      g[bucket_id].tail = sum;
+      totals[bucket_id] = sum - g[bucket_id].head;
+    }
+  }
+
+}
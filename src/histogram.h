@@ -0,0 +1,22 @@
+#ifndef MULTICORE_EXTERNAL_SORT_HISTOGRAM_H
+#define MULTICORE_EXTERNAL_SORT_HISTOGRAM_H
+
+#include <cstddef>
+#include "global.h"
+
+// Thread-local bucket counters. Each thread owns one row of counts, padded and aligned
+// to whole cache lines, so building a histogram needs neither atomics nor shared lines.
+namespace histogram {
+  // Zeroed num_threads x num_buckets counters; row t starts at counts + t * row_size(num_buckets).
+  size_t *allocate(size_t num_threads, size_t num_buckets);
+  void release(size_t *counts);
+  size_t row_size(size_t num_buckets);
+
+  // Merge the rows by a prefix sum. totals[b] receives the size of bucket b and g[b] its [head, tail).
+  // If p is given, p[b * num_threads + t] receives the sub-range of bucket b sized by thread t's own
+  // count, i.e. where thread t would scatter its records of bucket b.
+  void prefix_sum(const size_t *counts, size_t num_threads, size_t num_buckets,
+                  size_t *totals, section_t *g, section_t *p);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_HISTOGRAM_H
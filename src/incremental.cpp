@@ -0,0 +1,63 @@
+#include "incremental.h"
+#include "io_backend.h"
+
+#include <algorithm>
+
+namespace incremental {
+
+  // Appends a merged span, extending the one before if that is merged too and they meet
+  static void push_merge(std::vector<span_t> &spans, size_t base_head, size_t base_tail, size_t added_head,
+                         size_t added_tail) {
+    if (!spans.empty() && spans.back().added_head != spans.back().added_tail &&
+        spans.back().base_tail == base_head && spans.back().added_tail == added_head) {
+      spans.back().base_tail = base_tail;
+      spans.back().added_tail = added_tail;
+    } else {
+      spans.push_back({base_head, base_tail, added_head, added_tail});
+    }
+  }
+
+  bool plan_spans(int base_fd, const fence::index_t &base, int added_fd, const fence::index_t &added,
+                  const layout_engine_t *engine, size_t min_copy, char *scratch, std::vector<span_t> &spans) {
+    size_t record_size = engine->record_size;
+    size_t min_copy_records = (min_copy + record_size - 1) / record_size;
+    std::vector<char> last(record_size);
+    spans.clear();
+
+    // The new records a fence interval at a time: the base records from before the first of them up to
+    // the last of them are merged with them, and the ones up to the next interval are copied if enough
+    size_t position = 0; // Of the base, up to which the spans go
+    for (size_t k = 0; k < fence::size(added); k++) {
+      size_t first = k * added.interval;
+      size_t end = std::min(first + added.interval, added.num_records);
+      if (io::read_fully(added_fd, last.data(), record_size, (end - 1) * record_size) != record_size) {
+        return false;
+      }
+      size_t lower, upper;
+      if (!fence::rank(base_fd, base, engine, fence::slot(added, k), false, scratch, lower) ||
+          !fence::rank(base_fd, base, engine, last.data(), true, scratch, upper)) {
+        return false;
+      }
+      lower = std::max(lower, position);
+      upper = std::max(upper, lower);
+      if (lower - position >= min_copy_records) {
+        spans.push_back({position * record_size, lower * record_size, 0, 0});
+        position = lower;
+      }
+      push_merge(spans, position * record_size, upper * record_size, first * record_size, end * record_size);
+      position = upper;
+    }
+
+    // The rest of the base, copied unless it is too little to be worth a span of its own
+    if (position < base.num_records) {
+      if (base.num_records - position < min_copy_records && !spans.empty() &&
+          spans.back().added_head != spans.back().added_tail) {
+        spans.back().base_tail = base.num_records * record_size;
+      } else {
+        spans.push_back({position * record_size, base.num_records * record_size, 0, 0});
+      }
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,33 @@
+#ifndef MULTICORE_EXTERNAL_SORT_INCREMENTAL_H
+#define MULTICORE_EXTERNAL_SORT_INCREMENTAL_H
+
+#include <cstddef>
+#include <vector>
+#include "global.h"
+#include "layout_engine.h"
+#include "fence_index.h"
+
+#define APPEND_MIN_COPY (4096000)  // Smallest stretch of the base file copied rather than merged
+
+// Appending (-a): the sorted new records are merged into a sorted base file that is much larger. With the
+// base's fence index, the merge is cut where the new records fall: the stretches of the base that no
+// new record falls into are copied to the output in blocks, without a comparison, and only the rest is
+// merged record by record.
+namespace incremental {
+  // Byte ranges of the base file and of the sorted new records that make up one stretch of the output;
+  // one that takes no new records is copied
+  typedef struct span {
+    size_t base_head;
+    size_t base_tail;
+    size_t added_head;
+    size_t added_tail;
+  } span_t;
+
+  // Cuts the merge of base_fd, indexed by base, with added_fd, indexed by added, into spans of the output
+  // in order. Copied spans are at least min_copy bytes. scratch holds a fence interval of the base.
+  // Returns false on a read error.
+  bool plan_spans(int base_fd, const fence::index_t &base, int added_fd, const fence::index_t &added,
+                  const layout_engine_t *engine, size_t min_copy, char *scratch, std::vector<span_t> &spans);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_INCREMENTAL_H
@@ -0,0 +1,304 @@
+#include "io_backend.h"
+#include "telemetry.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace io {
+
+  typedef struct file {
+    int buffered_fd;  // Companion descriptor of an O_DIRECT file, -1 otherwise
+    char *map;        // Mapping of an IO_MMAP file, NULL otherwise
+    size_t map_size;
+    bool stream;      // Pipe or terminal, read and written sequentially
+    size_t streamed;  // Bytes written to a stream so far
+  } file_t;
+
+  // Indexed by descriptor. Entries are written on open/close only, before and after any concurrent use.
+  static file_t files[IO_MAX_FILES];
+  static bool initialized = false;
+
+  static file_t *lookup(int fd) {
+    if (fd < 0 || fd >= IO_MAX_FILES || !initialized) {
+      return NULL;
+    }
+    file_t *f = &files[fd];
+    return f->buffered_fd != -1 || f->map != NULL || f->stream ? f : NULL;
+  }
+
+  static void initialize() {
+    if (initialized) {
+      return;
+    }
+    for (size_t i = 0; i < IO_MAX_FILES; i++) {
+      files[i].buffered_fd = -1;
+      files[i].map = NULL;
+      files[i].map_size = 0;
+      files[i].stream = false;
+      files[i].streamed = 0;
+    }
+    initialized = true;
+  }
+
+  int open_file(const char *filename, int flags, int backend) {
+    initialize();
+    int fd;
+
+    if (backend == IO_DIRECT) {
+      if ((fd = open(filename, flags | O_DIRECT, 0777)) == -1) {
+        // e.g. tmpfs doesn't support O_DIRECT
+        return open(filename, flags, 0777);
+      }
+      int buffered_fd = open(filename, flags & ~(O_CREAT | O_TRUNC | O_EXCL), 0777);
+      if (buffered_fd == -1 || fd >= IO_MAX_FILES) {
+        if (buffered_fd != -1) {
+          close(buffered_fd);
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        return fd;
+      }
+      files[fd].buffered_fd = buffered_fd;
+      return fd;
+    }
+
+    if ((fd = open(filename, flags, 0777)) == -1) {
+      return -1;
+    }
+    if (backend == IO_MMAP && (flags & O_ACCMODE) == O_RDONLY && fd < IO_MAX_FILES) {
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+          madvise(map, st.st_size, MADV_SEQUENTIAL);
+          files[fd].map = (char *) map;
+          files[fd].map_size = st.st_size;
+        }
+      }
+    }
+    return fd;
+  }
+
+  void close_file(int fd) {
+    file_t *f = lookup(fd);
+    if (f != NULL) {
+      if (f->buffered_fd != -1) {
+        close(f->buffered_fd);
+        f->buffered_fd = -1;
+      }
+      if (f->map != NULL) {
+        munmap(f->map, f->map_size);
+        f->map = NULL;
+        f->map_size = 0;
+      }
+      f->stream = false;
+      f->streamed = 0;
+    }
+    close(fd);
+  }
+
+  void set_stream(int fd) {
+    initialize();
+    if (fd >= 0 && fd < IO_MAX_FILES) {
+      files[fd].stream = true;
+    }
+  }
+
+  bool is_stream(int fd) {
+    file_t *f = lookup(fd);
+    return f != NULL && f->stream;
+  }
+
+  size_t streamed(int fd) {
+    file_t *f = lookup(fd);
+    return f != NULL ? f->streamed : 0;
+  }
+
+  static size_t pread_fully(int fd, char *buffer, size_t size, size_t offset) {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t ret = pread(fd, buffer + done, size - done, offset + done);
+      if (ret <= 0) {
+        break;
+      }
+      done += ret;
+    }
+    return done;
+  }
+
+  // Until size bytes or the end of the stream
+  static size_t stream_read(int fd, char *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t ret = ::read(fd, buffer + done, size - done);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        break;
+      }
+      done += ret;
+    }
+    return done;
+  }
+
+  static bool stream_write(int fd, const char *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t ret = ::write(fd, buffer + done, size - done);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        files[fd].streamed += done;
+        return false;
+      }
+      done += ret;
+    }
+    files[fd].streamed += done;
+    return true;
+  }
+
+  static bool pwrite_fully(int fd, const char *buffer, size_t size, size_t offset) {
+    size_t done = 0;
+    while (done < size) {
+      ssize_t ret = pwrite(fd, buffer + done, size - done, offset + done);
+      if (ret <= 0) {
+        return false;
+      }
+      done += ret;
+    }
+    return true;
+  }
+
+  // Split [offset, offset + size) into an unaligned head, a block aligned middle and an unaligned tail.
+  // Returns false if the buffer can't line up with the blocks at all.
+  static bool split(const char *buffer, size_t size, size_t offset, size_t &head, size_t &middle) {
+    size_t aligned_offset = align_up(offset, IO_BLOCK_SIZE);
+    head = aligned_offset - offset < size ? aligned_offset - offset : size;
+    middle = (size - head) / IO_BLOCK_SIZE * IO_BLOCK_SIZE;
+    return ((size_t) (buffer + head)) % IO_BLOCK_SIZE == 0;
+  }
+
+  static size_t read_request(int fd, char *buffer, size_t size, size_t offset) {
+    file_t *f = lookup(fd);
+    if (f == NULL) {
+      return pread_fully(fd, buffer, size, offset);
+    }
+    if (f->stream) {
+      return stream_read(fd, buffer, size);
+    }
+    if (f->map != NULL) {
+      size_t amount = offset >= f->map_size ? 0 : (f->map_size - offset < size ? f->map_size - offset : size);
+      memcpy(buffer, f->map + offset, amount);
+      return amount;
+    }
+
+    size_t head, middle;
+    if (!split(buffer, size, offset, head, middle) || middle == 0) {
+      return pread_fully(f->buffered_fd, buffer, size, offset);
+    }
+    size_t done = pread_fully(f->buffered_fd, buffer, head, offset);
+    if (done < head) {
+      return done;
+    }
+    // O_DIRECT stops short at the end of the file; whatever lies beyond the last whole block
+    // is read through the page cache
+    size_t direct = pread_fully(fd, buffer + head, middle, offset + head);
+    done += direct - direct % IO_BLOCK_SIZE;
+    return done + pread_fully(f->buffered_fd, buffer + done, size - done, offset + done);
+  }
+
+  size_t split_request(int fd, const char *buffer, size_t size, size_t offset, piece_t *pieces) {
+    file_t *f = lookup(fd);
+    if (f != NULL && (f->map != NULL || f->stream)) {
+      return 0;
+    }
+
+    size_t head, middle;
+    if (f == NULL || f->buffered_fd == -1 || !split(buffer, size, offset, head, middle) || middle == 0) {
+      pieces[0].fd = f == NULL || f->buffered_fd == -1 ? fd : f->buffered_fd;
+      pieces[0].buffer_offset = 0;
+      pieces[0].size = size;
+      pieces[0].offset = offset;
+      return 1;
+    }
+    size_t num_pieces = 0;
+    size_t bounds[IO_MAX_PIECES + 1] = {0, head, head + middle, size};
+    for (size_t i = 0; i < IO_MAX_PIECES; i++) {
+      if (bounds[i + 1] > bounds[i]) {
+        pieces[num_pieces].fd = i == 1 ? fd : f->buffered_fd;
+        pieces[num_pieces].buffer_offset = bounds[i];
+        pieces[num_pieces].size = bounds[i + 1] - bounds[i];
+        pieces[num_pieces].offset = offset + bounds[i];
+        num_pieces++;
+      }
+    }
+    return num_pieces;
+  }
+
+  size_t read_fully(int fd, char *buffer, size_t size, size_t offset) {
+    telemetry::scoped_timer timer(telemetry::IO_NS);
+    size_t done = read_request(fd, buffer, size, offset);
+    telemetry::add(telemetry::BYTES_READ, done);
+    return done;
+  }
+
+  bool write_fully(int fd, const char *buffer, size_t size, size_t offset) {
+    telemetry::scoped_timer timer(telemetry::IO_NS);
+    telemetry::add(telemetry::BYTES_WRITTEN, size);
+    piece_t pieces[IO_MAX_PIECES];
+    size_t num_pieces = split_request(fd, buffer, size, offset, pieces);
+    if (num_pieces == 0) {
+      return is_stream(fd) ? stream_write(fd, buffer, size) : pwrite_fully(fd, buffer, size, offset);
+    }
+    for (size_t i = 0; i < num_pieces; i++) {
+      if (!pwrite_fully(pieces[i].fd, buffer + pieces[i].buffer_offset, pieces[i].size, pieces[i].offset)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool sync(int fd) {
+    file_t *f = lookup(fd);
+    if (f != NULL && f->stream) {
+      return true; // Nothing to flush to
+    }
+    if (f != NULL && f->buffered_fd != -1 && fdatasync(f->buffered_fd) != 0) {
+      return false;
+    }
+    return fdatasync(fd) == 0;
+  }
+
+  char *allocate(size_t size) {
+    void *buffer;
+    if (posix_memalign(&buffer, IO_BLOCK_SIZE, size) != 0) {
+      return NULL;
+    }
+    return (char *) buffer;
+  }
+
+  int parse_backend(const char *name) {
+    if (strcmp(name, "buffered") == 0) {
+      return IO_BUFFERED;
+    }
+    if (strcmp(name, "direct") == 0) {
+      return IO_DIRECT;
+    }
+    if (strcmp(name, "mmap") == 0) {
+      return IO_MMAP;
+    }
+    return -1;
+  }
+
+  const char *backend_name(int backend) {
+    return backend == IO_DIRECT ? "direct" : backend == IO_MMAP ? "mmap" : "buffered";
+  }
+
+}
@@ -0,0 +1,50 @@
+#ifndef MULTICORE_EXTERNAL_SORT_IO_BACKEND_H
+#define MULTICORE_EXTERNAL_SORT_IO_BACKEND_H
+
+#include <cstddef>
+#include "global.h"
+
+#define IO_BUFFERED (0)  // pread/pwrite through the page cache
+#define IO_DIRECT (1)    // O_DIRECT for every block aligned part of a request
+#define IO_MMAP (2)      // Read-only files are mapped and copied out; writes stay buffered
+
+#define IO_MAX_FILES (65536)
+#define IO_MAX_PIECES (3)  // Unaligned head, aligned middle, unaligned tail
+
+// All file I/O of the sort goes through here, so the backend is picked once at runtime.
+// O_DIRECT needs the buffer address, file offset and length aligned to IO_BLOCK_SIZE; the parts
+// of a request that aren't are served by a second, buffered descriptor of the same file.
+namespace io {
+  // One descriptor level transfer of a request: size bytes at buffer + buffer_offset <-> offset of fd.
+  typedef struct piece {
+    int fd;
+    size_t buffer_offset;
+    size_t size;
+    size_t offset;
+  } piece_t;
+
+  int open_file(const char *filename, int flags, int backend);
+  void close_file(int fd);
+  // Treat fd as a pipe: requests on it ignore their offset and transfer sequentially, in the order issued.
+  void set_stream(int fd);
+  bool is_stream(int fd);
+  // Bytes written to the stream fd so far, all of them in order
+  size_t streamed(int fd);
+
+  // Returns the number of bytes read, less than size only at the end of the file or on error.
+  size_t read_fully(int fd, char *buffer, size_t size, size_t offset);
+  bool write_fully(int fd, const char *buffer, size_t size, size_t offset);
+  // The transfers write_fully() would make for a request, so that they can be issued asynchronously.
+  // Returns the number of pieces, 0 if fd is mapped and the request has to go through read_fully().
+  size_t split_request(int fd, const char *buffer, size_t size, size_t offset, piece_t *pieces);
+  // Flush the file's data once, instead of opening it O_SYNC.
+  bool sync(int fd);
+
+  // IO_BLOCK_SIZE aligned allocation, for buffers used with IO_DIRECT
+  char *allocate(size_t size);
+
+  int parse_backend(const char *name);
+  const char *backend_name(int backend);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_IO_BACKEND_H
@@ -0,0 +1,223 @@
+#include "k_way_merge.h"
+#include "loser_tree.h"
+#include "async_io.h"
+#include "run_codec.h"
+#include "telemetry.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+namespace merge {
+
+  // Each run has two chunks: the one being merged and the next one, already in flight.
+  // Compressed runs also have a staging chunk their blocks are read into before decompression.
+  typedef struct way {
+    char *chunks[2];
+    char *staging;
+    size_t current;                 // Chunk being merged
+    size_t requested;               // Bytes asked for by the read in flight
+    bool pending;
+    const run_blocks_t *blocks;     // Block index of a compressed run, NULL otherwise
+    size_t next_block;
+    size_t refills;                 // Chunks taken so far
+    io::async_request_t ahead;      // Read of the next chunk into chunks[current ^ 1]
+    codec::block_request_t decode;  // Same for a compressed run
+  } way_t;
+
+  // Whole blocks from next_block on, as many as fit a chunk in both their tuples and compressed bytes
+  static void read_blocks_ahead(codec::block_reader &reader, int fd, section_t &run, way_t &way, size_t chunk_size) {
+    const run_blocks_t &blocks = *way.blocks;
+    size_t first = way.next_block;
+    size_t last = first;
+    while (last < blocks.num_blocks && blocks.raw_offsets[last + 1] <= run.tail &&
+           blocks.raw_offsets[last + 1] - blocks.raw_offsets[first] <= chunk_size &&
+           blocks.file_offsets[last + 1] - blocks.file_offsets[first] <= chunk_size) {
+      last++;
+    }
+    if (last == first) {
+      printf("[Error] compressed block at %zu doesn't fit a merge chunk\n", run.head);
+      way.pending = false;
+      return;
+    }
+    way.requested = blocks.raw_offsets[last] - blocks.raw_offsets[first];
+    reader.read(way.decode, fd, blocks, first, last, way.staging, way.chunks[way.current ^ 1]);
+    run.head = blocks.raw_offsets[last];
+    way.next_block = last;
+  }
+
+  // Start reading the next chunk of a run, if there is one.
+  static void read_ahead(io::async_queue &queue, codec::block_reader &reader, int fd, section_t &run, way_t &way,
+                         size_t chunk_size) {
+    way.pending = run.head < run.tail;
+    if (!way.pending) {
+      return;
+    }
+    if (way.blocks != NULL) {
+      read_blocks_ahead(reader, fd, run, way, chunk_size);
+      return;
+    }
+    way.requested = run.tail - run.head < chunk_size ? run.tail - run.head : chunk_size;
+    queue.read(way.ahead, fd, way.chunks[way.current ^ 1], way.requested, run.head);
+    run.head += way.requested;
+  }
+
+  // Switch to the chunk read ahead and start reading the one after it.
+  // Returns the number of bytes to merge from the new chunk, 0 once the run is exhausted.
+  template<class L>
+  static size_t advance(io::async_queue &queue, codec::block_reader &reader, int fd, section_t &run, way_t &way,
+                        size_t chunk_size) {
+    if (!way.pending) {
+      return 0;
+    }
+    size_t amount = way.blocks != NULL ? reader.wait(way.decode) : queue.wait(way.ahead);
+    if (amount < way.requested) {
+      printf("[Error] failed to read run chunk at %zu\n", run.head - way.requested + amount);
+    }
+    way.current ^= 1;
+    way.refills++;
+    read_ahead(queue, reader, fd, run, way, chunk_size);
+    return amount - amount % L::size;
+  }
+
+  // Returns the number of bytes the write got through
+  static size_t finish_write(io::async_queue &queue, io::async_request_t &request, size_t amount,
+                             size_t file_offset) {
+    size_t done = queue.wait(request);
+    if (done < amount) {
+      printf("[Error] failed to write merged output at %zu\n", file_offset);
+    }
+    return done;
+  }
+
+  size_t chunk_size(size_t input_buffer_size, size_t num_runs, size_t chunks_per_run, size_t record_size) {
+    // Whole I/O blocks where possible, so that reads can bypass the page cache
+    size_t size = input_buffer_size / (chunks_per_run * num_runs);
+    return size >= IO_UNIT ? size / IO_UNIT * IO_UNIT : size / record_size * record_size;
+  }
+
+  template<class L>
+  size_t merge_runs(const int *fds, section_t *runs, const run_blocks_t *const *blocks, size_t num_runs,
+                    char *input_buffer, size_t input_buffer_size,
+                    char *output_buffer, size_t output_buffer_size,
+                    int output_fd, size_t output_offset, size_t queue_depth, size_t num_decoders) {
+    telemetry::scoped_timer timer(telemetry::MERGE_NS);
+    bool compressed = false;
+    for (size_t i = 0; blocks != NULL && i < num_runs; i++) {
+      compressed |= blocks[i] != NULL;
+    }
+    size_t chunks_per_run = compressed ? 3 : 2;
+    size_t chunk_size = merge::chunk_size(input_buffer_size, num_runs, chunks_per_run, L::size);
+    // Two output buffers: one is filled while the other is written behind
+    size_t output_capacity = output_buffer_size / 2;
+    output_capacity = output_capacity >= IO_UNIT ? output_capacity / IO_UNIT * IO_UNIT :
+                      output_capacity / L::size * L::size;
+    if (chunk_size == 0 || output_capacity == 0) {
+      printf("[Error] merge buffers too small for %zu runs\n", num_runs);
+      return 0;
+    }
+
+    io::async_queue queue(queue_depth);
+    codec::block_reader reader(compressed ? num_decoders : 0);
+    way_t ways[num_runs];
+    section_t buffer_sections[num_runs]; // Unconsumed [head, tail) of each run's current chunk
+    loser_tree<L> tree(num_runs);
+
+    for (size_t i = 0; i < num_runs; i++) {
+      ways[i].chunks[0] = input_buffer + chunks_per_run * i * chunk_size;
+      ways[i].chunks[1] = ways[i].chunks[0] + chunk_size;
+      ways[i].staging = compressed ? ways[i].chunks[1] + chunk_size : NULL;
+      ways[i].current = 1;
+      ways[i].refills = 0;
+      ways[i].blocks = blocks != NULL ? blocks[i] : NULL;
+      if (ways[i].blocks != NULL) {
+        const size_t *raw_offsets = ways[i].blocks->raw_offsets;
+        ways[i].next_block = std::lower_bound(raw_offsets, raw_offsets + ways[i].blocks->num_blocks, runs[i].head) -
+                             raw_offsets;
+        if (runs[i].head < runs[i].tail && raw_offsets[ways[i].next_block] != runs[i].head) {
+          printf("[Error] run section at %zu doesn't start a compressed block\n", runs[i].head);
+          runs[i].tail = runs[i].head;
+        }
+      }
+      read_ahead(queue, reader, fds[i], runs[i], ways[i], chunk_size);
+    }
+    for (size_t i = 0; i < num_runs; i++) {
+      buffer_sections[i].head = 0;
+      buffer_sections[i].tail = advance<L>(queue, reader, fds[i], runs[i], ways[i], chunk_size);
+      tree.set(i, buffer_sections[i].tail > 0 ? (const record<L> *) ways[i].chunks[ways[i].current] : NULL);
+    }
+    tree.build();
+
+    char *outputs[2] = {output_buffer, output_buffer + output_capacity};
+    io::async_request_t writes[2];
+    size_t write_sizes[2] = {0, 0};
+    size_t write_offsets[2] = {0, 0};
+    size_t current_output = 0;
+    char *output = outputs[0];
+    size_t output_head = 0;
+    size_t written = 0;
+    size_t confirmed = 0; // Bytes whose writes got through
+    while (!tree.empty()) {
+      size_t idx = tree.winner();
+      memcpy(output + output_head, tree.top(), L::size);
+      output_head += L::size;
+
+      // If output buffer is full, write it behind and continue in the other one
+      if (output_head == output_capacity) {
+        write_sizes[current_output] = output_head;
+        write_offsets[current_output] = output_offset + written;
+        queue.write(writes[current_output], output_fd, output, output_head, output_offset + written);
+        written += output_head;
+        output_head = 0;
+        current_output ^= 1;
+        output = outputs[current_output];
+        if (write_sizes[current_output] > 0) {
+          confirmed += finish_write(queue, writes[current_output], write_sizes[current_output],
+                                    write_offsets[current_output]);
+          write_sizes[current_output] = 0;
+        }
+      }
+
+      // If the run's chunk is all merged, switch to the one read ahead
+      section_t &section = buffer_sections[idx];
+      section.head += L::size;
+      if (section.head == section.tail) {
+        section.head = 0;
+        section.tail = advance<L>(queue, reader, fds[idx], runs[idx], ways[idx], chunk_size);
+      }
+      tree.replace(section.head < section.tail ?
+                   (const record<L> *) (ways[idx].chunks[ways[idx].current] + section.head) : NULL);
+    }
+
+    if (output_head > 0) {
+      write_sizes[current_output] = output_head;
+      write_offsets[current_output] = output_offset + written;
+      queue.write(writes[current_output], output_fd, output, output_head, output_offset + written);
+      written += output_head;
+    }
+    for (size_t i = 0; i < 2; i++) {
+      if (write_sizes[i] > 0) {
+        confirmed += finish_write(queue, writes[i], write_sizes[i], write_offsets[i]);
+      }
+    }
+    if (telemetry::enabled()) {
+      size_t refills[num_runs];
+      size_t total = 0;
+      for (size_t i = 0; i < num_runs; i++) {
+        refills[i] = ways[i].refills;
+        total += refills[i];
+      }
+      telemetry::record_refills(refills, num_runs);
+      telemetry::record(telemetry::MERGE_REFILLS, total);
+    }
+    return confirmed;
+  }
+
+#define INSTANTIATE_MERGE_RUNS(SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE) \
+  template size_t merge_runs<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>>( \
+      const int *, section_t *, const run_blocks_t *const *, size_t, char *, size_t, char *, size_t, int, size_t, \
+      size_t, size_t);
+
+  FOR_EACH_RECORD_LAYOUT(INSTANTIATE_MERGE_RUNS)
+
+}
@@ -0,0 +1,27 @@
+#ifndef MULTICORE_EXTERNAL_SORT_K_WAY_MERGE_H
+#define MULTICORE_EXTERNAL_SORT_K_WAY_MERGE_H
+
+#include <cstddef>
+#include "global.h"
+
+namespace merge {
+  // Read chunk of each of num_runs runs when the merge input buffer holds chunks_per_run chunks per run
+  size_t chunk_size(size_t input_buffer_size, size_t num_runs, size_t chunks_per_run, size_t record_size);
+
+  // Merge `num_runs` sorted runs of records of layout L into output_fd starting at output_offset.
+  // Run i is the byte range [runs[i].head, runs[i].tail) of the sorted tuples of fds[i]; runs[] is consumed.
+  // If blocks[i] isn't NULL, fds[i] is a compressed run with that block index, and the range has to
+  // start and end on block boundaries; blocks itself may be NULL if no run is compressed.
+  // input_buffer is split evenly into two read chunks per run (three if any run is compressed), so the
+  // next chunk of every run is read ahead while the current one is merged; output_buffer into two
+  // halves that are written behind. Up to queue_depth reads and writes are in flight at once
+  // (0: synchronous I/O), and compressed chunks are read and decompressed by num_decoders threads.
+  // Returns the number of bytes written, short of the runs' total if a read or a write failed.
+  template<class L>
+  size_t merge_runs(const int *fds, section_t *runs, const run_blocks_t *const *blocks, size_t num_runs,
+                    char *input_buffer, size_t input_buffer_size,
+                    char *output_buffer, size_t output_buffer_size,
+                    int output_fd, size_t output_offset, size_t queue_depth, size_t num_decoders);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_K_WAY_MERGE_H
@@ -0,0 +1,101 @@
+#include "layout_engine.h"
+#include "parallel_radix_sort.h"
+#include "k_way_merge.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace layout {
+
+  template<class L>
+  static void sort(char *buffer, size_t size) {
+    radix_sort::parallel_radix_sort((record<L> *) buffer, size / L::size, 0);
+  }
+
+  template<class L>
+  static void indirect_sort(const char *buffer, size_t size, char *refs) {
+    radix_sort::parallel_indirect_sort((const record<L> *) buffer, size / L::size, (record_ref<L> *) refs);
+  }
+
+  template<class L>
+  static void gather(const char *buffer, const char *refs, size_t num_records, char *out) {
+    radix_sort::gather((const record<L> *) buffer, (const record_ref<L> *) refs, num_records, (record<L> *) out);
+  }
+
+  template<class L>
+  static int compare(const char *a, const char *b) {
+    return L::compare(a + L::key_offset, b + L::key_offset);
+  }
+
+  template<class L>
+  static normalized_key_t normalize(const char *record) {
+    return L::normalize(record + L::key_offset);
+  }
+
+  template<class L>
+  static layout_engine_t engine() {
+    static_assert(IO_UNIT % L::size == 0, "record size must divide IO_UNIT");
+    layout_engine_t e;
+    e.record_size = L::size;
+    e.key_offset = L::key_offset;
+    e.key_length = L::key_length;
+    e.key_type = L::key_type;
+    e.ref_size = sizeof(record_ref<L>);
+    e.sort = sort<L>;
+    e.indirect_sort = indirect_sort<L>;
+    e.gather = gather<L>;
+    e.merge = merge::merge_runs<L>;
+    e.compare = compare<L>;
+    e.count_pairs = L::count_pairs;
+    e.normalize = normalize<L>;
+    return e;
+  }
+
+#define LAYOUT_ENGINE(SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE) \
+  engine<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>>(),
+
+  static const layout_engine_t engines[] = {FOR_EACH_RECORD_LAYOUT(LAYOUT_ENGINE)};
+  static const size_t num_engines = sizeof(engines) / sizeof(engines[0]);
+
+  static const char *key_type_names[] = {"bytes", "int_be", "uint_le"};
+
+  const layout_engine_t *default_engine() {
+    for (size_t i = 0; i < num_engines; i++) {
+      if (engines[i].record_size == tuple_layout_t::size && engines[i].key_offset == tuple_layout_t::key_offset &&
+          engines[i].key_length == tuple_layout_t::key_length && engines[i].key_type == tuple_layout_t::key_type) {
+        return &engines[i];
+      }
+    }
+    return NULL;
+  }
+
+  const layout_engine_t *parse(const char *str) {
+    char type[16];
+    size_t size, key_offset, key_length;
+    if (sscanf(str, "%zu:%zu:%zu:%15s", &size, &key_offset, &key_length, type) != 4) {
+      return NULL;
+    }
+    for (size_t i = 0; i < num_engines; i++) {
+      if (engines[i].record_size == size && engines[i].key_offset == key_offset &&
+          engines[i].key_length == key_length && strcmp(key_type_name(engines[i].key_type), type) == 0) {
+        return &engines[i];
+      }
+    }
+    return NULL;
+  }
+
+  void print_layouts() {
+    printf("Record layouts (size:key_offset:key_length:type):");
+    for (size_t i = 0; i < num_engines; i++) {
+      printf(" %zu:%zu:%zu:%s", engines[i].record_size, engines[i].key_offset, engines[i].key_length,
+             key_type_name(engines[i].key_type));
+    }
+    printf("\n");
+  }
+
+  const char *key_type_name(int key_type) {
+    return key_type >= 0 && key_type < 3 ? key_type_names[key_type] : "unknown";
+  }
+
+}
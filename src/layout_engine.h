@@ -0,0 +1,44 @@
+#ifndef MULTICORE_EXTERNAL_SORT_LAYOUT_ENGINE_H
+#define MULTICORE_EXTERNAL_SORT_LAYOUT_ENGINE_H
+
+#include <cstddef>
+#include "global.h"
+
+// The sort and merge code compiled for one record layout (FOR_EACH_RECORD_LAYOUT), behind plain function
+// pointers, so that the phases pick a layout at runtime and pay for it once per buffer, never per record.
+typedef struct layout_engine {
+  size_t record_size;
+  size_t key_offset;
+  size_t key_length;
+  int key_type;
+  size_t ref_size;  // Bytes per (key, index) entry of the indirect sort
+
+  // Sort the records of buffer in place
+  void (*sort)(char *buffer, size_t size);
+  // Sort (key, index) entries of the records of buffer into refs, which must hold one per record
+  void (*indirect_sort)(const char *buffer, size_t size, char *refs);
+  // out[i] = the record of refs[i], for num_records entries
+  void (*gather)(const char *buffer, const char *refs, size_t num_records, char *out);
+  // merge::merge_runs for this layout
+  size_t (*merge)(const int *fds, section_t *runs, const run_blocks_t *const *blocks, size_t num_runs,
+                  char *input_buffer, size_t input_buffer_size, char *output_buffer, size_t output_buffer_size,
+                  int output_fd, size_t output_offset, size_t queue_depth, size_t num_decoders);
+  // Negative, zero or positive as the key of record a orders before, with or after that of record b
+  int (*compare)(const char *a, const char *b);
+  // The first 16 key bytes of a record as one integer in key order, see record_layout::normalize
+  normalized_key_t (*normalize)(const char *record);
+  // Adjacent records of buffer whose keys are out of order and equal, see record_layout::count_pairs
+  void (*count_pairs)(const char *buffer, size_t num_records, size_t &descents, size_t &duplicates);
+} layout_engine_t;
+
+namespace layout {
+  // The 100 byte, 10 byte key layout of the sort benchmark (tuple_t)
+  const layout_engine_t *default_engine();
+  // "size:key_offset:key_length:bytes|int_be|uint_le"; NULL if str isn't one of the compiled layouts
+  const layout_engine_t *parse(const char *str);
+  // Lists the compiled layouts as parse() takes them
+  void print_layouts();
+  const char *key_type_name(int key_type);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_LAYOUT_ENGINE_H
@@ -0,0 +1,105 @@
+#include "loser_tree.h"
+
+#include <cstring>
+
+namespace merge {
+
+  template<class L>
+  loser_tree<L>::loser_tree(size_t num_ways) : num_ways(num_ways) {
+    num_leaves = 1;
+    while (num_leaves < num_ways) {
+      num_leaves <<= 1;
+    }
+    leaves = new leaf_t[num_leaves];
+    nodes = new size_t[num_leaves];
+    for (size_t i = 0; i < num_leaves; i++) {
+      leaves[i].key = 0;
+      leaves[i].head = NULL;
+      nodes[i] = 0;
+    }
+  }
+
+  template<class L>
+  loser_tree<L>::~loser_tree() {
+    delete[] leaves;
+    delete[] nodes;
+  }
+
+  template<class L>
+  void loser_tree<L>::set(size_t way, const record<L> *head) {
+    load(way, head);
+  }
+
+  template<class L>
+  void loser_tree<L>::build() {
+    if (num_leaves == 1) {
+      nodes[0] = 0;
+      return;
+    }
+    nodes[0] = build(1);
+  }
+
+  template<class L>
+  void loser_tree<L>::replace(const record<L> *head) {
+    size_t way = nodes[0];
+    load(way, head);
+
+    size_t winner = way;
+    for (size_t node = (way + num_leaves) >> 1; node > 0; node >>= 1) {
+      if (beats(nodes[node], winner)) {
+        size_t tmp = nodes[node];
+        nodes[node] = winner;
+        winner = tmp;
+      }
+    }
+    nodes[0] = winner;
+  }
+
+  // Winner of the subtree rooted at `node`; losers are stored on the way up.
+  template<class L>
+  size_t loser_tree<L>::build(size_t node) {
+    if (node >= num_leaves) {
+      return node - num_leaves;
+    }
+    size_t left = build(node << 1);
+    size_t right = build((node << 1) | 1);
+    if (beats(right, left)) {
+      nodes[node] = left;
+      return right;
+    }
+    nodes[node] = right;
+    return left;
+  }
+
+  template<class L>
+  bool loser_tree<L>::beats(size_t a, size_t b) const {
+    const leaf_t &x = leaves[a];
+    const leaf_t &y = leaves[b];
+    if (x.head == NULL) {
+      return false;
+    }
+    if (y.head == NULL) {
+      return true;
+    }
+    if (x.key != y.key) {
+      return x.key < y.key;
+    }
+    int cmp = L::compare_rest(x.head->key(), y.head->key());
+    return cmp < 0 || (cmp == 0 && a < b);
+  }
+
+  template<class L>
+  void loser_tree<L>::load(size_t way, const record<L> *head) {
+    leaf_t &l = leaves[way];
+    l.head = head;
+    if (head != NULL) {
+      l.key = L::normalize(head->key());
+    }
+  }
+
+#define INSTANTIATE_LOSER_TREE(SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE) \
+  template class loser_tree<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>>;
+
+  FOR_EACH_RECORD_LAYOUT(INSTANTIATE_LOSER_TREE)
+
+}
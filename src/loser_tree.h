@@ -0,0 +1,47 @@
+#ifndef MULTICORE_EXTERNAL_SORT_LOSER_TREE_H
+#define MULTICORE_EXTERNAL_SORT_LOSER_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include "global.h"
+
+namespace merge {
+  // Tournament tree of losers over `num_ways` sorted streams of records of layout L.
+  // Each leaf caches the first 16 key digits as an integer (L::normalize), so a match is decided by
+  // one 128-bit integer compare; only keys longer than that fall back to their remaining bytes on a tie.
+  // Ties are broken by way index, which keeps the merge stable across runs.
+  template<class L>
+  class loser_tree {
+  public:
+    explicit loser_tree(size_t num_ways);
+    ~loser_tree();
+
+    // Set the head record of a way before build(). NULL marks the way as exhausted.
+    void set(size_t way, const record<L> *head);
+    void build();
+
+    size_t winner() const { return nodes[0]; }
+    const record<L> *top() const { return leaves[nodes[0]].head; }
+    bool empty() const { return leaves[nodes[0]].head == NULL; }
+
+    // Replace the winner's record with the next one of the same way (NULL if exhausted) and replay.
+    void replace(const record<L> *head);
+
+  private:
+    typedef struct leaf {
+      normalized_key_t key;
+      const record<L> *head;
+    } leaf_t;
+
+    size_t num_ways;
+    size_t num_leaves; // num_ways rounded up to a power of two
+    leaf_t *leaves;
+    size_t *nodes;     // nodes[0]: overall winner, nodes[1..num_leaves): loser of each match
+
+    bool beats(size_t a, size_t b) const;
+    size_t build(size_t node);
+    void load(size_t way, const record<L> *head);
+  };
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_LOSER_TREE_H
@@ -0,0 +1,170 @@
+#include "merge_path.h"
+#include "io_backend.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace merge_path {
+
+  // The fences of all runs in key order; the k-th of them has about k / size of the records before it
+  static void sort_fences(const fence::index_t *fences, size_t num_runs, const layout_engine_t *engine,
+                          std::vector<const char *> &keys, size_t &total) {
+    total = 0;
+    for (size_t i = 0; i < num_runs; i++) {
+      total += fences[i].num_records;
+      for (size_t j = 0; j < fence::size(fences[i]); j++) {
+        keys.push_back(fence::slot(fences[i], j));
+      }
+    }
+    std::sort(keys.begin(), keys.end(), [engine](const char *a, const char *b) {
+      return engine->compare(a, b) < 0;
+    });
+  }
+
+  // The records of every run that order before the key (lower) and not after it (upper), and their sums
+  static bool rank_all(const int *fds, const fence::index_t *fences, size_t num_runs, const layout_engine_t *engine,
+                       const char *key, char *scratch, size_t *lower, size_t *upper, size_t &sum_lower,
+                       size_t &sum_upper) {
+    sum_lower = sum_upper = 0;
+    for (size_t i = 0; i < num_runs; i++) {
+      if (!fence::rank(fds[i], fences[i], engine, key, false, scratch, lower[i]) ||
+          !fence::rank(fds[i], fences[i], engine, key, true, scratch, upper[i])) {
+        return false;
+      }
+      sum_lower += lower[i];
+      sum_upper += upper[i];
+    }
+    return true;
+  }
+
+  // Every record before the key goes before the cut, and as many equal to it as it takes, run by run
+  static void split(const size_t *lower, const size_t *upper, size_t num_runs, size_t rest, size_t *positions) {
+    for (size_t i = 0; i < num_runs; i++) {
+      size_t take = std::min(upper[i] - lower[i], rest);
+      positions[i] = lower[i] + take;
+      rest -= take;
+    }
+  }
+
+  bool partition(const int *fds, const fence::index_t *fences, size_t num_runs, size_t num_slices,
+                 const layout_engine_t *engine, bool split_ties, char *scratch, size_t *segments) {
+    size_t stride = num_slices + 1;
+    size_t record_size = engine->record_size;
+    size_t total;
+    std::vector<const char *> keys;
+    sort_fences(fences, num_runs, engine, keys, total);
+
+    for (size_t i = 0; i < num_runs; i++) {
+      segments[i * stride] = 0;
+      segments[i * stride + num_slices] = fences[i].num_records * record_size;
+    }
+    std::vector<size_t> lower(num_runs), upper(num_runs), positions(num_runs);
+    for (size_t s = 1; s < num_slices; s++) {
+      size_t target = s * total / num_slices;
+      if (keys.empty()) {
+        for (size_t i = 0; i < num_runs; i++) {
+          segments[i * stride + s] = 0;
+        }
+        continue;
+      }
+      const char *key = keys[std::min(keys.size() - 1, target * keys.size() / total)];
+
+      size_t sum_lower, sum_upper;
+      if (!rank_all(fds, fences, num_runs, engine, key, scratch, lower.data(), upper.data(), sum_lower, sum_upper)) {
+        return false;
+      }
+      if (split_ties) {
+        target = std::min(std::max(target, sum_lower), sum_upper);
+      } else {
+        target = target >= sum_upper ? sum_upper : sum_lower;
+      }
+      split(lower.data(), upper.data(), num_runs, target - sum_lower, positions.data());
+      for (size_t i = 0; i < num_runs; i++) {
+        segments[i * stride + s] = positions[i] * record_size;
+      }
+    }
+    return true;
+  }
+
+  bool cut(const int *fds, const fence::index_t *fences, size_t num_runs, size_t target,
+           const layout_engine_t *engine, char *scratch, size_t *positions) {
+    size_t record_size = engine->record_size;
+    size_t total;
+    std::vector<const char *> keys;
+    sort_fences(fences, num_runs, engine, keys, total);
+    if (target >= total) {
+      for (size_t i = 0; i < num_runs; i++) {
+        positions[i] = fences[i].num_records;
+      }
+      return true;
+    }
+
+    // The first fence with at least target records up to it
+    std::vector<size_t> lower(num_runs), upper(num_runs), head(num_runs, 0);
+    size_t sum_lower, sum_upper;
+    size_t low = 0, high = keys.size();
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (!rank_all(fds, fences, num_runs, engine, keys[mid], scratch, lower.data(), upper.data(), sum_lower,
+                    sum_upper)) {
+        return false;
+      }
+      if (sum_upper >= target) {
+        high = mid;
+      } else {
+        low = mid + 1;
+      }
+    }
+
+    // The cut falls among the records equal to that fence, or among the ones between it and the fence
+    // before, at most an interval of every run
+    size_t before = 0;
+    if (low > 0) {
+      if (!rank_all(fds, fences, num_runs, engine, keys[low - 1], scratch, lower.data(), upper.data(), sum_lower,
+                    before)) {
+        return false;
+      }
+      head = upper;
+    }
+    if (low < keys.size()) {
+      if (!rank_all(fds, fences, num_runs, engine, keys[low], scratch, lower.data(), upper.data(), sum_lower,
+                    sum_upper)) {
+        return false;
+      }
+      if (sum_lower <= target) {
+        split(lower.data(), upper.data(), num_runs, target - sum_lower, positions);
+        return true;
+      }
+    } else {
+      for (size_t i = 0; i < num_runs; i++) {
+        lower[i] = fences[i].num_records;
+      }
+    }
+
+    // Those records, read and ordered: the first one after the cut is the one target - before among them
+    std::vector<char> window;
+    for (size_t i = 0; i < num_runs; i++) {
+      size_t bytes = (lower[i] - head[i]) * record_size;
+      window.resize(window.size() + bytes);
+      if (bytes > 0 && io::read_fully(fds[i], window.data() + window.size() - bytes, bytes,
+                                      head[i] * record_size) != bytes) {
+        return false;
+      }
+    }
+    std::vector<const char *> records(window.size() / record_size);
+    for (size_t r = 0; r < records.size(); r++) {
+      records[r] = window.data() + r * record_size;
+    }
+    std::nth_element(records.begin(), records.begin() + (target - before), records.end(),
+                     [engine](const char *a, const char *b) {
+                       return engine->compare(a, b) < 0;
+                     });
+    if (!rank_all(fds, fences, num_runs, engine, records[target - before], scratch, lower.data(), upper.data(),
+                  sum_lower, sum_upper)) {
+      return false;
+    }
+    split(lower.data(), upper.data(), num_runs, target - sum_lower, positions);
+    return true;
+  }
+
+}
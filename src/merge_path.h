@@ -0,0 +1,29 @@
+#ifndef MULTICORE_EXTERNAL_SORT_MERGE_PATH_H
+#define MULTICORE_EXTERNAL_SORT_MERGE_PATH_H
+
+#include <cstddef>
+#include "global.h"
+#include "layout_engine.h"
+#include "fence_index.h"
+
+// Merge path (co-ranking) partitioning of a merge: output record r of the merge is preceded by a_i records
+// of every run i, sum a_i = r, such that none of those orders after any of the rest. Cutting the output
+// into slices at such points gives slices that merge on their own, each into its own region of the output.
+// The fence indexes of the runs give a key of about the right rank; its exact position in every run costs
+// one read of a fence interval, and records equal to it are split between the slices in run order.
+// The same search cut at an exact rank ends a merge after its first records (top-K).
+namespace merge_path {
+  // segments[i * (num_slices + 1) + s] is the byte offset in run i where slice s starts, for the runs fds
+  // with indexes fences. scratch holds a fence interval of records. Without split_ties, records with equal
+  // keys all go to the same slice, so that the slices are key ranges, only about equal in size.
+  // Returns false on a read error.
+  bool partition(const int *fds, const fence::index_t *fences, size_t num_runs, size_t num_slices,
+                 const layout_engine_t *engine, bool split_ties, char *scratch, size_t *segments);
+  // The first target records of the merge are the first positions[i] records of every run i (all of them
+  // if there are fewer). Reads at most an interval of every run besides the searches.
+  // Returns false on a read error.
+  bool cut(const int *fds, const fence::index_t *fences, size_t num_runs, size_t target,
+           const layout_engine_t *engine, char *scratch, size_t *positions);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_MERGE_PATH_H
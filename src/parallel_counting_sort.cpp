@@ -3,144 +3,177 @@
 //
 
 #include "parallel_counting_sort.h"
+#include "histogram.h"
+#include "parallel_radix_sort.h"
 
+#include <cstdio>
 #include <utility>
+#include <vector>
+#include <algorithm>
 #include <omp.h>
 
 namespace counting_sort {
 
-  size_t bucket(tuple_t &data, const tuple_key_t *thresholds, const size_t &num_thresholds) {
-    for (size_t i = 0; i < num_thresholds; i++) {
-      if ((tuple_key_t &) data < thresholds[i]) {
-        return i;
-      }
+  void sort(tuple_t *data, size_t sz, size_t num_threads) {
+    if (sz < PARALLEL_PARTITION_THRESHOLD || num_threads == 1) {
+      radix_sort::parallel_radix_sort(data, sz, 0);
+      return;
+    }
+
+    // SAMPLE_OVERSAMPLING keys per bucket at equal strides; a key that takes up several buckets' share of
+    // the sample repeats among the splitters and so gets a bucket of its own
+    size_t num_buckets = NUM_BUCKETS;
+    size_t sample_size = std::min(sz, num_buckets * SAMPLE_OVERSAMPLING);
+    size_t stride = sz / sample_size;
+    std::vector<tuple_key_t> sample(sample_size);
+    for (size_t i = 0; i < sample_size; i++) {
+      memcpy(sample[i].key, data[i * stride].key(), KEY_SIZE);
+    }
+    std::sort(sample.begin(), sample.end());
+    std::vector<tuple_key_t> thresholds(num_buckets - 1);
+    for (size_t i = 1; i < num_buckets; i++) {
+      thresholds[i - 1] = sample[i * sample_size / num_buckets];
+    }
+
+    size_t buckets[num_buckets];
+    if (!parallel_counting_sort(data, sz, thresholds.data(), buckets, num_buckets, num_threads)) {
+      // Nothing was moved, so the buffer is sorted as a whole instead
+      radix_sort::parallel_radix_sort(data, sz, 0);
+      return;
+    }
+
+    size_t heads[num_buckets];
+    for (size_t b = 0, head = 0; b < num_buckets; head += buckets[b++]) {
+      heads[b] = head;
+    }
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads) shared(data, buckets, heads, num_buckets) \
+        default(none)
+    for (size_t b = 0; b < num_buckets; b++) {
+      radix_sort::parallel_radix_sort(data + heads[b], buckets[b], 0);
     }
-    return num_thresholds;
   }
 
-  void parallel_counting_sort(tuple_t *data, size_t sz, tuple_key_t *thresholds,
+  bool parallel_counting_sort(tuple_t *data, size_t sz, tuple_key_t *thresholds,
                               size_t *buckets, size_t num_buckets, size_t num_processors) {
-    size_t num_thresholds = num_buckets - 1;
-    memset(buckets, 0, sizeof(size_t) * num_buckets);
-
-    // Build histogram
-    #pragma omp parallel shared(sz, data, thresholds, num_thresholds, buckets, num_processors) default(none)
-    {
-      #pragma omp for
-      for (size_t i = 0; i < num_processors; i++) {
-        size_t head_offset = i * sz / num_processors;
-        size_t chunk_size = i == num_processors - 1 ? sz / num_processors + sz % num_processors : sz / num_processors;
-        for (size_t offset = head_offset; offset < head_offset + chunk_size; offset++) {
-          size_t b = bucket(data[offset], thresholds, num_thresholds);
-          #pragma omp atomic
-          buckets[b]++;
+    splitter_tree tree(thresholds, num_buckets - 1);
+    section_t g[num_buckets];
+    section_t p[num_buckets][num_processors];
+
+    size_t *counts = histogram::allocate(num_processors, num_buckets);
+    if (counts == NULL) {
+      printf("Buffer allocation failed (histogram)\n");
+      return false;
+    }
+    size_t stride = histogram::row_size(num_buckets);
+
+    // Build histogram, processor i counts its own chunk into its own row
+    #pragma omp parallel for shared(sz, data, tree, counts, stride, num_processors) default(none)
+    for (size_t i = 0; i < num_processors; i++) {
+      size_t *row = counts + i * stride;
+      size_t classified[NUM_BUCKETS];
+      size_t end = (i + 1) * sz / num_processors;
+      for (size_t offset = i * sz / num_processors; offset < end; offset += NUM_BUCKETS) {
+        size_t count = end - offset < NUM_BUCKETS ? end - offset : NUM_BUCKETS;
+        tree.bucket(data + offset, count, classified);
+        for (size_t j = 0; j < count; j++) {
+          row[classified[j]]++;
         }
       }
     }
 
-    size_t sum = 0;
-    section_t g[num_buckets];
-    section_t p[num_buckets][num_processors];
+    // Set bucket [head, tail], and each processor's share of it for the first permutation round
+    histogram::prefix_sum(counts, num_processors, num_buckets, buckets, g, (section_t *) p);
+    histogram::release(counts);
 
-    // Set bucket [head, tail]
-    // Partition for repair
-    for (size_t i = 0; i < num_buckets; i++) {
-      g[i].head = sum;
-      sum += buckets[i];
-      g[i].tail = sum;
-    }
+    size_t last_remaining = 0;
+    bool first_round = true;
+    while (true) {
+      size_t remaining = 0;
+      for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
+        remaining += g[bucket_id].tail - g[bucket_id].head;
+      }
+      if (remaining == 0) {
+        break;
+      }
+
+      // A single stripe per bucket always finishes the permutation in one round
+      size_t needed_threads = num_processors;
+      if (!first_round &&
+          (remaining < PARALLEL_PARTITION_THRESHOLD || remaining >= last_remaining)) {
+        needed_threads = 1;
+      }
+      last_remaining = remaining;
 
-    bool is_empty = false;
-    while (!is_empty) {
       // Partition For Permutation
-      for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
+      for (size_t bucket_id = 0; bucket_id < num_buckets && !first_round; bucket_id++) {
         size_t total = g[bucket_id].tail - g[bucket_id].head;
+        size_t stripes = total < needed_threads ? 1 : needed_threads;
+        size_t chunk_size = total / stripes;
 
-        if (total == 0) {
-          for (size_t thread_id = 0; thread_id < num_processors; thread_id++) {
+        for (size_t thread_id = 0; thread_id < num_processors; thread_id++) {
+          if (thread_id < stripes) {
+            p[bucket_id][thread_id].head = g[bucket_id].head + chunk_size * thread_id;
+            p[bucket_id][thread_id].tail = thread_id == stripes - 1 ? g[bucket_id].tail
+                                                                    : p[bucket_id][thread_id].head + chunk_size;
+          } else {
             p[bucket_id][thread_id].head = p[bucket_id][thread_id].tail = g[bucket_id].tail;
           }
-          continue;
-        }
-
-        size_t needed_threads = num_processors;
-        size_t chunk_size = total / num_processors;
-
-        if (total < num_processors) {
-          needed_threads = 1;
-          chunk_size = 1;
-        }
-
-        for (size_t thread_id = 0; thread_id < needed_threads; thread_id++) {
-          p[bucket_id][thread_id].head = g[bucket_id].head + chunk_size * thread_id;
-          p[bucket_id][thread_id].tail = p[bucket_id][thread_id].head + chunk_size;
-        }
-        p[bucket_id][needed_threads - 1].tail = g[bucket_id].tail;
-
-        for (size_t thread_id = needed_threads; thread_id < num_processors; thread_id++) {
-          p[bucket_id][thread_id].head = p[bucket_id][thread_id].tail = g[bucket_id].tail;
         }
       }
 
       // Permutation stage
-      #pragma omp parallel shared(data, thresholds, num_thresholds, num_processors, p, num_buckets) default(none)
-      {
-        #pragma omp for
-        for (size_t thread_id = 0; thread_id < num_processors; thread_id++) {
-          permute(data, thresholds, num_thresholds, (section_t *) p, num_processors, thread_id, num_buckets);
-        }
+      #pragma omp parallel for num_threads(needed_threads) shared(data, tree, num_processors, needed_threads, p, num_buckets) default(none)
+      for (size_t thread_id = 0; thread_id < needed_threads; thread_id++) {
+        permute(data, tree, (section_t *) p, num_processors, thread_id, num_buckets);
       }
 
       // Repair stage
-      is_empty = true;
-      #pragma omp parallel shared(data, thresholds, num_thresholds, num_processors, g, p, is_empty, num_buckets) default(none)
-      {
-        #pragma omp for
-        for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
-          repair(data, thresholds, num_thresholds, g, (section_t *) p, num_processors, bucket_id);
-          if (g[bucket_id].tail - g[bucket_id].head > 0) {
-            is_empty = false;
-          }
-        }
+      #pragma omp parallel for shared(data, tree, num_processors, g, p, num_buckets) default(none)
+      for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
+        repair(data, tree, g, (section_t *) p, num_processors, bucket_id);
       }
+      first_round = false;
     }
+    return true;
   }
 
-  void permute(tuple_t *data, const tuple_key_t *thresholds, const size_t &num_thresholds, section_t *p,
+  // Afterwards every stripe holds its correctly placed records in [start, head)
+  // and only misplaced ones in [head, tail).
+  void permute(tuple_t *data, const splitter_tree &tree, section_t *p,
                const size_t &num_threads, const size_t &thread_id, const size_t &num_buckets) {
     for (size_t bucket_id = 0; bucket_id < num_buckets; bucket_id++) {
-      size_t head = ((p + bucket_id * num_threads) + thread_id)->head;
-      while (head < ((p + bucket_id * num_threads) + thread_id)->tail) {
-        tuple_t &v = data[head];
-        size_t k = bucket(v, thresholds, num_thresholds);
-        while (k != bucket_id &&
-               ((p + k * num_threads) + thread_id)->head < ((p + k * num_threads) + thread_id)->tail) {
-          std::swap(v, data[((p + k * num_threads) + thread_id)->head++]);
-          k = bucket(v, thresholds, num_thresholds);
+      section_t &own = p[bucket_id * num_threads + thread_id];
+      for (size_t head = own.head; head < own.tail; head++) {
+        size_t k = tree.bucket(data[head]);
+        while (k != bucket_id && p[k * num_threads + thread_id].head < p[k * num_threads + thread_id].tail) {
+          std::swap(data[head], data[p[k * num_threads + thread_id].head++]);
+          k = tree.bucket(data[head]);
         }
-        head++;
         if (k == bucket_id) {
-          ((p + bucket_id * num_threads) + thread_id)->head++;
+          std::swap(data[head], data[own.head++]);
         }
       }
     }
   }
 
-  void repair(tuple_t *data, const tuple_key_t *thresholds, const size_t &num_thresholds, section_t *g, section_t *p,
+  // Move the misplaced records left in bucket_id's stripes to the end of the bucket,
+  // so that g[bucket_id] shrinks to the range that still needs another round.
+  void repair(tuple_t *data, const splitter_tree &tree, section_t *g, section_t *p,
               const size_t &num_threads, const size_t &bucket_id) {
     size_t tail = g[bucket_id].tail;
     for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
-      size_t head = ((p + bucket_id * num_threads) + thread_id)->head;
-      while (head < ((p + bucket_id * num_threads) + thread_id)->tail && head < tail) {
-        tuple_t &v = data[head++];
-        if (bucket(v, thresholds, num_thresholds) != bucket_id) {
-          while (head < tail) {
-            tuple_t &w = data[--tail];
-            if (bucket(w, thresholds, num_thresholds) == bucket_id) {
-              std::swap(v, w);
-              break;
-            }
-          }
+      section_t &stripe = p[bucket_id * num_threads + thread_id];
+      for (size_t head = stripe.head; head < stripe.tail && head < tail; head++) {
+        if (tree.bucket(data[head]) == bucket_id) {
+          continue;
+        }
+        while (tail > head + 1 && tree.bucket(data[tail - 1]) != bucket_id) {
+          tail--;
+        }
+        if (tail > head + 1) {
+          std::swap(data[head], data[--tail]);
+        } else {
+          tail = head;
         }
       }
     }
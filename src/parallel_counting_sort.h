@@ -7,14 +7,21 @@
 
 #include <cstddef>
 #include "global.h"
+#include "splitter_tree.h"
 
 namespace counting_sort {
-  size_t bucket(tuple_t &data, const tuple_key_t *thresholds, const size_t &num_thresholds);
-  void parallel_counting_sort(tuple_t *data, size_t sz, tuple_key_t *thresholds,
+  // Sample sort of a buffer of default layout records (-m counting): splitters sampled from the buffer cut
+  // it into NUM_BUCKETS key ranges by parallel_counting_sort, and the ranges are then radix sorted one per
+  // thread at a time
+  void sort(tuple_t *data, size_t sz, size_t num_threads);
+
+  // Moves the records of data into num_buckets key ranges cut at thresholds, bucket b holding buckets[b] of
+  // them. Returns false, with data and buckets untouched, if its histogram can't be allocated.
+  bool parallel_counting_sort(tuple_t *data, size_t sz, tuple_key_t *thresholds,
                               size_t *buckets, size_t num_buckets, size_t num_processors);
-  void permute(tuple_t *data, const tuple_key_t *thresholds, const size_t &num_thresholds, section_t *p,
+  void permute(tuple_t *data, const splitter_tree &tree, section_t *p,
                const size_t &num_threads, const size_t &thread_id, const size_t &num_buckets);
-  void repair(tuple_t *data, const tuple_key_t *thresholds, const size_t &num_thresholds, section_t *g, section_t *p,
+  void repair(tuple_t *data, const splitter_tree &tree, section_t *g, section_t *p,
               const size_t &num_threads, const size_t &bucket_id);
 }
 
@@ -3,118 +3,397 @@
 //
 
 #include "parallel_radix_sort.h"
+#include "histogram.h"
+#include "telemetry.h"
 
 #include <cstdio>
 #include <utility>
 #include <algorithm>
 #include <cstring>
 #include <cmath>
+#include <vector>
 #include <omp.h>
 
 namespace radix_sort {
 
-  template void parallel_radix_sort<tuple_key_t>(tuple_key_t *, size_t, size_t);
-  template void parallel_radix_sort<tuple_t>(tuple_t *, size_t, size_t);
+  // Insertion sort of fewer than SMALL_SORT_THRESHOLD entries on their normalized keys. Only the
+  // (key, position) pairs move while sorting; the entries are moved once, through a scratch copy.
+  template<class T>
+  static void small_sort(T *data, size_t sz) {
+    typedef typename T::layout L;
+    normalized_key_t keys[SMALL_SORT_THRESHOLD];
+    uint8_t order[SMALL_SORT_THRESHOLD];
+    for (size_t i = 0; i < sz; i++) {
+      normalized_key_t key = L::normalize(T::key_of(data[i]));
+      size_t j = i;
+      while (j > 0 && (keys[j - 1] > key ||
+                       (L::key_length > 16 && keys[j - 1] == key &&
+                        L::compare_rest(T::key_of(data[order[j - 1]]), T::key_of(data[i])) > 0))) {
+        keys[j] = keys[j - 1];
+        order[j] = order[j - 1];
+        j--;
+      }
+      keys[j] = key;
+      order[j] = (uint8_t) i;
+    }
+
+    T sorted[SMALL_SORT_THRESHOLD];
+    for (size_t i = 0; i < sz; i++) {
+      sorted[i] = data[order[i]];
+    }
+    memcpy(data, sorted, sizeof(T) * sz);
+  }
 
+  // First level at or after `level` whose digit isn't the same for all sz entries, T::key_length if
+  // their keys are all equal. Only the first 16 digits are looked at, as normalized keys.
   template<class T>
-  void parallel_radix_sort(T *data, size_t sz, size_t level) {
-    if (sz < 64) {
-      std::sort(data, data + sz);
+  static size_t first_distinct_level(const T *data, size_t sz, size_t level, size_t num_threads) {
+    typedef typename T::layout L;
+    if (level >= 16) {
+      return level;
+    }
+    normalized_key_t lo = L::normalize(T::key_of(data[0])), hi = lo;
+    #pragma omp parallel num_threads(num_threads) shared(data, sz, lo, hi) default(none)
+    {
+      normalized_key_t own_lo = lo, own_hi = hi;
+      #pragma omp for schedule(static)
+      for (size_t i = 1; i < sz; i++) {
+        normalized_key_t key = L::normalize(T::key_of(data[i]));
+        own_lo = key < own_lo ? key : own_lo;
+        own_hi = key > own_hi ? key : own_hi;
+      }
+      #pragma omp critical
+      {
+        lo = own_lo < lo ? own_lo : lo;
+        hi = own_hi > hi ? own_hi : hi;
+      }
+    }
+    normalized_key_t diff = lo ^ hi;
+    if (diff == 0) {
+      return L::key_length <= 16 ? L::key_length : 16;
+    }
+    uint64_t high = (uint64_t) (diff >> 64);
+    size_t common = high != 0 ? __builtin_clzll(high) / 8 : 8 + __builtin_clzll((uint64_t) diff) / 8;
+    return common > level ? common : level;
+  }
+
+  static void record_level(const size_t *buckets, size_t level) {
+    if (telemetry::enabled()) {
+      size_t touched = 0;
+      for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
+        touched += buckets[bucket_id] > 0;
+      }
+      telemetry::record(telemetry::RADIX_PARTITIONS, 1);
+      telemetry::record(telemetry::BUCKETS_TOUCHED, touched);
+      telemetry::record_maximum(telemetry::RADIX_DEPTH, level + 1);
+    }
+  }
+
+  // A partition left for the task pool: sz entries from data + head, sorted from digit `level` on
+  typedef struct sort_task {
+    size_t head;
+    size_t size;
+    size_t level;
+  } sort_task_t;
+
+  // MSD radix sort of a partition by the calling thread alone. Within the task pool (spawn), every
+  // bucket of at least TASK_CUTOFF entries becomes a task of its own that any idle thread may take;
+  // smaller ones are sorted inline, so the pool isn't flooded with tasks too small to pay for themselves.
+  template<class T>
+  static void sort_partition(T *data, size_t sz, size_t level, bool spawn) {
+    if (sz < SMALL_SORT_THRESHOLD) {
+      small_sort(data, sz);
       return;
     }
+    telemetry::scoped_timer timer(telemetry::SORT_NS);
 
     size_t buckets[NUM_BUCKETS];
+    section_t g[NUM_BUCKETS];
     memset(buckets, 0, sizeof(size_t) * NUM_BUCKETS);
-
-    // Build histogram
-    #pragma omp parallel for shared(data, sz, level, buckets) default(none)
     for (size_t i = 0; i < sz; i++) {
-      size_t b = bucket(&data[i], level);
-      #pragma omp atomic
-      buckets[b]++;
+      buckets[T::digit(data[i], level)]++;
     }
+    histogram::prefix_sum(buckets, 1, NUM_BUCKETS, buckets, g, NULL);
+    record_level(buckets, level);
 
-    size_t sum = 0;
-    section_t g[NUM_BUCKETS];
-
-    // Set bucket [head, tail]
-    for (size_t i = 0; i < NUM_BUCKETS; i++) {
-      g[i].head = sum;
-      sum += buckets[i];
-      g[i].tail = sum;
+    // All in one bucket, as with shared prefixes or low-entropy keys: nothing to permute. Skip every digit
+    // the keys have in common at once, and stop if they have no other.
+    if (buckets[T::digit(data[0], level)] == sz) {
+      size_t next = first_distinct_level(data, sz, level + 1, 1);
+      if (next < T::key_length) {
+        sort_partition(data, sz, next, spawn);
+      }
+      return;
     }
 
     for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
       size_t head = g[bucket_id].head;
       while (head < g[bucket_id].tail) {
-        size_t b = bucket(&data[head], level);
+        size_t b = T::digit(data[head], level);
         while (b != bucket_id) {
           std::swap(data[head], data[g[b].head++]);
-          b = bucket(&data[head], level);
+          b = T::digit(data[head], level);
         }
         head++;
       }
     }
 
-    if (level < KEY_SIZE) {
-      size_t offsets[NUM_BUCKETS];
-      offsets[0] = 0;
-      for (size_t i = 1; i < NUM_BUCKETS; i++) {
-        offsets[i] = g[i - 1].tail;
+    if (level + 1 < T::key_length) {
+      size_t next_level = level + 1;
+      for (size_t bucket_id = 0, head = 0; bucket_id < NUM_BUCKETS; head += buckets[bucket_id++]) {
+        T *bucket = data + head;
+        size_t size = buckets[bucket_id];
+        if (spawn && size >= TASK_CUTOFF) {
+          #pragma omp task firstprivate(bucket, size, next_level) default(none)
+          sort_partition(bucket, size, next_level, true);
+        } else {
+          sort_partition(bucket, size, next_level, spawn);
+        }
       }
+    }
+  }
 
-      #pragma omp parallel for shared(data, offsets, buckets, level) default(none)
-      for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
-        parallel_radix_sort(data + offsets[bucket_id], buckets[bucket_id], level + 1);
+  // The top levels, partitioned by all threads together (PARADIS). Buckets large enough for a parallel
+  // partition of their own are recursed into one at a time, the rest are left in `tasks` for the pool.
+  template<class T>
+  static void sort_cooperatively(T *data, size_t head, size_t sz, size_t level, size_t num_threads,
+                                 std::vector<sort_task_t> &tasks) {
+    size_t *counts = sz >= PARALLEL_PARTITION_THRESHOLD ? histogram::allocate(num_threads, NUM_BUCKETS) : NULL;
+    if (counts == NULL) {
+      sort_task_t task = {head, sz, level};
+      tasks.push_back(task);
+      return;
+    }
+    telemetry::scoped_timer timer(telemetry::SORT_NS);
+    T *partition = data + head;
+    size_t buckets[NUM_BUCKETS];
+    section_t g[NUM_BUCKETS];
+
+    // Build histogram, one padded row of counters per thread
+    size_t stride = histogram::row_size(NUM_BUCKETS);
+    #pragma omp parallel num_threads(num_threads) shared(partition, sz, level, counts, stride) default(none)
+    {
+      size_t *row = counts + omp_get_thread_num() * stride;
+      #pragma omp for schedule(static)
+      for (size_t i = 0; i < sz; i++) {
+        row[T::digit(partition[i], level)]++;
+      }
+    }
+
+    // Set bucket [head, tail], and each thread's share of it for the first parallel round
+    section_t *p = new section_t[NUM_BUCKETS * num_threads];
+    histogram::prefix_sum(counts, num_threads, NUM_BUCKETS, buckets, g, p);
+    histogram::release(counts);
+    record_level(buckets, level);
+
+    // See sort_partition
+    if (buckets[T::digit(partition[0], level)] == sz) {
+      delete[] p;
+      size_t next = first_distinct_level(partition, sz, level + 1, num_threads);
+      if (next < T::key_length) {
+        sort_cooperatively(data, head, sz, next, num_threads, tasks);
+      }
+      return;
+    }
+
+    section_t work[NUM_BUCKETS];
+    memcpy(work, g, sizeof(section_t) * NUM_BUCKETS);
+    parallel_partition(partition, level, work, p, num_threads);
+    delete[] p;
+
+    if (level + 1 < T::key_length) {
+      for (size_t bucket_id = 0, offset = head; bucket_id < NUM_BUCKETS; offset += buckets[bucket_id++]) {
+        if (buckets[bucket_id] >= PARALLEL_PARTITION_THRESHOLD) {
+          sort_cooperatively(data, offset, buckets[bucket_id], level + 1, num_threads, tasks);
+        } else if (buckets[bucket_id] > 1) {
+          sort_task_t task = {offset, buckets[bucket_id], level + 1};
+          tasks.push_back(task);
+        }
       }
     }
   }
 
-  // 8-bit used for radix
-  size_t bucket(void *data, const size_t &level) {
-    return (size_t) (*(static_cast<char *>(data) + level) & 0xFF);
+  // Sorts every partition of tasks on one team of threads. The partitions and the buckets they spawn
+  // are OpenMP tasks, which idle threads take from the others, so a few large or skewed buckets don't
+  // leave the rest of the team waiting the way a static split over the buckets would.
+  template<class T>
+  static void run_tasks(T *data, std::vector<sort_task_t> &tasks, size_t num_threads) {
+    // Largest first, so that the biggest partition isn't the one that starts last
+    std::sort(tasks.begin(), tasks.end(), [](const sort_task_t &a, const sort_task_t &b) {
+      return a.size > b.size;
+    });
+    #pragma omp parallel num_threads(num_threads) shared(data, tasks) default(none)
+    #pragma omp single
+    for (size_t i = 0; i < tasks.size(); i++) {
+      #pragma omp task firstprivate(i) shared(data, tasks) default(none)
+      sort_partition(data + tasks[i].head, tasks[i].size, tasks[i].level, true);
+    }
   }
 
+  template<class T>
+  void parallel_radix_sort(T *data, size_t sz, size_t level) {
+    size_t num_threads = omp_in_parallel() ? 1 : omp_get_max_threads();
+    if (num_threads == 1) {
+      sort_partition(data, sz, level, false);
+      return;
+    }
+    std::vector<sort_task_t> tasks;
+    sort_cooperatively(data, 0, sz, level, num_threads, tasks);
+    run_tasks(data, tasks, num_threads);
+  }
+
+  // Sort (key, index) entries, 16 bytes for the default layout, instead of the records themselves.
+  // refs must hold sz entries; data is left untouched.
+  template<class L>
+  void parallel_indirect_sort(const record<L> *data, size_t sz, record_ref<L> *refs) {
+    #pragma omp parallel for shared(data, sz, refs) default(none)
+    for (size_t i = 0; i < sz; i++) {
+      memcpy(refs[i].key, data[i].key(), L::key_length);
+      refs[i].index = (uint32_t) i;
+    }
+    parallel_radix_sort(refs, sz, 0);
+  }
+
+  // out[i] = data[refs[i].index], processed in blocks small enough to stay in cache
+  // while the random reads of the next tuples are prefetched.
+  template<class L>
+  void gather(const record<L> *data, const record_ref<L> *refs, size_t sz, record<L> *out) {
+    const size_t block_size = 2048;
+    const size_t prefetch_distance = 16;
+    #pragma omp parallel for shared(data, refs, sz, out, block_size, prefetch_distance) default(none)
+    for (size_t block = 0; block < sz; block += block_size) {
+      telemetry::scoped_timer timer(telemetry::SORT_NS);
+      size_t end = block + block_size < sz ? block + block_size : sz;
+      for (size_t i = block; i < end; i++) {
+        if (i + prefetch_distance < end) {
+          const char *next = data[refs[i + prefetch_distance].index].data;
+          __builtin_prefetch(next);
+          __builtin_prefetch(next + L::size - 1);
+        }
+        memcpy(&out[i], &data[refs[i].index], L::size);
+      }
+    }
+  }
+
+  // In-place parallel distribution (PARADIS). g[b] is the [head, tail) range bucket b must end up in.
+  // p (NUM_BUCKETS x num_threads sections) holds the first round's stripes, as produced by
+  // histogram::prefix_sum, and is reused as scratch afterwards.
+  // Each round splits every bucket's unplaced range into one stripe per thread, permutes the stripes
+  // independently and then repairs each bucket, leaving only the misplaced records for the next round.
+  // Once little is left (or a round makes no progress) a single stripe per bucket finishes the job,
+  // which is exactly the serial American flag permutation.
+  template<class T>
+  void parallel_partition(T *data, const size_t &level, section_t *g, section_t *p, const size_t &num_threads) {
+    size_t last_remaining = 0;
+    bool first_round = true;
+
+    while (true) {
+      size_t remaining = 0;
+      for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
+        remaining += g[bucket_id].tail - g[bucket_id].head;
+      }
+      if (remaining == 0) {
+        break;
+      }
+
+      size_t needed_threads = num_threads;
+      if (!first_round &&
+          (remaining < PARALLEL_PARTITION_THRESHOLD || remaining >= last_remaining)) {
+        needed_threads = 1;
+      }
+      last_remaining = remaining;
+
+      // Partition for permutation
+      for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS && !first_round; bucket_id++) {
+        size_t total = g[bucket_id].tail - g[bucket_id].head;
+        size_t stripes = total < needed_threads ? 1 : needed_threads;
+        size_t chunk_size = total / stripes;
+        section_t *stripe = p + bucket_id * num_threads;
+        for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
+          if (thread_id < stripes) {
+            stripe[thread_id].head = g[bucket_id].head + chunk_size * thread_id;
+            stripe[thread_id].tail = thread_id == stripes - 1 ? g[bucket_id].tail
+                                                              : stripe[thread_id].head + chunk_size;
+          } else {
+            stripe[thread_id].head = stripe[thread_id].tail = g[bucket_id].tail;
+          }
+        }
+      }
+
+      // Permutation stage
+      #pragma omp parallel for num_threads(needed_threads) shared(data, level, p, num_threads, needed_threads) default(none)
+      for (size_t thread_id = 0; thread_id < needed_threads; thread_id++) {
+        telemetry::scoped_timer timer(telemetry::SORT_NS);
+        permute(data, level, p, num_threads, thread_id);
+      }
+
+      // Repair stage
+      #pragma omp parallel for shared(data, level, g, p, num_threads) default(none)
+      for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
+        telemetry::scoped_timer timer(telemetry::SORT_NS);
+        repair(data, level, g, p, num_threads, bucket_id);
+      }
+      first_round = false;
+    }
+  }
+
+  // Afterwards every stripe holds its correctly placed records in [start, head)
+  // and only misplaced ones in [head, tail).
   template<class T>
   void permute(T *data, const size_t &level, section_t *p, const size_t &num_threads, const size_t &thread_id) {
     for (size_t bucket_id = 0; bucket_id < NUM_BUCKETS; bucket_id++) {
-      size_t head = ((p + bucket_id * num_threads) + thread_id)->head;
-      while (head < ((p + bucket_id * num_threads) + thread_id)->tail) {
-        T &v = data[head];
-        size_t k = bucket(&v, level);
-        while (k != bucket_id &&
-               ((p + k * num_threads) + thread_id)->head < ((p + k * num_threads) + thread_id)->tail) {
-          std::swap(v, data[((p + k * num_threads) + thread_id)->head++]);
-          k = bucket(&v, level);
+      section_t &own = p[bucket_id * num_threads + thread_id];
+      for (size_t head = own.head; head < own.tail; head++) {
+        size_t k = T::digit(data[head], level);
+        while (k != bucket_id && p[k * num_threads + thread_id].head < p[k * num_threads + thread_id].tail) {
+          std::swap(data[head], data[p[k * num_threads + thread_id].head++]);
+          k = T::digit(data[head], level);
         }
-        head++;
         if (k == bucket_id) {
-          ((p + bucket_id * num_threads) + thread_id)->head++;
+          std::swap(data[head], data[own.head++]);
         }
       }
     }
   }
 
+  // Move the misplaced records left in bucket_id's stripes to the end of the bucket,
+  // so that g[bucket_id] shrinks to the range that still needs another round.
   template<class T>
   void repair(T *data, const size_t &level, section_t *g, section_t *p, const size_t &num_threads,
               const size_t &bucket_id) {
     size_t tail = g[bucket_id].tail;
     for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
-      size_t head = ((p + bucket_id * num_threads) + thread_id)->head;
-      while (head < ((p + bucket_id * num_threads) + thread_id)->tail && head < tail) {
-        T &v = data[head++];
-        if (bucket(&v, level) != bucket_id) {
-          while (head < tail) {
-            T &w = data[--tail];
-            if (bucket(&w, level) == bucket_id) {
-              std::swap(v, w);
-              break;
-            }
-          }
+      section_t &stripe = p[bucket_id * num_threads + thread_id];
+      for (size_t head = stripe.head; head < stripe.tail && head < tail; head++) {
+        if (T::digit(data[head], level) == bucket_id) {
+          continue;
+        }
+        while (tail > head + 1 && T::digit(data[tail - 1], level) != bucket_id) {
+          tail--;
+        }
+        if (tail > head + 1) {
+          std::swap(data[head], data[--tail]);
+        } else {
+          tail = head;
         }
       }
     }
     g[bucket_id].head = tail;
   }
 
+  // Records, keys and indirect entries of every layout; the digits are the layout's key bytes (8-bit radix)
+#define INSTANTIATE_RADIX_SORT(SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE) \
+  template void parallel_radix_sort(record<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, size_t, size_t); \
+  template void parallel_radix_sort(record_key<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, size_t, \
+                                    size_t); \
+  template void parallel_radix_sort(record_ref<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, size_t, \
+                                    size_t); \
+  template void parallel_indirect_sort(const record<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, \
+                                       size_t, record_ref<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *); \
+  template void gather(const record<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, \
+                       const record_ref<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *, size_t, \
+                       record<record_layout<SIZE, KEY_OFFSET, KEY_LENGTH, KEY_TYPE>> *);
+
+  FOR_EACH_RECORD_LAYOUT(INSTANTIATE_RADIX_SORT)
+
 }
@@ -8,13 +8,17 @@
 #include <cstddef>
 #include "global.h"
 
-typedef struct tuple_key tuple_key_t;
-
 namespace radix_sort {
   template<typename T>
   void parallel_radix_sort(T *data, size_t sz, size_t level);
 
-  size_t bucket(void *data, const size_t &level);
+  template<class L>
+  void parallel_indirect_sort(const record<L> *data, size_t sz, record_ref<L> *refs);
+  template<class L>
+  void gather(const record<L> *data, const record_ref<L> *refs, size_t sz, record<L> *out);
+
+  template<class T>
+  void parallel_partition(T *data, const size_t &level, section_t *g, section_t *p, const size_t &num_threads);
   template<class T>
   void permute(T *data, const size_t &level, section_t *p, const size_t &num_threads, const size_t &thread_id);
   template<class T>
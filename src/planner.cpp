@@ -0,0 +1,259 @@
+#include "planner.h"
+#include "async_io.h"
+#include "k_way_merge.h"
+#include "run_codec.h"
+#include "layout_engine.h"
+#include "top_k.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+namespace planner {
+
+  static size_t align_down(size_t size, size_t unit) {
+    return size / unit * unit;
+  }
+
+  // Runs of the first merge; as many as the fan-in allows for a stream
+  static size_t first_merge_runs(const param_t &param) {
+    return param.streaming ? param.fan_in : std::min(param.num_partitions, param.fan_in);
+  }
+
+  bool plan(param_t &param) {
+    size_t budget = align_down(param.memory_budget, IO_UNIT);
+    bool indirect = param.sort_mode == SORT_INDIRECT;
+    size_t record_size = param.engine->record_size;
+
+    // Splitter sampling, the counting sort and the block codec are written for the default layout's keys
+    if (param.engine != layout::default_engine()) {
+      if (param.num_ranges > 1) {
+        printf("[Plan] key ranges need the default record layout, using a cascaded merge\n");
+        param.num_ranges = 0;
+      }
+      if (param.compress) {
+        printf("[Plan] compressed runs need the default record layout, writing plain runs\n");
+        param.compress = false;
+      }
+      if (param.sort_mode == SORT_COUNTING) {
+        printf("[Plan] counting sort needs the default record layout, sorting in place\n");
+        param.sort_mode = SORT_IN_PLACE;
+      }
+    }
+
+    // The top records are cut from the front of a single merge of plain runs (or never reach runs at all),
+    // and key-range files cut the same way unless sample sort splits the runs into key ranges already
+    if (param.top_k > 0) {
+      if (param.num_ranges > 1) {
+        printf("[Plan] the top records are cut from a single merge, using a cascaded merge\n");
+        param.num_ranges = 0;
+      }
+      if (param.run_mode == RUN_REPLACEMENT) {
+        printf("[Plan] the top records are cut from sorted run buffers, not replacement selection\n");
+      }
+      param.run_mode = RUN_RADIX;
+    }
+    // Splitters are sampled from the whole input before phase1, which a stream doesn't have yet
+    if (param.streaming && param.num_ranges > 1) {
+      printf("[Plan] key ranges need a seekable input, using a cascaded merge\n");
+      param.num_ranges = 0;
+    }
+    if ((param.top_k > 0 || param.num_outputs > 0) && param.num_ranges <= 1 && param.compress) {
+      printf("[Plan] the final merge is cut by merge path, which needs plain runs, writing plain runs\n");
+      param.compress = false;
+    }
+
+    // Phase 1: run buffers, plus one (key, index) entry per tuple and the gather staging buffer
+    // when sorting indirectly, and the staging buffer of compressed blocks.
+    // Whatever fits in one buffer is sorted in memory.
+    size_t staging = (indirect ? GATHER_BUFFER_SIZE : 0) + (param.compress ? COMPRESS_BUFFER_SIZE : 0);
+    size_t bytes_per_tuple = record_size + (indirect ? param.engine->ref_size : 0);
+    size_t padding = 3 * IO_BLOCK_SIZE; // Aligning the entries and the staging buffers
+    if (budget <= staging + padding + MIN_MERGE_CHUNK * 2) {
+      printf("[Error] memory budget of %zu bytes is too small\n", param.memory_budget);
+      return false;
+    }
+    size_t tuples_in_budget = (budget - staging - padding) / bytes_per_tuple;
+
+    // Appending always goes through runs, for the final merge with the base file, and key-range files
+    // through a merge cut into them
+    param.in_memory = !param.streaming && param.base_filename == NULL && param.num_outputs == 0 &&
+                      param.file_size / record_size <= tuples_in_budget;
+    param.heap_select = !param.in_memory && top_k::fits(param);
+    if (param.in_memory || param.heap_select) {
+      param.compress = false;
+      param.run_size = param.file_size;
+      param.num_partitions = 1;
+      param.fan_in = param.merge_passes = param.merge_workers = 0;
+      param.merge_buffer_size = param.output_buffer_size = 0;
+      return true;
+    }
+
+    // Whole I/O blocks per run, so that run files can be written with O_DIRECT
+    param.run_size = tuples_in_budget / param.num_buffers * record_size;
+    if (param.run_size >= IO_UNIT) {
+      param.run_size = align_down(param.run_size, IO_UNIT);
+    }
+    if (param.run_size == 0) {
+      printf("[Error] memory budget of %zu bytes can't hold %zu run buffers\n", param.memory_budget,
+             param.num_buffers);
+      return false;
+    }
+    param.num_partitions = param.streaming ? 0 : std::max((param.file_size + param.run_size - 1) / param.run_size,
+                                                          (size_t) 1);
+
+    // Phase 2: two thirds of the budget for the run chunks, one third for the output buffers.
+    // Every run has two chunks (one merged, one read ahead), plus one for compressed blocks, of at least
+    // MIN_MERGE_CHUNK, which bounds the fan-in; more runs than that are merged in several (cascaded) passes.
+    size_t chunks_per_run = param.compress ? 3 : 2;
+    param.output_buffer_size = align_down(budget / 3, IO_UNIT);
+    param.merge_buffer_size = budget - param.output_buffer_size;
+    param.fan_in = param.merge_buffer_size / (chunks_per_run * MIN_MERGE_CHUNK);
+    if (param.fan_in < 2) {
+      param.fan_in = 2;
+    }
+    param.merge_passes = 1;
+    for (size_t runs = param.num_partitions; runs > param.fan_in; runs = (runs - 1) / param.fan_in + 1) {
+      param.merge_passes++;
+    }
+
+    if (param.base_filename != NULL && param.num_ranges > 1) {
+      printf("[Plan] appending merges the input into the base file at once, using a cascaded merge\n");
+      param.num_ranges = 0;
+    }
+
+    // Sample sort merges every key range from all runs at once, so each concurrent range merge
+    // needs its own chunks of MIN_MERGE_CHUNK for every run.
+    // Otherwise the final merge is split by merge path over as many workers as it has chunks for.
+    param.merge_workers = 1;
+    if (param.num_ranges > 1) {
+      size_t workers = merge_workers(param, param.num_partitions);
+      workers = workers < param.num_ranges ? workers : param.num_ranges;
+      if (workers == 0) {
+        printf("[Plan] key ranges are merged from all runs at once, which takes at most %zu runs in this "
+               "budget, not %zu; using a cascaded merge (a larger -M raises the limit)\n",
+               param.merge_buffer_size / (chunks_per_run * MIN_MERGE_CHUNK), param.num_partitions);
+        param.num_ranges = 0;
+        if (param.num_outputs > 0 && param.compress) {
+          printf("[Plan] the final merge is cut by merge path, which needs plain runs, writing plain runs\n");
+          param.compress = false;
+        }
+      } else {
+        param.merge_workers = workers;
+      }
+    } else if (!param.compress) {
+      param.merge_workers = std::max(merge_workers(param, first_merge_runs(param)), (size_t) 1);
+    }
+
+    // A compressed block, and its compressed form, has to fit the smallest read chunk of the first merge
+    if (param.compress) {
+      size_t chunk = param.num_ranges > 1 ?
+                     merge::chunk_size(align_down(param.merge_buffer_size / param.merge_workers, IO_UNIT),
+                                       param.num_partitions, chunks_per_run, TUPLE_SIZE) :
+                     merge::chunk_size(param.merge_buffer_size, first_merge_runs(param), chunks_per_run, TUPLE_SIZE);
+      param.block_size = chunk > codec::block_bound(0) ? chunk - codec::block_bound(0) : 0;
+      param.block_size = align_down(std::min(param.block_size, (size_t) RUN_BLOCK_SIZE), TUPLE_SIZE);
+      if (param.block_size == 0) {
+        printf("[Plan] merge chunks are too small for compressed blocks, writing plain runs\n");
+        param.compress = false;
+      }
+    }
+
+    // Replacement selection writes each run as one stream of plain records, cut wherever the keys say
+    if (param.run_mode == RUN_REPLACEMENT && (param.num_ranges > 1 || param.compress)) {
+      printf("[Plan] replacement selection writes plain runs without key ranges, sorting run buffers\n");
+      param.run_mode = RUN_RADIX;
+    }
+    // The choice is made on a sample of the input, which a stream doesn't have yet
+    if (param.run_mode == RUN_AUTO && (param.num_ranges > 1 || param.compress || param.streaming)) {
+      param.run_mode = RUN_RADIX;
+    }
+    return true;
+  }
+
+  size_t merge_workers(const param_t &param, size_t num_runs) {
+    size_t chunks_per_run = param.compress ? 3 : 2;
+    size_t workers = param.merge_buffer_size / (std::max(num_runs, (size_t) 1) * chunks_per_run * MIN_MERGE_CHUNK);
+    return std::min(workers, param.num_threads);
+  }
+
+  void print(const param_t &param) {
+    printf("[Plan] memory budget: %zu bytes, threads: %zu\n", param.memory_budget, param.num_threads);
+    if (param.engine != layout::default_engine()) {
+      printf("[Plan] records of %zu bytes, %zu byte %s key at offset %zu\n", param.engine->record_size,
+             param.engine->key_length, layout::key_type_name(param.engine->key_type), param.engine->key_offset);
+    }
+    if (param.top_k > 0) {
+      printf("[Plan] top %zu records only%s\n", param.top_k,
+             param.heap_select ? ", selected by a heap in one pass" :
+             param.in_memory ? "" : ", runs and merge cut after that many");
+    }
+    if (param.in_memory) {
+      printf("[Plan] sorting %zu bytes in memory\n", param.file_size);
+      return;
+    }
+    if (param.heap_select) {
+      return;
+    }
+    if (param.streaming) {
+      printf("[Plan] streamed input, runs of %zu bytes (%zu pipeline buffers)\n", param.run_size, param.num_buffers);
+    } else {
+      printf("[Plan] %zu runs of %zu bytes (%zu pipeline buffers)\n", param.num_partitions, param.run_size,
+             param.num_buffers);
+    }
+    if (param.base_filename != NULL) {
+      printf("[Plan] merged into sorted file %s (%zu bytes)\n", param.base_filename, param.base_size);
+    }
+    if (param.run_mode == RUN_REPLACEMENT) {
+      printf("[Plan] runs by replacement selection, their number only known afterwards\n");
+    } else if (param.run_mode == RUN_AUTO) {
+      printf("[Plan] runs by replacement selection if the input samples nearly sorted\n");
+    }
+    printf("[Plan] merge fan-in: %zu, passes: %zu, read chunk: %zu bytes, output buffer: %zu bytes\n",
+           param.fan_in, param.merge_passes,
+           merge::chunk_size(param.merge_buffer_size, first_merge_runs(param), param.compress ? 3 : 2,
+                             param.engine->record_size),
+           param.output_buffer_size);
+    printf("[Plan] merge I/O: %s, queue depth: %zu\n", io::async_engine(param.queue_depth), param.queue_depth);
+    if (param.num_tmp_directories > 1) {
+      printf("[Plan] runs striped over %zu temporary directories:", param.num_tmp_directories);
+      for (size_t i = 0; i < param.num_tmp_directories; i++) {
+        printf(" %s", param.tmp_directories[i]);
+      }
+      printf("\n");
+    }
+    if (param.compress) {
+      printf("[Plan] compressed runs, blocks of %zu bytes\n", param.block_size);
+    }
+    if (param.num_outputs > 0) {
+      printf("[Plan] output in %zu key-range files, %s\n", param.num_outputs,
+             param.num_ranges > 1 ? "one per sampled key range" : "cut from the final merge by merge path");
+    }
+    if (param.num_ranges > 1) {
+      printf("[Plan] %zu key ranges merged by %zu workers\n", param.num_ranges, param.merge_workers);
+    } else if (param.merge_workers > 1) {
+      printf("[Plan] final merge split by merge path over up to %zu workers\n", param.merge_workers);
+    }
+  }
+
+  size_t parse_size(const char *str) {
+    char *end;
+    size_t size = strtoull(str, &end, 10);
+    switch (*end) {
+      case 'K':
+      case 'k':
+        return size * 1000;
+      case 'M':
+      case 'm':
+        return size * 1000 * 1000;
+      case 'G':
+      case 'g':
+        return size * 1000 * 1000 * 1000;
+      case '\0':
+        return size;
+      default:
+        return 0;
+    }
+  }
+
+}
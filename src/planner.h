@@ -0,0 +1,23 @@
+#ifndef MULTICORE_EXTERNAL_SORT_PLANNER_H
+#define MULTICORE_EXTERNAL_SORT_PLANNER_H
+
+#include <cstddef>
+#include "global.h"
+
+namespace planner {
+  // Derive the run size, merge fan-in and every buffer size from param.memory_budget, num_threads,
+  // num_buffers, sort_mode, num_ranges, compress and file_size. Returns false if the budget is too small.
+  // A streamed input is never sorted in memory; its runs are counted as they are read. The top_k records
+  // are selected in memory (heap_select) if they fit it, without runs. Key ranges (num_ranges) are dropped
+  // for a cascaded merge when there are more runs than the fan-in, since each range is merged from all of
+  // the runs in a single pass.
+  bool plan(param_t &param);
+  void print(const param_t &param);
+  // Concurrent merges of num_runs runs that the merge buffer holds chunks for, at most one per thread
+  size_t merge_workers(const param_t &param, size_t num_runs);
+
+  // "1800000000", "512M", "4G", ... Returns 0 if str isn't a size.
+  size_t parse_size(const char *str);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_PLANNER_H
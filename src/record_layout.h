@@ -0,0 +1,260 @@
+#ifndef MULTICORE_EXTERNAL_SORT_RECORD_LAYOUT_H
+#define MULTICORE_EXTERNAL_SORT_RECORD_LAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define KEY_BYTES (0)    // Unsigned bytes in memcmp order, which is also the order of big-endian unsigned integers
+#define KEY_INT_BE (1)   // Two's complement big-endian integer
+#define KEY_UINT_LE (2)  // Unsigned little-endian integer
+
+// The layouts the sort and merge engines are compiled for, as (record size, key offset, key length, key type).
+// Each one is selected at runtime with -l size:key_offset:key_length:type; add a line here for another one.
+// Record sizes have to divide IO_UNIT, so that runs and I/O chunks stay whole records.
+#define FOR_EACH_RECORD_LAYOUT(X) \
+  X(100, 0, 10, KEY_BYTES)        \
+  X(16, 0, 8, KEY_BYTES)          \
+  X(16, 8, 8, KEY_UINT_LE)        \
+  X(64, 0, 8, KEY_INT_BE)         \
+  X(64, 8, 16, KEY_BYTES)         \
+  X(256, 0, 16, KEY_BYTES)        \
+  X(256, 32, 8, KEY_UINT_LE)
+
+// A key's first 16 digits as one unsigned integer, so that comparing two of them is a single integer compare.
+typedef unsigned __int128 normalized_key_t;
+
+// Where the key of a fixed size record lies and how it orders. Everything is a compile-time constant,
+// so that digit() and compare() inline to a few loads and integer compares for every layout.
+// Digit i of a key is its i-th most significant byte in sort order; the radix sort partitions on them.
+template<size_t Size, size_t KeyOffset, size_t KeyLength, int KeyType>
+struct record_layout {
+  static constexpr size_t size = Size;
+  static constexpr size_t key_offset = KeyOffset;
+  static constexpr size_t key_length = KeyLength;
+  static constexpr int key_type = KeyType;
+  static constexpr size_t prefix_length = KeyLength < 8 ? KeyLength : 8;  // Digits in prefix()
+  static constexpr size_t suffix_length = KeyLength < 16 ? KeyLength - prefix_length : 8;  // Digits in suffix()
+
+  static_assert(KeyLength > 0 && KeyOffset + KeyLength <= Size, "the key has to lie within the record");
+  static_assert(KeyType == KEY_BYTES || KeyType == KEY_INT_BE || KeyType == KEY_UINT_LE, "unknown key type");
+
+  static inline size_t digit(const char *key, size_t level) {
+    uint8_t byte = key[KeyType == KEY_UINT_LE ? KeyLength - 1 - level : level];
+    return KeyType == KEY_INT_BE && level == 0 ? byte ^ 0x80 : byte;
+  }
+
+  // The first prefix_length digits as one integer, most significant first
+  static inline uint64_t prefix(const char *key) {
+    uint64_t value;
+    if (KeyType != KEY_UINT_LE && KeyLength >= 8) {
+      memcpy(&value, key, sizeof(value));
+      value = __builtin_bswap64(value);
+      return KeyType == KEY_INT_BE ? value ^ (1ULL << 63) : value;
+    }
+    if (KeyType == KEY_UINT_LE && KeyLength == 8) {
+      memcpy(&value, key, sizeof(value));
+      return value;
+    }
+    value = 0;
+    for (size_t level = 0; level < prefix_length; level++) {
+      value |= (uint64_t) digit(key, level) << (56 - 8 * level);
+    }
+    return value;
+  }
+
+  // The suffix_length digits after the prefix as one integer, most significant first and left aligned,
+  // so that keys with equal prefixes order as their suffixes do. 0 for keys of up to 8 bytes.
+  static inline uint64_t suffix(const char *key) {
+    uint64_t value;
+    if (suffix_length == 0) {
+      return 0;
+    }
+    if (KeyType != KEY_UINT_LE && suffix_length == 8) {
+      memcpy(&value, key + 8, sizeof(value));
+      return __builtin_bswap64(value);
+    }
+    if (KeyType == KEY_UINT_LE && suffix_length == 8) {
+      memcpy(&value, key + KeyLength - 16, sizeof(value));
+      return value;
+    }
+    if (KeyType != KEY_UINT_LE && suffix_length == 2) {
+      uint16_t tail;
+      memcpy(&tail, key + 8, sizeof(tail));
+      return (uint64_t) __builtin_bswap16(tail) << 48;
+    }
+    value = 0;
+    for (size_t level = 0; level < suffix_length; level++) {
+      value |= (uint64_t) digit(key, prefix_length + level) << (56 - 8 * level);
+    }
+    return value;
+  }
+
+  // The first 16 digits as one integer: for keys of up to 16 bytes, comparing two keys is comparing these
+  static inline normalized_key_t normalize(const char *key) {
+    return ((normalized_key_t) prefix(key) << 64) | suffix(key);
+  }
+
+  // Compares the digits after the first 16, for keys with equal normalized forms
+  static inline int compare_rest(const char *a, const char *b) {
+    if (KeyLength <= 16) {
+      return 0;
+    }
+    if (KeyType != KEY_UINT_LE) {
+      return memcmp(a + 16, b + 16, KeyLength - 16);
+    }
+    for (size_t level = 16; level < KeyLength; level++) {
+      size_t x = digit(a, level), y = digit(b, level);
+      if (x != y) {
+        return x < y ? -1 : 1;
+      }
+    }
+    return 0;
+  }
+
+  // Negative, zero or positive as key a orders before, with or after key b
+  static inline int compare(const char *a, const char *b) {
+    normalized_key_t x = normalize(a), y = normalize(b);
+    if (x != y) {
+      return x < y ? -1 : 1;
+    }
+    return compare_rest(a, b);
+  }
+
+  // Equality doesn't depend on the digit order; a memcmp of a constant length inlines to a few loads
+  static inline bool equal(const char *a, const char *b) {
+    return memcmp(a, b, KeyLength) == 0;
+  }
+
+  // Adjacent pairs among num_records records whose keys are out of order (descents) and equal (duplicates).
+  // The keys are normalized a block at a time and the pairs compared without branches, so that a sorted
+  // stretch costs two integer compares per record rather than a key comparison each.
+  static void count_pairs(const char *records, size_t num_records, size_t &descents, size_t &duplicates) {
+    const size_t block = 64;
+    normalized_key_t keys[block + 1];
+    descents = duplicates = 0;
+    for (size_t first = 0; first + 1 < num_records; first += block) {
+      size_t count = num_records - first - 1 < block ? num_records - first - 1 : block;
+      for (size_t i = 0; i <= count; i++) {
+        keys[i] = normalize(records + (first + i) * Size + KeyOffset);
+      }
+      size_t less = 0, equal_keys = 0;
+      for (size_t i = 0; i < count; i++) {
+        less += keys[i + 1] < keys[i];
+        equal_keys += keys[i + 1] == keys[i];
+      }
+      if (KeyLength > 16 && equal_keys > 0) {
+        // Ties of the first 16 digits are settled by the rest of the key
+        for (size_t i = 0; i < count; i++) {
+          if (keys[i + 1] == keys[i]) {
+            int cmp = compare_rest(records + (first + i) * Size + KeyOffset,
+                                   records + (first + i + 1) * Size + KeyOffset);
+            less += cmp > 0;
+            equal_keys -= cmp != 0;
+          }
+        }
+      }
+      descents += less;
+      duplicates += equal_keys;
+    }
+  }
+};
+
+template<size_t S, size_t O, size_t K, int T> constexpr size_t record_layout<S, O, K, T>::size;
+template<size_t S, size_t O, size_t K, int T> constexpr size_t record_layout<S, O, K, T>::key_offset;
+template<size_t S, size_t O, size_t K, int T> constexpr size_t record_layout<S, O, K, T>::key_length;
+template<size_t S, size_t O, size_t K, int T> constexpr int record_layout<S, O, K, T>::key_type;
+template<size_t S, size_t O, size_t K, int T> constexpr size_t record_layout<S, O, K, T>::prefix_length;
+template<size_t S, size_t O, size_t K, int T> constexpr size_t record_layout<S, O, K, T>::suffix_length;
+
+// The types the engines sort. Each has a key_length, a key_of() and a digit() for the radix sort, and orders by its key.
+
+// A whole record
+template<class L>
+struct record {
+  typedef L layout;
+  static constexpr size_t key_length = L::key_length;
+
+  char data[L::size];
+
+  const char *key() const {
+    return data + L::key_offset;
+  }
+
+  static const char *key_of(const record &r) {
+    return r.key();
+  }
+
+  static size_t digit(const record &r, size_t level) {
+    return L::digit(r.key(), level);
+  }
+
+  bool operator<(const record &op) const {
+    return L::compare(key(), op.key()) < 0;
+  }
+
+  bool operator>(const record &op) const {
+    return L::compare(key(), op.key()) > 0;
+  }
+};
+
+// Just the key of a record
+template<class L>
+struct record_key {
+  typedef L layout;
+  static constexpr size_t key_length = L::key_length;
+
+  char key[L::key_length];
+
+  static const char *key_of(const record_key &k) {
+    return k.key;
+  }
+
+  static size_t digit(const record_key &k, size_t level) {
+    return L::digit(k.key, level);
+  }
+
+  bool operator<(const record_key &op) const {
+    return L::compare(key, op.key) < 0;
+  }
+
+  bool operator>(const record_key &op) const {
+    return L::compare(key, op.key) > 0;
+  }
+
+  bool operator==(const record_key &op) const {
+    return L::equal(key, op.key);
+  }
+
+  bool operator!=(const record_key &op) const {
+    return !L::equal(key, op.key);
+  }
+};
+
+// Entry of the indirect sort: the key followed by the record's index in its buffer.
+template<class L>
+struct record_ref {
+  typedef L layout;
+  static constexpr size_t key_length = L::key_length;
+
+  char key[L::key_length];
+  uint32_t index;
+
+  static const char *key_of(const record_ref &r) {
+    return r.key;
+  }
+
+  static size_t digit(const record_ref &r, size_t level) {
+    return L::digit(r.key, level);
+  }
+
+  bool operator<(const record_ref &op) const {
+    return L::compare(key, op.key) < 0;
+  }
+};
+
+template<class L> constexpr size_t record<L>::key_length;
+template<class L> constexpr size_t record_key<L>::key_length;
+template<class L> constexpr size_t record_ref<L>::key_length;
+
+#endif //MULTICORE_EXTERNAL_SORT_RECORD_LAYOUT_H
@@ -0,0 +1,236 @@
+#include "replacement_selection.h"
+#include "io_backend.h"
+#include "validator.h"
+#include "telemetry.h"
+#include "fence_index.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+
+namespace replacement {
+
+  bool sample(int fd, size_t file_size, const layout_engine_t *engine, char *buffer, presortedness_t &measure) {
+    size_t record_size = engine->record_size;
+    size_t num_records = file_size / record_size;
+    size_t window = num_records < PRESORT_WINDOW ? num_records : PRESORT_WINDOW;
+    size_t num_windows = window > 0 ? num_records / window : 0;
+    num_windows = num_windows < PRESORT_SAMPLES ? num_windows : PRESORT_SAMPLES;
+    measure.descents = measure.ascending = 0;
+    if (num_windows == 0) {
+      return true;
+    }
+
+    // Window i starts at the i-th of num_windows equal strides, so that they span the whole input
+    size_t stride = num_records / num_windows;
+    size_t descents = 0, ascending = 0;
+    char last[record_size];
+    for (size_t i = 0; i < num_windows; i++) {
+      size_t size = window * record_size;
+      if (io::read_fully(fd, buffer, size, i * stride * record_size) != size) {
+        return false;
+      }
+      size_t window_descents, duplicates;
+      engine->count_pairs(buffer, window, window_descents, duplicates);
+      descents += window_descents;
+      ascending += i > 0 && engine->compare(last, buffer) <= 0;
+      memcpy(last, buffer + size - record_size, record_size);
+    }
+    measure.descents = window > 1 ? (double) descents / (num_windows * (window - 1)) : 0;
+    measure.ascending = num_windows > 1 ? (double) ascending / (num_windows - 1) : 1;
+    return true;
+  }
+
+  bool prefers_replacement(const presortedness_t &measure) {
+    // Sorted input, or sorted stretches, pass through the radix path unsorted already
+    return measure.descents > 0 && measure.descents <= PRESORT_MAX_DESCENTS &&
+           measure.ascending >= PRESORT_MIN_ASCENDING;
+  }
+
+  // A record in the heap: its run, its normalized key and where it is kept
+  typedef struct entry {
+    normalized_key_t key;
+    uint32_t run;
+    uint32_t slot;
+  } entry_t;
+
+  class selection {
+  public:
+    selection(const layout_engine_t *engine, const char *slots) : engine(engine), slots(slots) {}
+
+    // Earlier run first, then the smaller key
+    bool before(const entry_t &a, const entry_t &b) const {
+      if (a.run != b.run) {
+        return a.run < b.run;
+      }
+      if (a.key != b.key) {
+        return a.key < b.key;
+      }
+      return engine->key_length > 16 &&
+             engine->compare(slots + a.slot * engine->record_size, slots + b.slot * engine->record_size) < 0;
+    }
+
+    void sift_down(entry_t *heap, size_t size, size_t node) const {
+      entry_t e = heap[node];
+      for (size_t child = 2 * node + 1; child < size; child = 2 * node + 1) {
+        if (child + 1 < size && before(heap[child + 1], heap[child])) {
+          child++;
+        }
+        if (!before(heap[child], e)) {
+          break;
+        }
+        heap[node] = heap[child];
+        node = child;
+      }
+      heap[node] = e;
+    }
+
+  private:
+    const layout_engine_t *engine;
+    const char *slots;
+  };
+
+  // Sequential reads of the input, a chunk at a time
+  typedef struct input {
+    int fd;
+    char *chunk;
+    size_t chunk_size;
+    size_t head;
+    size_t tail;
+    size_t offset;  // Of the end of the chunk in the input
+    bool end;
+  } input_t;
+
+  static const char *next_record(input_t &in, param_t &param) {
+    size_t record_size = param.engine->record_size;
+    if (in.head == in.tail) {
+      if (in.end) {
+        return NULL;
+      }
+      size_t amount = in.chunk_size;
+      if (!param.streaming) {
+        amount = param.file_size - in.offset < amount ? param.file_size - in.offset : amount;
+      }
+      size_t ret = io::read_fully(in.fd, in.chunk, amount, in.offset);
+      in.end = ret < in.chunk_size || (!param.streaming && in.offset + ret == param.file_size);
+      if (ret % record_size != 0) {
+        printf("[Error] input ends with a partial record of %zu bytes, dropped\n", ret % record_size);
+      }
+      in.head = 0;
+      in.tail = ret - ret % record_size;
+      in.offset += ret;
+      validate::add(param.input_sum, in.chunk, in.tail, record_size, param.num_threads);
+      if (in.tail == 0) {
+        return NULL;
+      }
+    }
+    const char *record = in.chunk + in.head;
+    in.head += record_size;
+    return record;
+  }
+
+  // Writes the output chunk to the run file and takes its fences
+  static bool flush(int run_fd, const char *output, size_t &output_head, size_t &run_offset,
+                    const layout_engine_t *engine, fence::index_t &run_fence) {
+    bool ok = output_head == 0 || io::write_fully(run_fd, output, output_head, run_offset);
+    fence::add(run_fence, engine, output, output_head / engine->record_size);
+    run_offset += output_head;
+    output_head = 0;
+    return ok;
+  }
+
+  static bool close_run(int run_fd, const std::string &filename, const layout_engine_t *engine,
+                        const fence::index_t &run_fence) {
+    io::close_file(run_fd);
+    return fence::write(run_fence, engine, filename);
+  }
+
+  bool generate_runs(param_t &param, const std::function<std::string(size_t)> &run_name, size_t &num_runs,
+                     size_t &input_size) {
+    telemetry::scoped_timer timer(telemetry::SORT_NS);
+    const layout_engine_t *engine = param.engine;
+    size_t record_size = engine->record_size;
+    num_runs = input_size = 0;
+
+    // Input chunk, output chunk, then the records of the heap and the heap itself
+    size_t budget = param.memory_budget / IO_UNIT * IO_UNIT;
+    size_t io_size = budget / 8 < REPLACEMENT_IO_SIZE ? budget / 8 / IO_UNIT * IO_UNIT : REPLACEMENT_IO_SIZE;
+    char *slots = param.buffer + 2 * io_size;
+    size_t capacity = io_size > 0 ? (budget - 2 * io_size - alignof(entry_t)) / (record_size + sizeof(entry_t)) : 0;
+    capacity = capacity < UINT32_MAX ? capacity : UINT32_MAX;
+    entry_t *heap = (entry_t *) align_up((size_t) (slots + capacity * record_size), alignof(entry_t));
+    if (io_size == 0 || capacity == 0) {
+      printf("[Error] memory budget too small for replacement selection\n");
+      return false;
+    }
+    input_t in = {param.input_fd, param.buffer, io_size, 0, 0, 0, false};
+    char *output = param.buffer + io_size;
+    selection order(engine, slots);
+
+    // Fill the heap, every record in the first run
+    size_t size = 0;
+    for (const char *record; size < capacity && (record = next_record(in, param)) != NULL; size++) {
+      memcpy(slots + size * record_size, record, record_size);
+      heap[size].key = engine->normalize(record);
+      heap[size].run = 0;
+      heap[size].slot = (uint32_t) size;
+    }
+    for (size_t node = size / 2; node-- > 0;) {
+      order.sift_down(heap, size, node);
+    }
+
+    int run_fd = -1;
+    size_t run_offset = 0, output_head = 0;
+    std::string filename;
+    fence::index_t run_fence;
+    uint32_t current_run = 0;
+    bool ok = true;
+    while (size > 0 && ok) {
+      entry_t top = heap[0];
+      const char *emitted = slots + top.slot * record_size;
+      if (run_fd == -1 || top.run != current_run) {
+        if (run_fd != -1) {
+          ok = flush(run_fd, output, output_head, run_offset, engine, run_fence) &&
+               close_run(run_fd, filename, engine, run_fence);
+        }
+        current_run = top.run;
+        run_offset = output_head = 0;
+        fence::init(run_fence, engine, FENCE_INTERVAL);
+        filename = run_name(num_runs++);
+        if ((run_fd = io::open_file(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, param.io_backend)) == -1) {
+          printf("[Error] failed to open run file %s\n", filename.c_str());
+          return false;
+        }
+      }
+      memcpy(output + output_head, emitted, record_size);
+      output_head += record_size;
+      input_size += record_size;
+      if (output_head == io_size) {
+        ok = flush(run_fd, output, output_head, run_offset, engine, run_fence);
+      }
+
+      // The next record takes the emitted one's place, in this run unless it orders before it
+      const char *record = next_record(in, param);
+      if (record == NULL) {
+        heap[0] = heap[--size];
+      } else {
+        normalized_key_t key = engine->normalize(record);
+        bool below = key < top.key || (key == top.key && engine->key_length > 16 && engine->compare(record, emitted) < 0);
+        memcpy(slots + top.slot * record_size, record, record_size);
+        heap[0].key = key;
+        heap[0].run = below ? top.run + 1 : top.run;
+        heap[0].slot = top.slot;
+      }
+      order.sift_down(heap, size, 0);
+    }
+    if (run_fd != -1) {
+      ok = flush(run_fd, output, output_head, run_offset, engine, run_fence) && ok;
+      ok = close_run(run_fd, filename, engine, run_fence) && ok;
+    }
+    if (!ok) {
+      printf("[Error] failed to write run file\n");
+    }
+    return ok;
+  }
+
+}
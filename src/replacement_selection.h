@@ -0,0 +1,38 @@
+#ifndef MULTICORE_EXTERNAL_SORT_REPLACEMENT_SELECTION_H
+#define MULTICORE_EXTERNAL_SORT_REPLACEMENT_SELECTION_H
+
+#include <cstddef>
+#include <string>
+#include <functional>
+#include "global.h"
+#include "layout_engine.h"
+
+#define PRESORT_SAMPLES (64)          // Windows of the input sampled to measure how sorted it is
+#define PRESORT_WINDOW (1024)         // Consecutive records per window
+#define PRESORT_MAX_DESCENTS (0.25)   // Most out of order pairs in the windows for replacement selection
+#define PRESORT_MIN_ASCENDING (0.75)  // Least share of windows in order with the one before for the same
+#define REPLACEMENT_IO_SIZE (4096000) // Input and output chunk of replacement selection
+
+// Run generation by replacement selection: a heap of as many records as the memory budget holds emits
+// them in key order into the current run, and every record read takes the place of the one emitted.
+// A record below the last one emitted waits for the next run. Random input gives runs of about twice
+// the memory; nearly sorted input, whose records are out of place by less than the memory, gives one.
+namespace replacement {
+  typedef struct presortedness {
+    double descents;   // Share of the adjacent pairs within the windows that are out of order
+    double ascending;  // Share of the windows that start at or above the end of the one before
+  } presortedness_t;
+
+  // Samples PRESORT_SAMPLES windows spread over the input, read into buffer. Returns false on a read error.
+  bool sample(int fd, size_t file_size, const layout_engine_t *engine, char *buffer, presortedness_t &measure);
+  // Whether the measure calls for replacement selection rather than sorting whole buffers
+  bool prefers_replacement(const presortedness_t &measure);
+
+  // Reads param.input_fd to its end and writes the runs to the files run_name(0), run_name(1), ..., each
+  // with its fence index, through param.buffer. Adds the records read to param.input_sum.
+  // Returns false on an I/O error.
+  bool generate_runs(param_t &param, const std::function<std::string(size_t)> &run_name, size_t &num_runs,
+                     size_t &input_size);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_REPLACEMENT_SELECTION_H
@@ -1,355 +1,1480 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <omp.h>
 
 #include "global.h"
 #include "parallel_radix_sort.h"
+#include "parallel_counting_sort.h"
+#include "k_way_merge.h"
+#include "bounded_queue.h"
+#include "sample_sort.h"
+#include "planner.h"
+#include "io_backend.h"
+#include "async_io.h"
+#include "run_codec.h"
+#include "telemetry.h"
+#include "layout_engine.h"
+#include "arena.h"
+#include "validator.h"
+#include "replacement_selection.h"
+#include "fence_index.h"
+#include "merge_path.h"
+#include "incremental.h"
+#include "top_k.h"
 
 using namespace std;
 
-int prepare_environment() {
-  if (mkdir(TMP_DIRECTORY, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
-    if (errno == EEXIST) {
-      // already exists
-    } else {
-      // something else
-      return -1;
+// Creates every temporary directory; returns the index of one that couldn't be made, -1 if all are there
+int prepare_environment(const param_t &param) {
+  for (size_t i = 0; i < param.num_tmp_directories; i++) {
+    if (mkdir(param.tmp_directories[i], S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) == -1) {
+      if (errno == EEXIST) {
+        // already exists
+      } else {
+        // something else
+        return i;
+      }
     }
   }
-  return 0;
+  return -1;
 }
 
-void phase_small_file(param_t &param);
-void phase1(param_t &param);
-void phase2(param_t &param);
+bool phase_small_file(param_t &param);
+bool phase_top_k(param_t &param);
+bool phase1(param_t &param);
+bool phase2(param_t &param);
+
+bool check_base(param_t &param);
+bool check_output(const vector<string> &filenames, const param_t &param, bool write_fence);
 
-void check_output(char *filename, char *buffer);
+void reset_peak_rss();
+size_t peak_rss();
 
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    printf("Program usage: ./run input_file_name output_file_name\n");
-    return 0;
+  param_t param;
+  param.buffer = NULL;
+  param.memory_budget = MAX_BUFFER;
+  param.num_threads = omp_get_max_threads();
+  param.num_buffers = NUM_PIPELINE_BUFFERS;
+  param.io_backend = IO_BUFFERED;
+  param.queue_depth = IO_QUEUE_DEPTH;
+  param.sort_mode = SORT_IN_PLACE;
+  param.run_mode = RUN_AUTO;
+  param.num_ranges = 0;
+  param.thresholds = NULL;
+  param.segments = NULL;
+  param.compress = false;
+  param.block_size = 0;
+  param.run_blocks = NULL;
+  param.streaming = false;
+  param.engine = layout::default_engine();
+  memset(&param.input_sum, 0, sizeof(param.input_sum));
+  param.base_filename = NULL;
+  param.base_fd = -1;
+  param.base_size = 0;
+  param.top_k = 0;
+  param.heap_select = false;
+  param.num_outputs = 0;
+  param.output_fds = NULL;
+  const char *telemetry_filename = NULL;
+  bool write_fence = false;
+  vector<const char *> tmp_directories;
+  int pages = PAGES_HUGE;
+  int placement = NUMA_INTERLEAVE;
+  bool pin = false;
+
+  int opt;
+  bool usage_error = false;
+  while ((opt = getopt(argc, argv, "M:t:b:i:q:m:r:s:zT:l:d:p:n:Aa:Fk:P:")) != -1) {
+    switch (opt) {
+      case 'M':
+        param.memory_budget = planner::parse_size(optarg);
+        break;
+      case 't':
+        param.num_threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':
+        param.num_buffers = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        if ((param.io_backend = io::parse_backend(optarg)) == -1) {
+          usage_error = true;
+        }
+        break;
+      case 'q':
+        param.queue_depth = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        if (strcmp(optarg, "inplace") == 0) {
+          param.sort_mode = SORT_IN_PLACE;
+        } else if (strcmp(optarg, "indirect") == 0) {
+          param.sort_mode = SORT_INDIRECT;
+        } else if (strcmp(optarg, "counting") == 0) {
+          param.sort_mode = SORT_COUNTING;
+        } else {
+          usage_error = true;
+        }
+        break;
+      case 'r':
+        if (strcmp(optarg, "auto") == 0) {
+          param.run_mode = RUN_AUTO;
+        } else if (strcmp(optarg, "radix") == 0) {
+          param.run_mode = RUN_RADIX;
+        } else if (strcmp(optarg, "replacement") == 0) {
+          param.run_mode = RUN_REPLACEMENT;
+        } else {
+          usage_error = true;
+        }
+        break;
+      case 's':
+        param.num_ranges = strtoul(optarg, NULL, 10);
+        break;
+      case 'z':
+        param.compress = true;
+        break;
+      case 'T':
+        telemetry_filename = optarg;
+        break;
+      case 'l':
+        if ((param.engine = layout::parse(optarg)) == NULL) {
+          layout::print_layouts();
+          usage_error = true;
+        }
+        break;
+      case 'd':
+        for (char *directory = strtok(optarg, ","); directory != NULL; directory = strtok(NULL, ",")) {
+          tmp_directories.push_back(directory);
+        }
+        break;
+      case 'p':
+        if ((pages = arena::parse_pages(optarg)) == -1) {
+          usage_error = true;
+        }
+        break;
+      case 'n':
+        if ((placement = arena::parse_placement(optarg)) == -1) {
+          usage_error = true;
+        }
+        break;
+      case 'A':
+        pin = true;
+        break;
+      case 'a':
+        param.base_filename = optarg;
+        break;
+      case 'F':
+        write_fence = true;
+        break;
+      case 'k':
+        if ((param.top_k = strtoull(optarg, NULL, 10)) == 0) {
+          usage_error = true;
+        }
+        break;
+      case 'P':
+        if ((param.num_outputs = strtoul(optarg, NULL, 10)) == 0) {
+          usage_error = true;
+        }
+        break;
+      default:
+        usage_error = true;
+        break;
+    }
+  }
+  if (usage_error || argc - optind < 2 || param.num_buffers == 0 || param.num_threads == 0) {
+    printf("Program usage: ./run [-M memory_budget] [-t num_threads] [-b num_pipeline_buffers] "
+           "[-i buffered|direct|mmap] [-q queue_depth] [-m inplace|indirect|counting] [-r auto|radix|replacement] "
+           "[-s num_key_ranges] [-z] "
+           "[-T telemetry.json|telemetry.csv] [-l size:key_offset:key_length:type] [-d tmp_dir,...] "
+           "[-p huge|thp|small] [-n interleave|local|none] [-A (pin threads)] [-a sorted_base_file] "
+           "[-F (write output fence index)] [-k top_k_records] [-P num_key_range_files] "
+           "input_file_name|- output_file_name|-\n"
+           "  -s merges every key range from all runs in one pass, so it falls back to a cascaded merge when "
+           "there are more runs than the merge fan-in\n");
+    return 1;
+  }
+  char *input_filename = argv[optind];
+  char *output_filename = argv[optind + 1];
+  if (param.num_outputs > 0 && (param.top_k > 0 || param.base_filename != NULL)) {
+    printf("[Error] key-range files (-P) can't be combined with top-K (-k) or appending (-a)\n");
+    return 1;
+  }
+  if (param.num_outputs > 0 && strcmp(output_filename, "-") == 0) {
+    printf("[Error] key-range files (-P) need an output file name, not a stream\n");
+    return 1;
+  }
+  if (param.top_k > 0 && param.base_filename != NULL) {
+    printf("[Error] top-K (-k) can't be combined with appending (-a)\n");
+    return 1;
+  }
+  // Key-range files are split by sample sort's splitters when it can run, by merge path otherwise
+  if (param.num_outputs > 0) {
+    param.num_ranges = param.num_outputs > 1 ? param.num_outputs : 0;
   }
 
-  if (prepare_environment() == -1) {
-    printf("%s directory couldn't be made\n", TMP_DIRECTORY);
-    return 0;
+  // Sorted tuples written to "-" own stdout; everything printed goes to stderr instead
+  int stdout_fd = -1;
+  if (strcmp(output_filename, "-") == 0) {
+    stdout_fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
   }
 
-  param_t param;
-  param.buffer = NULL;
-  param.thresholds = NULL;
-  char *buffer;
-  if ((buffer = (char *) malloc(READ_BUFFER_SIZE)) == NULL) {
-    printf("Buffer allocation failed (input read buffer)\n");
-    return 0;
+  if (tmp_directories.empty()) {
+    tmp_directories.push_back(TMP_DIRECTORY);
+  }
+  param.tmp_directories = tmp_directories.data();
+  param.num_tmp_directories = tmp_directories.size();
+  int missing_directory = prepare_environment(param);
+  if (missing_directory != -1) {
+    printf("%s directory couldn't be made\n", param.tmp_directories[missing_directory]);
+    return 1;
+  }
+
+  omp_set_num_threads(param.num_threads);
+  if (pin && !arena::pin_threads(param.num_threads)) {
+    printf("[Plan] couldn't pin the sort threads, leaving them unpinned\n");
+  }
+  if (telemetry_filename != NULL) {
+    telemetry::enable();
+    telemetry::name_thread("main");
   }
-  param.buffer = buffer;
 
   /// [Phase 1] START
-  if ((param.input_fd = open(argv[1], O_RDONLY)) == -1) {
-    printf("[Error] failed to open input file %s\n", argv[1]);
-    return 0;
+  if (strcmp(input_filename, "-") == 0) {
+    param.input_fd = STDIN_FILENO;
+  } else if ((param.input_fd = io::open_file(input_filename, O_RDONLY, param.io_backend)) == -1) {
+    printf("[Error] failed to open input file %s\n", input_filename);
+    return 1;
+  }
+  // Pipes, stdin and other inputs without a size are read until they end
+  struct stat input_stat;
+  param.streaming = fstat(param.input_fd, &input_stat) != 0 || !S_ISREG(input_stat.st_mode);
+  if (param.streaming) {
+    io::set_stream(param.input_fd);
+    param.file_size = 0;
+  } else {
+    param.file_size = lseek(param.input_fd, 0, SEEK_END);
   }
-  param.file_size = lseek(param.input_fd, 0, SEEK_END);
 
-  if ((param.output_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, 0777)) == -1) {
-    printf("[Error] failed to open input file %s\n", argv[2]);
-    return 0;
+  // The base file is read while the output is written, so they can't be the same file
+  if (param.base_filename != NULL) {
+    struct stat base_stat, output_stat;
+    if ((param.base_fd = io::open_file(param.base_filename, O_RDONLY, param.io_backend)) == -1) {
+      printf("[Error] failed to open base file %s\n", param.base_filename);
+      return 1;
+    }
+    param.base_size = lseek(param.base_fd, 0, SEEK_END);
+    if (param.base_size % param.engine->record_size != 0) {
+      printf("[Error] base file %s isn't a whole number of records\n", param.base_filename);
+      return 1;
+    }
+    if (stat(output_filename, &output_stat) == 0 && fstat(param.base_fd, &base_stat) == 0 &&
+        base_stat.st_dev == output_stat.st_dev && base_stat.st_ino == output_stat.st_ino) {
+      printf("[Error] the output can't be the base file\n");
+      return 1;
+    }
+  }
+
+  if (!planner::plan(param)) {
+    return 1;
+  }
+  planner::print(param);
+
+  arena::arena_t arena;
+  if (!arena::create(arena, param.memory_budget, pages, placement, param.num_threads)) {
+    printf("Buffer allocation failed (memory budget)\n");
+    return 1;
+  }
+  arena::print(arena);
+  param.buffer = arena.base;
+
+  // Key-range files are <output>.0, <output>.1, ... in key order
+  vector<string> output_files;
+  vector<int> output_fds;
+  if (param.num_outputs > 0) {
+    for (size_t i = 0; i < param.num_outputs; i++) {
+      output_files.push_back(string(output_filename) + "." + to_string(i));
+    }
+  } else {
+    output_files.push_back(output_filename);
+  }
+  for (size_t i = 0; i < output_files.size(); i++) {
+    int fd;
+    if (stdout_fd != -1) {
+      fd = stdout_fd;
+    } else if ((fd = io::open_file(output_files[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, param.io_backend)) == -1) {
+      printf("[Error] failed to open output file %s\n", output_files[i].c_str());
+      return 1;
+    }
+    output_fds.push_back(fd);
+  }
+  param.output_fd = param.num_outputs > 0 ? -1 : output_fds[0];
+  param.output_fds = param.num_outputs > 0 ? output_fds.data() : NULL;
+  struct stat output_stat;
+  bool output_streaming = fstat(output_fds[0], &output_stat) != 0 || !S_ISREG(output_stat.st_mode);
+  if (output_streaming) {
+    io::set_stream(output_fds[0]);
+  } else {
+    for (const string &filename : output_files) {
+      unlink((filename + FENCE_SUFFIX).c_str()); // Of the file this one replaces
+    }
   }
 
   chrono::time_point<chrono::system_clock> t1, t2;
   long long int duration;
+  bool ok = true; // Exit status: a failed phase, sync or validation exits with 1
 
-  if (param.file_size <= READ_BUFFER_SIZE) {
+  if (param.base_filename != NULL) {
     t1 = chrono::high_resolution_clock::now();
-    phase_small_file(param);
+    if (!check_base(param)) {
+      return 1;
+    }
+    t2 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+    cout << "[Append] base file took: " << duration << " (milliseconds)" << endl;
+  }
+
+  if (param.in_memory) {
+    reset_peak_rss();
+    telemetry::begin_phase(telemetry::SMALL_FILE);
+    t1 = chrono::high_resolution_clock::now();
+    ok = phase_small_file(param);
     t2 = chrono::high_resolution_clock::now();
     duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
     cout << "[Phase small file] took: " << duration << " (milliseconds)" << endl;
+    cout << "[Phase small file] peak RSS: " << peak_rss() << " (kilobytes)" << endl;
+  } else if (param.heap_select) {
+    reset_peak_rss();
+    telemetry::begin_phase(telemetry::PHASE1);
+    t1 = chrono::high_resolution_clock::now();
+    ok = phase_top_k(param);
+    t2 = chrono::high_resolution_clock::now();
+    duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+    cout << "[Phase top-K] took: " << duration << " (milliseconds)" << endl;
+    cout << "[Phase top-K] peak RSS: " << peak_rss() << " (kilobytes)" << endl;
   } else {
     /// [Phase 1] START
+    reset_peak_rss();
+    telemetry::begin_phase(telemetry::PHASE1);
     t1 = chrono::high_resolution_clock::now();
-    phase1(param);
+    ok = phase1(param);
     t2 = chrono::high_resolution_clock::now();
 
     duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
     cout << "[Phase1] took: " << duration << " (milliseconds)" << endl;
+    cout << "[Phase1] peak RSS: " << peak_rss() << " (kilobytes)" << endl;
     /// [Phase 1] END
 
     /// [Phase 2] START
+    // A stream that fit in its first run was written to the output by phase1 already
+    if (!ok) {
+      printf("[Error] run generation failed, no merge\n");
+    } else if (!param.in_memory) {
+      reset_peak_rss();
+      telemetry::begin_phase(telemetry::PHASE2);
+      t1 = chrono::high_resolution_clock::now();
+      ok = phase2(param);
+      t2 = chrono::high_resolution_clock::now();
+
+      duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+      cout << "[Phase2] took: " << duration << " (milliseconds)" << endl;
+      cout << "[Phase2] peak RSS: " << peak_rss() << " (kilobytes)" << endl;
+    }
+    /// [Phase 2] END
+  }
+
+  // A single flush of the output instead of synchronous writes
+  telemetry::begin_phase(telemetry::FINISH);
+  t1 = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < output_fds.size(); i++) {
+    if (!io::sync(output_fds[i])) {
+      printf("[Error] failed to sync output file %s\n", output_files[i].c_str());
+      ok = false;
+    }
+  }
+  t2 = chrono::high_resolution_clock::now();
+  duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+  cout << "[Sync] took: " << duration << " (milliseconds)" << endl;
+
+  if (stdout_fd == -1 && !output_streaming) {
     t1 = chrono::high_resolution_clock::now();
-    phase2(param);
+    ok = check_output(output_files, param, write_fence) && ok;
     t2 = chrono::high_resolution_clock::now();
-
     duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
-    cout << "[Phase2] took: " << duration << " (milliseconds)" << endl;
-    /// [Phase 2] END
+    cout << "[Validation] took: " << duration << " (milliseconds)" << endl;
+  } else {
+    if (write_fence) {
+      printf("[Error] the output is a stream, so no fence index is written\n");
+    }
+    char checksum[33];
+    validate::format(param.input_sum, checksum);
+    printf("[Validation] skipped, the output is a stream; input: %zu records, checksum %s\n",
+           param.input_sum.records, checksum);
+    // Its order can't be read back, but a merge that stopped short shows in its size
+    size_t records = param.input_sum.records;
+    if (param.top_k > 0 && param.top_k < records) {
+      records = param.top_k;
+    }
+    size_t written = io::streamed(output_fds[0]);
+    if (!output_streaming) {
+      written = fstat(output_fds[0], &output_stat) == 0 ? output_stat.st_size : 0;
+    }
+    if (written != records * param.engine->record_size) {
+      printf("[Error] %zu bytes written to the output instead of %zu records\n", written, records);
+      ok = false;
+    }
   }
-  check_output(argv[2], param.buffer);
 
   t1 = chrono::high_resolution_clock::now();
 
-  close(param.input_fd);
-  close(param.output_fd);
+  io::close_file(param.input_fd);
+  for (int fd : output_fds) {
+    io::close_file(fd);
+  }
+  if (param.base_fd != -1) {
+    io::close_file(param.base_fd);
+  }
 
+  arena::destroy(arena);
+  param.buffer = NULL;
   if (param.thresholds != NULL) {
     free(param.thresholds);
   }
-  if (param.buffer != NULL) {
-    free(param.buffer);
+  if (param.segments != NULL) {
+    free(param.segments);
   }
-  if (param.sorted_keys != NULL) {
-    free(param.sorted_keys);
+  if (param.run_blocks != NULL) {
+    for (size_t i = 0; i < param.num_partitions; i++) {
+      codec::release(param.run_blocks[i]);
+    }
+    free(param.run_blocks);
   }
 
   t2 = chrono::high_resolution_clock::now();
   duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
   cout << "[Clean up] took: " << duration << " (milliseconds)" << endl;
 
-  return 0;
+  if (telemetry_filename != NULL && !telemetry::write(telemetry_filename)) {
+    printf("[Error] failed to write telemetry file %s\n", telemetry_filename);
+    ok = false;
+  }
+
+  return ok ? 0 : 1;
+}
+
+const char *sort_mode_name(int sort_mode) {
+  return sort_mode == SORT_INDIRECT ? "indirect" : sort_mode == SORT_COUNTING ? "counting" : "inplace";
 }
 
-void phase_small_file(param_t &param) {
+// Sort `size` bytes of records in buffer. In SORT_INDIRECT mode the records stay where they are
+// and refs receives their sorted order, one engine->ref_size entry per record.
+void sort_buffer(const layout_engine_t *engine, char *buffer, size_t size, char *refs, int sort_mode) {
+  telemetry::scoped_timer timer(telemetry::SORT_NS);
+  if (sort_mode == SORT_INDIRECT) {
+    engine->indirect_sort(buffer, size, refs);
+  } else if (sort_mode == SORT_COUNTING) {
+    counting_sort::sort((tuple_t *) buffer, size / TUPLE_SIZE, omp_get_max_threads());
+  } else {
+    engine->sort(buffer, size);
+  }
+}
+
+// Write a sorted buffer to fd at offset. With refs, the records are gathered into `staging`
+// (GATHER_BUFFER_SIZE bytes) block by block and each block is written out. The fences of what is
+// written are added to fence, unless it is NULL.
+bool write_sorted(const layout_engine_t *engine, int fd, size_t offset, const char *buffer, size_t size,
+                  const char *refs, char *staging, fence::index_t *fence) {
+  for (size_t head = 0; head < size;) {
+    const char *src = buffer + head;
+    size_t amount = size - head;
+    if (refs != NULL) {
+      amount = amount < GATHER_BUFFER_SIZE ? amount : GATHER_BUFFER_SIZE;
+      size_t first = head / engine->record_size;
+      engine->gather(buffer, refs + first * engine->ref_size, amount / engine->record_size, staging);
+      src = staging;
+    }
+    if (!io::write_fully(fd, src, amount, offset + head)) {
+      return false;
+    }
+    if (fence != NULL) {
+      fence::add(*fence, engine, src, amount / engine->record_size);
+    }
+    head += amount;
+  }
+  return true;
+}
+
+bool phase_small_file(param_t &param) {
   chrono::time_point<chrono::system_clock> t1, t2;
   long long int duration;
 
-  for (size_t offset = 0; offset < param.file_size;) {
-    size_t ret = pread(param.input_fd, param.buffer + offset, param.file_size - offset, offset);
-    offset += ret;
+  if (io::read_fully(param.input_fd, param.buffer, param.file_size, 0) != param.file_size) {
+    printf("[Error] failed to read input file\n");
+    return false;
+  }
+  if (param.file_size % param.engine->record_size != 0) {
+    printf("[Error] input ends with a partial record of %zu bytes, dropped\n",
+           param.file_size % param.engine->record_size);
+    param.file_size -= param.file_size % param.engine->record_size;
+  }
+
+  const layout_engine_t *engine = param.engine;
+  validate::add(param.input_sum, param.buffer, param.file_size, engine->record_size, param.num_threads);
+  char *refs = NULL;
+  char *staging = NULL;
+  if (param.sort_mode == SORT_INDIRECT) {
+    refs = param.buffer + align_up(param.file_size, IO_BLOCK_SIZE);
+    staging = param.buffer + align_up(refs + param.file_size / engine->record_size * engine->ref_size - param.buffer,
+                                      IO_BLOCK_SIZE);
   }
 
   t1 = chrono::high_resolution_clock::now();
-  radix_sort::parallel_radix_sort((tuple_t *) param.buffer, param.file_size / TUPLE_SIZE, 0);
+  sort_buffer(engine, param.buffer, param.file_size, refs, param.sort_mode);
   t2 = chrono::high_resolution_clock::now();
 
   duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
-  cout << "[Phase1] sorting: " << duration << " (milliseconds)" << endl;
+  cout << "[Phase1] sorting (" << sort_mode_name(param.sort_mode) << "): " << duration << " (milliseconds)" << endl;
 
-  for (size_t offset = 0; offset < param.file_size;) {
-    size_t ret = pwrite(param.output_fd, param.buffer + offset, param.file_size - offset, offset);
-    offset += ret;
+  // Only the first top_k records with -k
+  size_t output_size = param.file_size;
+  if (param.top_k > 0 && param.top_k < param.file_size / engine->record_size) {
+    output_size = param.top_k * engine->record_size;
   }
+  t1 = chrono::high_resolution_clock::now();
+  bool ok = write_sorted(engine, param.output_fd, 0, param.buffer, output_size, refs, staging, NULL);
+  if (!ok) {
+    printf("[Error] failed to write output file\n");
+  }
+  t2 = chrono::high_resolution_clock::now();
+
+  duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+  cout << "[Phase1] writing: " << duration << " (milliseconds)" << endl;
+  return ok;
 }
 
-void phase1(param_t &param) {
+// Top-K (-k) that fits the memory budget: one pass over the input keeps the top_k smallest records in a
+// heap, then they are sorted and written to the output, without runs
+bool phase_top_k(param_t &param) {
   chrono::time_point<chrono::system_clock> t1, t2;
-  long long int duration;
+  t1 = chrono::high_resolution_clock::now();
+  size_t num_selected, input_size;
+  if (!top_k::select(param, num_selected, input_size)) {
+    // Records the input didn't give aren't among those kept, so they are not the top K
+    printf("[Error] top-K selection failed, nothing written\n");
+    return false;
+  }
+  t2 = chrono::high_resolution_clock::now();
+  cout << "[Phase1] top-K selection: " << num_selected << " of " << input_size / param.engine->record_size
+       << " records, " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << " (milliseconds)" << endl;
 
-  size_t file_size = param.file_size; // Input file size
-  size_t num_tuples = file_size / TUPLE_SIZE; // Number of tuples
-  size_t num_partitions = (file_size - 1) / READ_BUFFER_SIZE + 1; // Total cycles run to process the input file
+  t1 = chrono::high_resolution_clock::now();
+  bool ok = write_sorted(param.engine, param.output_fd, 0, param.buffer, num_selected * param.engine->record_size,
+                         NULL, NULL, NULL);
+  if (!ok) {
+    printf("[Error] failed to write output file\n");
+  }
+  t2 = chrono::high_resolution_clock::now();
+  cout << "[Phase1] writing: " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << " (milliseconds)"
+       << endl;
+
+  param.file_size = input_size;
+  param.num_tuples = input_size / param.engine->record_size;
+  return ok;
+}
 
-  tuple_key_t *keys;
-  if ((keys = (tuple_key_t *) malloc(sizeof(tuple_key_t) * num_tuples)) == NULL) {
-    printf("Buffer allocation failed (key buffer)\n");
-    return;
+// Runs are striped round-robin over the temporary directories, one device each ideally, so that phase1
+// writes and the merge's reads ahead (which are in flight for all runs at once) go to every device.
+// The runs of a merge pass start one directory further along, so that they don't all pile up on the first.
+string run_filename(const param_t &param, size_t pass, size_t run_id) {
+  string filename(param.tmp_directories[(pass + run_id) % param.num_tmp_directories]);
+  if (filename.empty() || filename.back() != '/') {
+    filename += '/';
   }
+  if (pass > 0) {
+    filename += to_string(pass) + "_";
+  }
+  return filename + to_string(run_id) + TMP_FILE_SUFFIX;
+}
 
-  // For each cycle, we must only extract the keys
-  size_t key_offset = 0;
-  size_t head_offset = 0;
-  for (size_t i = 0; i < num_partitions; i++) {
-    // Read to buffer
-    size_t read_amount = i != num_partitions - 1 ? READ_BUFFER_SIZE :
-                         (file_size - 1) % READ_BUFFER_SIZE + 1; // The last part will have remainders
+typedef struct run_job {
+  size_t run_id;
+  char *buffer;
+  size_t size;
+  char *refs;        // Sorted order of the buffer in SORT_INDIRECT mode, NULL otherwise
+  bool presorted;    // The buffer was in order as read, so refs weren't filled
+  bool last;         // No run follows
+} run_job_t;
 
-    for (size_t offset = 0; offset < read_amount;) {
-      size_t ret = pread(param.input_fd, param.buffer + offset, head_offset + read_amount - offset,
-                         head_offset + offset);
-      offset += ret;
-    }
-    head_offset += read_amount;
+// Make room for at least `needed` zeroed entries in a block index that grows with the runs
+static bool reserve_blocks(run_blocks_t *&blocks, size_t &capacity, size_t needed) {
+  if (needed <= capacity) {
+    return true;
+  }
+  size_t grown_capacity = capacity * 2 > needed ? capacity * 2 : needed;
+  run_blocks_t *grown = (run_blocks_t *) realloc(blocks, grown_capacity * sizeof(run_blocks_t));
+  if (grown == NULL) {
+    return false;
+  }
+  memset(grown + capacity, 0, (grown_capacity - capacity) * sizeof(run_blocks_t));
+  blocks = grown;
+  capacity = grown_capacity;
+  return true;
+}
+
+// Whether the records of buffer are in key order already. The first PRESORT_WINDOW records are looked at
+// on their own, which is all an unsorted buffer costs; then all of them, in one slice per thread, each
+// slice overlapping the next by one record.
+bool is_sorted(const layout_engine_t *engine, const char *buffer, size_t size, size_t num_threads) {
+  size_t record_size = engine->record_size;
+  size_t num_records = size / record_size;
+  size_t descents, duplicates;
+  engine->count_pairs(buffer, num_records < PRESORT_WINDOW ? num_records : PRESORT_WINDOW, descents, duplicates);
+  if (descents > 0 || num_records <= PRESORT_WINDOW) {
+    return descents == 0;
+  }
 
-    // Key copy
-    for (size_t j = 0; j < read_amount / TUPLE_SIZE; j++) {
-      memcpy(&keys[key_offset + j], ((tuple_t *) param.buffer) + j, KEY_SIZE);
+  size_t total = 0;
+  #pragma omp parallel for schedule(static) num_threads(num_threads) reduction(+:total) \
+      shared(engine, buffer, num_records, num_threads, record_size) default(none)
+  for (size_t i = 0; i < num_threads; i++) {
+    size_t first = i * num_records / num_threads;
+    size_t last = (i + 1) * num_records / num_threads;
+    size_t slice_descents = 0, slice_duplicates;
+    if (last > first) {
+      engine->count_pairs(buffer + first * record_size, last - first + (last < num_records), slice_descents,
+                          slice_duplicates);
     }
-    key_offset += (read_amount / TUPLE_SIZE);
+    total += slice_descents;
+  }
+  return total == 0;
+}
+
+// Runs by replacement selection, read and written by this thread through the whole memory budget
+bool phase1_replacement(param_t &param) {
+  chrono::time_point<chrono::system_clock> t1, t2;
+  t1 = chrono::high_resolution_clock::now();
+  size_t num_runs, input_size;
+  bool ok = replacement::generate_runs(param, [&param](size_t run_id) { return run_filename(param, 0, run_id); },
+                                       num_runs, input_size);
+  if (!ok) {
+    printf("[Error] replacement selection failed\n");
+  }
+  t2 = chrono::high_resolution_clock::now();
+  cout << "[Phase1] replacement selection: " << num_runs << " runs, "
+       << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << " (milliseconds)" << endl;
 
-    radix_sort::parallel_radix_sort((tuple_t *) param.buffer, read_amount / TUPLE_SIZE, 0);
+  param.file_size = input_size;
+  param.num_tuples = input_size / param.engine->record_size;
+  param.num_partitions = num_runs;
+  param.in_memory = num_runs == 0 && param.base_filename == NULL; // An empty input, and so an empty output
+  return ok;
+}
 
-    int output_fd;
-    string filename(TMP_DIRECTORY);
-    filename += to_string(i) + TMP_FILE_SUFFIX;
-    if ((output_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, 0777)) == -1) {
-      printf("[Error] failed to open input file %s\n", filename.c_str());
-      return;
+// Run generation as a three stage pipeline over param.num_buffers run buffers:
+// reader thread (pread) -> sort stage (this thread, OpenMP) -> writer thread (pwrite <tmp dir>/<i>.data).
+// While run i is sorted, run i+1 is being read and run i-1 written.
+// A buffer that is in order as read isn't sorted, and one whose records all order at or after the end of
+// the run before is appended to that run, so sorted stretches of the input make few long runs.
+// A streamed input is read until it ends, so its size and number of runs are only known afterwards;
+// if it all fits in the first run, that run is written straight to the output.
+// Input that samples nearly sorted goes to replacement selection instead (RUN_AUTO).
+// Returns false if the runs weren't all read and written.
+bool phase1(param_t &param) {
+  size_t file_size = param.file_size; // Input file size
+  size_t num_buffers = param.num_buffers;
+  size_t run_size = param.run_size;
+  size_t num_partitions = param.num_partitions; // Total runs produced from the input file
+  const layout_engine_t *engine = param.engine;
+  size_t record_size = engine->record_size;
+
+  if (param.run_mode == RUN_AUTO) {
+    replacement::presortedness_t measure;
+    if (!replacement::sample(param.input_fd, file_size, engine, param.buffer, measure)) {
+      printf("[Error] failed to sample input keys\n");
+      return false;
     }
+    param.run_mode = replacement::prefers_replacement(measure) ? RUN_REPLACEMENT : RUN_RADIX;
+    printf("[Plan] sampled %.4f of adjacent keys out of order, %.2f of windows in order: %s\n", measure.descents,
+           measure.ascending, param.run_mode == RUN_REPLACEMENT ? "replacement selection" : "sorted run buffers");
+  }
+  if (param.run_mode == RUN_REPLACEMENT) {
+    return phase1_replacement(param);
+  }
 
-    for (size_t offset = 0; offset < read_amount;) {
-      size_t ret = pwrite(output_fd, param.buffer + offset, read_amount - offset, offset);
-      offset += ret;
+  // Sample sort: choose the key ranges up front and record where each range starts in every run
+  size_t num_ranges = param.num_ranges > 1 ? param.num_ranges : 0;
+  if (num_ranges > 0) {
+    param.thresholds = (tuple_key_t *) malloc(sizeof(tuple_key_t) * (num_ranges - 1));
+    param.segments = (size_t *) malloc(sizeof(size_t) * (num_ranges + 1) * num_partitions);
+    if (param.thresholds == NULL || param.segments == NULL) {
+      printf("Buffer allocation failed (sample sort ranges)\n");
+      return false;
     }
+    if (!sample_sort::choose_splitters(param.input_fd, file_size, num_ranges, param.thresholds)) {
+      printf("[Error] failed to sample input keys\n");
+      return false;
+    }
+  }
 
-    close(output_fd);
+  bounded_queue<run_job_t> free_queue(num_buffers);
+  bounded_queue<run_job_t> sort_queue(num_buffers);
+  bounded_queue<run_job_t> write_queue(num_buffers);
+
+  // Run buffers first, then (indirect sort only) their (key, index) entries and the gather staging buffer,
+  // then (compressed runs only) the staging buffer of compressed blocks
+  size_t refs_per_run = run_size / record_size * engine->ref_size;
+  char *refs = NULL;
+  char *staging = NULL;
+  char *compress_staging = NULL;
+  if (param.sort_mode == SORT_INDIRECT) {
+    refs = param.buffer + align_up(run_size * num_buffers, IO_BLOCK_SIZE);
+    staging = param.buffer + align_up(refs + refs_per_run * num_buffers - param.buffer, IO_BLOCK_SIZE);
+  }
+  if (param.compress) {
+    char *end = staging != NULL ? staging + GATHER_BUFFER_SIZE : param.buffer + run_size * num_buffers;
+    compress_staging = param.buffer + align_up(end - param.buffer, IO_BLOCK_SIZE);
+  }
+  // Sized for the planned runs, grown by the writer as the runs of a stream come in
+  size_t blocks_capacity = 0;
+  if (param.compress && !reserve_blocks(param.run_blocks, blocks_capacity, num_partitions)) {
+    printf("Buffer allocation failed (run block index)\n");
+    return false;
   }
 
-  // Sort the key list, ascending order
-  t1 = chrono::high_resolution_clock::now();
-  radix_sort::parallel_radix_sort<tuple_key_t>(keys, num_tuples, 0);
-  t2 = chrono::high_resolution_clock::now();
-  duration = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
-  cout << "[Phase1] sorting: " << duration << " (milliseconds)" << endl;
+  for (size_t i = 0; i < num_buffers; i++) {
+    run_job_t job = {0, param.buffer + i * run_size, 0, refs != NULL ? refs + i * refs_per_run : NULL, false, false};
+    free_queue.push(job);
+  }
+
+  long long int read_duration = 0, sort_duration = 0, write_duration = 0;
+  bool read_ok = true, write_ok = true; // Each set by its own thread only
+
+  thread reader([&] {
+    telemetry::name_thread("reader");
+    chrono::time_point<chrono::system_clock> t1, t2;
+    run_job_t job;
+    size_t head_offset = 0;
+    size_t runs_read = 0;
+    bool more = true;
+    for (size_t i = 0; more && free_queue.pop(job); i++) {
+      t1 = chrono::high_resolution_clock::now();
+      // The last run has remainders
+      size_t read_amount = param.streaming || i != num_partitions - 1 ? run_size : file_size - head_offset;
+      size_t ret = io::read_fully(param.input_fd, job.buffer, read_amount, head_offset);
+      if (param.streaming) {
+        more = ret == read_amount;
+        if (ret % record_size != 0) {
+          printf("[Error] input ends with a partial record of %zu bytes, dropped\n", ret % record_size);
+        }
+        read_amount = ret - ret % record_size;
+        if (read_amount == 0 && i > 0) {
+          break; // Ended right after a full run
+        }
+      } else {
+        more = i + 1 < num_partitions;
+        if (ret < read_amount) {
+          printf("[Error] failed to read input at %zu\n", head_offset + ret);
+          read_ok = false;
+        } else if (!more && ret % record_size != 0) {
+          printf("[Error] input ends with a partial record of %zu bytes, dropped\n", ret % record_size);
+        }
+        read_amount = ret - ret % record_size;
+      }
+      job.run_id = i;
+      job.size = read_amount;
+      job.last = !more;
+      head_offset += read_amount;
+      t2 = chrono::high_resolution_clock::now();
+      read_duration += chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+      sort_queue.push(job);
+      runs_read++;
+    }
+    file_size = head_offset;
+    num_partitions = runs_read;
+    sort_queue.close();
+  });
+
+  // Plain runs without key ranges are written by the writer as one file per run of buffers in order.
+  // With -k, no run holds more than the top_k records that the merge may take from it.
+  bool extend = !param.compress && num_ranges == 0;
+  size_t run_limit = param.top_k > 0 && param.top_k < SIZE_MAX / record_size ? param.top_k * record_size : SIZE_MAX;
+  size_t runs_written = 0, buffers_presorted = 0;
+
+  thread writer([&] {
+    telemetry::name_thread("writer");
+    chrono::time_point<chrono::system_clock> t1, t2;
+    run_job_t job;
+    int run_fd = -1;
+    size_t run_bytes = 0;
+    string run_name;
+    fence::index_t run_fence;
+    vector<char> ends(3 * record_size); // The first and last record of a buffer, the last of the run
+    auto close_run = [&] {
+      io::close_file(run_fd);
+      if (!fence::write(run_fence, engine, run_name)) {
+        printf("[Error] failed to write fence index of %s\n", run_name.c_str());
+      }
+    };
+    while (write_queue.pop(job)) {
+      t1 = chrono::high_resolution_clock::now();
+      int output_fd;
+      string filename = run_filename(param, 0, job.run_id);
+      const char *refs = job.presorted ? NULL : job.refs;
+      if (job.run_id == 0 && job.last && param.base_filename == NULL && param.num_outputs == 0) {
+        // The whole input in one run, already in its final order
+        size_t size = job.size < run_limit ? job.size : run_limit;
+        if (!write_sorted(engine, param.output_fd, 0, job.buffer, size, refs, staging, NULL)) {
+          printf("[Error] failed to write output file\n");
+          write_ok = false;
+        }
+        param.in_memory = true;
+      } else if (extend) {
+        if (job.size > 0) {
+          char *first = ends.data(), *last = first + record_size, *run_end = last + record_size;
+          size_t num_records = job.size / record_size;
+          if (refs != NULL) {
+            engine->gather(job.buffer, refs, 1, first);
+            engine->gather(job.buffer, refs + (num_records - 1) * engine->ref_size, 1, last);
+          } else {
+            memcpy(first, job.buffer, record_size);
+            memcpy(last, job.buffer + job.size - record_size, record_size);
+          }
+          if (run_fd == -1 || engine->compare(run_end, first) > 0) {
+            if (run_fd != -1) {
+              close_run();
+            }
+            run_name = run_filename(param, 0, runs_written++);
+            run_bytes = 0;
+            fence::init(run_fence, engine, FENCE_INTERVAL);
+            if ((run_fd = io::open_file(run_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, param.io_backend)) == -1) {
+              printf("[Error] failed to open run file %s\n", run_name.c_str());
+              write_ok = false;
+            }
+          }
+          size_t size = run_limit - run_bytes < job.size ? run_limit - run_bytes : job.size;
+          if (run_fd != -1 && size > 0 &&
+              !write_sorted(engine, run_fd, run_bytes, job.buffer, size, refs, staging, &run_fence)) {
+            printf("[Error] failed to write run file %s\n", run_name.c_str());
+            write_ok = false;
+          }
+          run_bytes += size;
+          memcpy(run_end, last, record_size);
+        }
+      } else if ((output_fd = io::open_file(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                            param.io_backend)) == -1) {
+        printf("[Error] failed to open input file %s\n", filename.c_str());
+        write_ok = false;
+      } else if (param.compress && !reserve_blocks(param.run_blocks, blocks_capacity, job.run_id + 1)) {
+        printf("Buffer allocation failed (run block index)\n");
+        io::close_file(output_fd);
+        write_ok = false;
+      } else if (param.compress) {
+        // Key ranges of a sample sort start new blocks, so that they can be merged on their own
+        const size_t *cuts = num_ranges > 0 ? param.segments + job.run_id * (num_ranges + 1) : NULL;
+        run_blocks_t &blocks = param.run_blocks[job.run_id];
+        if (!codec::write_run(output_fd, job.buffer, job.size, (const tuple_ref_t *) refs, staging,
+                              compress_staging, param.block_size, cuts, num_ranges > 0 ? num_ranges + 1 : 0, blocks)) {
+          printf("[Error] failed to write run file %s\n", filename.c_str());
+          write_ok = false;
+        }
+        io::close_file(output_fd);
+        t2 = chrono::high_resolution_clock::now();
+        double seconds = chrono::duration_cast<chrono::microseconds>(t2 - t1).count() / 1e6;
+        size_t compressed = blocks.file_offsets != NULL ? blocks.file_offsets[blocks.num_blocks] : 0;
+        printf("[Phase1] run %zu: %zu -> %zu bytes (ratio %.2f) in %zu blocks, %.1f MB/s\n", job.run_id, job.size,
+               compressed, compressed > 0 ? (double) job.size / compressed : 0.0, blocks.num_blocks,
+               seconds > 0 ? job.size / seconds / 1e6 : 0.0);
+      } else {
+        if (!write_sorted(engine, output_fd, 0, job.buffer, job.size, refs, staging, NULL)) {
+          printf("[Error] failed to write run file %s\n", filename.c_str());
+          write_ok = false;
+        }
+        io::close_file(output_fd);
+      }
+      t2 = chrono::high_resolution_clock::now();
+      write_duration += chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+      free_queue.push(job);
+    }
+    if (run_fd != -1) {
+      close_run();
+    }
+  });
+
+  chrono::time_point<chrono::system_clock> t1, t2;
+  run_job_t job;
+  while (sort_queue.pop(job)) {
+    t1 = chrono::high_resolution_clock::now();
+    validate::add(param.input_sum, job.buffer, job.size, record_size, param.num_threads);
+    job.presorted = is_sorted(engine, job.buffer, job.size, param.num_threads);
+    if (job.presorted) {
+      buffers_presorted++;
+    } else {
+      sort_buffer(engine, job.buffer, job.size, job.refs, param.sort_mode);
+    }
+    if (num_ranges > 0) {
+      sample_sort::segment(job.buffer, (const tuple_ref_t *) (job.presorted ? NULL : job.refs), job.size,
+                           param.thresholds, num_ranges, param.segments + job.run_id * (num_ranges + 1));
+    }
+    t2 = chrono::high_resolution_clock::now();
+    sort_duration += chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+    write_queue.push(job);
+  }
+  write_queue.close();
 
-  // Need $(num_partitions - 1) keys to separate the whole input into $num_partitions parts.
-  // They will be used as following (ex. num_partitions = 4)
-  // if (key < threshold[0]): put to file 0,
-  // else if (key < threshold[1]): put to file 1,
-  // else if (key < threshold[2]): put to file 2,
-  // else: put to file 3
-  tuple_key_t *thresholds = (tuple_key_t *) malloc(sizeof(tuple_key_t) * (num_partitions - 1));
-  const size_t chunk_size = num_tuples / num_partitions; // Tuples per partition
+  reader.join();
+  writer.join();
 
-  for (size_t i = 1; i < num_partitions; i++) {
-    memcpy(&thresholds[i - 1], &keys[chunk_size * i], KEY_SIZE);
+  cout << "[Phase1] reading: " << read_duration << " (milliseconds)" << endl;
+  cout << "[Phase1] sorting (" << sort_mode_name(param.sort_mode) << "): " << sort_duration << " (milliseconds)"
+       << endl;
+  cout << "[Phase1] writing: " << write_duration << " (milliseconds)" << endl;
+  if (extend && !param.in_memory) {
+    printf("[Phase1] %zu buffers (%zu in order as read) written as %zu runs\n", num_partitions, buffers_presorted,
+           runs_written);
+    num_partitions = runs_written;
   }
 
   param.file_size = file_size;
-  param.num_tuples = num_tuples;
-  param.thresholds = thresholds;
+  param.num_tuples = file_size / record_size;
   param.num_partitions = num_partitions;
-  param.sorted_keys = keys;
+  param.num_ranges = num_ranges;
+  return read_ok && write_ok;
 }
 
-void phase2(param_t &param) {
-  int tmp_fds[param.num_partitions];
-  char *input_buffers[param.num_partitions];
-  size_t buffer_size = READ_BUFFER_SIZE / param.num_partitions;
-  for (size_t i = 0; i < param.num_partitions; i++) {
-    string filename(TMP_DIRECTORY);
-    filename += to_string(i) + TMP_FILE_SUFFIX;
-    if ((tmp_fds[i] = open(filename.c_str(), O_RDONLY)) == -1) {
-      printf("[Error] failed to open input file %s\n", filename.c_str());
-      return;
-    }
-    input_buffers[i] = i != param.num_partitions - 1 ? param.buffer + (i + 1) * buffer_size
-                                                     : param.buffer;
-    // Since last partition's first chunk is already set in param.buffer from before, leave it there.
-    if (i != param.num_partitions) {
-      for (size_t offset = 0; offset < buffer_size;) {
-        size_t ret = pread(tmp_fds[i], input_buffers[i], buffer_size - offset, offset);
-        offset += ret;
+// Bytes of the sections of num_runs runs together, which their merge has to write
+size_t section_bytes(const section_t *runs, size_t num_runs) {
+  size_t total = 0;
+  for (size_t i = 0; i < num_runs; i++) {
+    total += runs[i].tail - runs[i].head;
+  }
+  return total;
+}
+
+// Merge whole run files into output_fd with the loser tree, using the merge half of param.buffer.
+// blocks[i] is the block index of a compressed run file, NULL for a plain one.
+bool merge_files(param_t &param, const vector<string> &filenames, const vector<const run_blocks_t *> &blocks,
+                 int output_fd) {
+  size_t num_runs = filenames.size();
+  int fds[num_runs];
+  section_t runs[num_runs];
+  for (size_t i = 0; i < num_runs; i++) {
+    if ((fds[i] = io::open_file(filenames[i].c_str(), O_RDONLY, param.io_backend)) == -1) {
+      printf("[Error] failed to open input file %s\n", filenames[i].c_str());
+      for (size_t j = 0; j < i; j++) {
+        io::close_file(fds[j]);
       }
+      return false;
     }
+    runs[i].head = 0;
+    runs[i].tail = blocks[i] != NULL ? blocks[i]->raw_offsets[blocks[i]->num_blocks] : lseek(fds[i], 0, SEEK_END);
   }
-  char *output_buffer;
-  if ((output_buffer = (char *) malloc(sizeof(char) * WRITE_BUFFER_SIZE)) == NULL) {
-    printf("Buffer allocation failed (output write buffer)\n");
-    return;
+
+  // k-way merge of the sorted runs through a loser tree, O(N log P)
+  size_t expected = section_bytes(runs, num_runs);
+  size_t merged = param.engine->merge(fds, runs, blocks.data(), num_runs, param.buffer, param.merge_buffer_size,
+                                      param.buffer + param.merge_buffer_size, param.output_buffer_size, output_fd, 0,
+                                      param.queue_depth, param.num_threads);
+  if (merged != expected) {
+    printf("[Error] merged %zu of %zu bytes of %zu runs\n", merged, expected, num_runs);
   }
 
-  size_t num_partitions = param.num_partitions;
-  section_t output_buffer_section = {0, WRITE_BUFFER_SIZE};
-  section_t input_buffer_sections[param.num_partitions];
-  section_t input_buffer_global_sections[param.num_partitions];
+  for (size_t i = 0; i < num_runs; i++) {
+    io::close_file(fds[i]);
+  }
+  return merged == expected;
+}
 
-  for (size_t partition_id = 0; partition_id < param.num_partitions; partition_id++) {
-    input_buffer_global_sections[partition_id].head = buffer_size; // Already read the first chunks
-    input_buffer_global_sections[partition_id].tail = READ_BUFFER_SIZE;
-    input_buffer_sections[partition_id].head = 0;
-    input_buffer_sections[partition_id].tail = buffer_size;
+// Merge num_sections sections of the runs fds, section s being the byte ranges
+// [segments[i * (num_sections + 1) + s], segments[i * (num_sections + 1) + s + 1]) of every run i, each
+// straight into its known region of output_fd, or into output_fds[s] of its own unless that is NULL.
+// Sections are spread over num_workers threads, each with an equal share of the input and output buffers.
+// Returns false if any section wasn't merged whole.
+bool merge_sections(param_t &param, const int *fds, const run_blocks_t *const *blocks, size_t num_runs,
+                    const size_t *segments, size_t num_sections, size_t num_workers, int output_fd,
+                    const int *output_fds) {
+  size_t stride = num_sections + 1;
+  size_t section_offsets[num_sections];
+  size_t sum = 0;
+  for (size_t section = 0; section < num_sections; section++) {
+    section_offsets[section] = output_fds != NULL ? 0 : sum;
+    for (size_t run_id = 0; run_id < num_runs; run_id++) {
+      sum += segments[run_id * stride + section + 1] - segments[run_id * stride + section];
+    }
   }
 
-  size_t output_offset = 0;
-  // Before stepping into this step, we must fill in the input buffers with the first ata sets
-  for (size_t tuple_id = 0; tuple_id < param.num_tuples; tuple_id++) {
-    tuple_key_t &key = param.sorted_keys[tuple_id];
+  size_t num_decoders = param.num_threads > num_workers ? param.num_threads / num_workers : 1;
+  size_t input_share = param.merge_buffer_size / num_workers / IO_UNIT * IO_UNIT;
+  size_t output_share = param.output_buffer_size / num_workers / IO_UNIT * IO_UNIT;
+  char *output_buffer = param.buffer + param.merge_buffer_size;
 
-    size_t idx;
-    for (idx = 0; idx < param.num_partitions; idx++) {
-      if (input_buffer_sections[idx].head == input_buffer_sections[idx].tail) {
-        continue;
-      }
+  bool ok = true;
+  #pragma omp parallel for schedule(dynamic, 1) num_threads(num_workers) reduction(&&:ok) \
+      shared(param, fds, blocks, segments, output_buffer, num_runs, num_sections, stride, section_offsets, \
+             input_share, output_share, num_decoders, output_fd, output_fds) \
+      default(none)
+  for (size_t section = 0; section < num_sections; section++) {
+    size_t worker = omp_get_thread_num();
+    section_t runs[num_runs];
+    for (size_t run_id = 0; run_id < num_runs; run_id++) {
+      runs[run_id].head = segments[run_id * stride + section];
+      runs[run_id].tail = segments[run_id * stride + section + 1];
+    }
+    size_t expected = section_bytes(runs, num_runs);
+    size_t merged = param.engine->merge(fds, runs, blocks, num_runs, param.buffer + worker * input_share, input_share,
+                                        output_buffer + worker * output_share, output_share,
+                                        output_fds != NULL ? output_fds[section] : output_fd,
+                                        section_offsets[section], param.queue_depth, num_decoders);
+    if (merged != expected) {
+      printf("[Error] merged %zu of %zu bytes of section %zu\n", merged, expected, section);
+      ok = false;
+    }
+  }
+  return ok;
+}
 
-      tuple_key_t &comp = *(tuple_key_t *) (input_buffers[idx] + input_buffer_sections[idx].head);
-      if (key == comp) {
-        memcpy(output_buffer + output_buffer_section.head, &key, TUPLE_SIZE);
-        input_buffer_sections[idx].head += TUPLE_SIZE;
-        output_buffer_section.head += TUPLE_SIZE;
-        break;
+// Sample sort: every key range is merged on its own, from its segment of each run, by param.merge_workers,
+// into its region of the output or into its own key-range file (-P)
+bool merge_ranges(param_t &param) {
+  size_t num_runs = param.num_partitions;
+
+  vector<int> tmp_fds(num_runs);
+  for (size_t i = 0; i < num_runs; i++) {
+    string filename = run_filename(param, 0, i);
+    if ((tmp_fds[i] = io::open_file(filename.c_str(), O_RDONLY, param.io_backend)) == -1) {
+      printf("[Error] failed to open input file %s\n", filename.c_str());
+      for (size_t j = 0; j < i; j++) {
+        io::close_file(tmp_fds[j]);
       }
+      return false;
     }
+  }
 
-    // If partition buffer is all read, read another chunk
-    if (input_buffer_sections[idx].head == input_buffer_sections[idx].tail) {
-      // Read another chunk only if available
-      if (input_buffer_global_sections[idx].head != input_buffer_global_sections[idx].tail) {
-        for (size_t offset = 0; offset < buffer_size;) {
-          size_t ret = pread(tmp_fds[idx], input_buffers[idx], buffer_size - offset,
-                             input_buffer_global_sections[idx].head + offset);
-          offset += ret;
-        }
-        input_buffer_global_sections[idx].head += buffer_size;
-        input_buffer_sections[idx].head = 0;
+  const run_blocks_t *blocks[num_runs];
+  for (size_t i = 0; i < num_runs; i++) {
+    blocks[i] = param.run_blocks != NULL ? &param.run_blocks[i] : NULL;
+  }
+
+  bool ok = merge_sections(param, tmp_fds.data(), blocks, num_runs, param.segments, param.num_ranges,
+                           param.merge_workers, param.output_fd, param.output_fds);
+
+  for (size_t i = 0; i < num_runs; i++) {
+    io::close_file(tmp_fds[i]);
+  }
+  return ok;
+}
+
+// A merge of plain run files cut by merge path into slices merged by up to num_workers workers: with
+// output_fds, into num_slices key-range files, records with equal keys never split between two of them;
+// otherwise into output_fd, a slice per worker of at least MIN_MERGE_CHUNK bytes each. Only the first
+// limit records are merged unless limit is 0, and the runs are only read up to where those end (-k).
+// The cuts are found with the fence index next to each run file, or one sampled from the run if it has
+// none (the runs of a cascaded merge pass).
+bool merge_path_files(param_t &param, const vector<string> &filenames, int output_fd, const int *output_fds,
+                      size_t num_slices, size_t num_workers, size_t limit) {
+  chrono::time_point<chrono::system_clock> t1, t2;
+  t1 = chrono::high_resolution_clock::now();
+  const layout_engine_t *engine = param.engine;
+  size_t num_runs = filenames.size();
+  int fds[num_runs];
+  vector<fence::index_t> fences(num_runs);
+  bool ok = true;
+  for (size_t i = 0; i < num_runs; i++) {
+    if ((fds[i] = io::open_file(filenames[i].c_str(), O_RDONLY, param.io_backend)) == -1) {
+      printf("[Error] failed to open input file %s\n", filenames[i].c_str());
+      for (size_t j = 0; j < i; j++) {
+        io::close_file(fds[j]);
       }
+      return false;
     }
+    size_t size = lseek(fds[i], 0, SEEK_END);
+    if (ok && !fence::read(fences[i], engine, filenames[i], size / engine->record_size)) {
+      ok = fence::sample(fds[i], size, engine, FENCE_INTERVAL, fences[i]);
+    }
+  }
+  size_t scratch_size = 0;
+  for (size_t i = 0; i < num_runs; i++) {
+    scratch_size = max(scratch_size, fences[i].interval * engine->record_size);
+  }
+  if (ok && scratch_size > param.memory_budget) {
+    printf("[Error] fence intervals of %zu bytes don't fit the memory budget\n", scratch_size);
+    ok = false;
+  }
 
-    // If output buffer is full, flush
-    if (output_buffer_section.head == output_buffer_section.tail) {
-      for (size_t offset = 0; offset < WRITE_BUFFER_SIZE;) {
-        size_t ret = pwrite(param.output_fd, output_buffer, WRITE_BUFFER_SIZE - offset, output_offset + offset);
-        offset += ret;
-      }
-      output_buffer_section.head = 0;
-      output_offset += WRITE_BUFFER_SIZE;
+  // The runs end where the first limit records of the merge do
+  if (ok && limit > 0) {
+    vector<size_t> positions(num_runs);
+    ok = merge_path::cut(fds, fences.data(), num_runs, limit, engine, param.buffer, positions.data());
+    for (size_t i = 0; ok && i < num_runs; i++) {
+      fence::truncate(fences[i], positions[i]);
     }
   }
+  size_t total = 0;
+  for (size_t i = 0; i < num_runs; i++) {
+    total += fences[i].num_records * engine->record_size;
+  }
+  if (ok && total == 0) {
+    // Nothing to merge; the outputs were opened empty
+    for (size_t i = 0; i < num_runs; i++) {
+      io::close_file(fds[i]);
+    }
+    return true;
+  }
+
+  if (output_fds == NULL) {
+    num_slices = min(num_workers, max(total / MIN_MERGE_CHUNK, (size_t) 1));
+  }
+  num_workers = min(num_workers, num_slices);
+  vector<size_t> segments(num_runs * (num_slices + 1));
+  ok = ok && merge_path::partition(fds, fences.data(), num_runs, num_slices, engine, output_fds == NULL, param.buffer,
+                                   segments.data());
+  t2 = chrono::high_resolution_clock::now();
+  cout << "[Phase2] merge path: " << num_slices << " slices of " << total << " bytes, cut in "
+       << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() << " (milliseconds)" << endl;
 
-  free(output_buffer);
+  if (ok) {
+    const run_blocks_t *blocks[num_runs];
+    for (size_t i = 0; i < num_runs; i++) {
+      blocks[i] = NULL;
+    }
+    ok = merge_sections(param, fds, blocks, num_runs, segments.data(), num_slices, num_workers, output_fd,
+                        output_fds);
+  } else {
+    printf("[Error] failed to read run files for merge path\n");
+  }
+  for (size_t i = 0; i < num_runs; i++) {
+    io::close_file(fds[i]);
+  }
+  return ok;
 }
 
-void check_output(char *filename, char *buffer) {
-  int fd;
-  if ((fd = open(filename, O_RDONLY | O_NONBLOCK)) == -1) {
-    printf("Can't open output file\n");
-    return;
+// Copies size bytes at offset of fd to the output at output_offset, through the merge buffer
+bool copy_range(param_t &param, int fd, size_t offset, size_t size, size_t output_offset) {
+  size_t block = param.merge_buffer_size;
+  for (size_t done = 0; done < size;) {
+    size_t amount = size - done < block ? size - done : block;
+    if (io::read_fully(fd, param.buffer, amount, offset + done) != amount ||
+        !io::write_fully(param.output_fd, param.buffer, amount, output_offset + done)) {
+      return false;
+    }
+    done += amount;
   }
+  return true;
+}
 
-  size_t file_size = lseek(fd, 0, SEEK_END);                  // Input file size
-  size_t num_tuples = file_size / TUPLE_SIZE;                       // Number of tuples
-  size_t num_partitions = (file_size - 1) / READ_BUFFER_SIZE + 1;   // Total cycles run to process the input file
+// Appending: merges the sorted new runs into the base file. With the base's fence index, the new runs are
+// merged into one first (<tmp dir>/<pass>_0.data) and the stretches of the base that none of its records
+// fall into are copied; without one, the base is just one more run of the final merge.
+bool merge_append(param_t &param, vector<string> run_files, vector<const run_blocks_t *> run_blocks, size_t pass) {
+  chrono::time_point<chrono::system_clock> t1, t2;
+  const layout_engine_t *engine = param.engine;
+  size_t record_size = engine->record_size;
+  fence::index_t base;
+  bool indexed = fence::read(base, engine, param.base_filename, param.base_size / record_size);
+  if (!indexed || base.interval * record_size > param.memory_budget) {
+    if (!indexed) {
+      printf("[Append] base file has no fence index, or one older than the file, merging all of it\n");
+    } else {
+      printf("[Append] fence interval of the base file (%zu bytes) doesn't fit the memory budget, merging all "
+             "of it\n", base.interval * record_size);
+    }
+    run_files.push_back(param.base_filename);
+    run_blocks.push_back(NULL);
+    return merge_files(param, run_files, run_blocks, param.output_fd);
+  }
 
-  tuple_key_t *keys;
-  if ((keys = (tuple_key_t *) malloc(sizeof(tuple_key_t) * num_tuples)) == NULL) {
-    printf("Buffer allocation failed (key buffer)\n");
-    return;
+  bool ok = true;
+  if (run_files.size() > 1 || (run_files.size() == 1 && run_blocks[0] != NULL)) {
+    t1 = chrono::high_resolution_clock::now();
+    int output_fd;
+    string filename = run_filename(param, pass, 0);
+    unlink((filename + FENCE_SUFFIX).c_str());
+    if ((output_fd = io::open_file(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, param.io_backend)) == -1) {
+      printf("[Error] failed to open input file %s\n", filename.c_str());
+      return false;
+    }
+    ok = merge_files(param, run_files, run_blocks, output_fd);
+    io::close_file(output_fd);
+    if (!ok) {
+      return false;
+    }
+    for (size_t i = 0; i < run_files.size(); i++) {
+      unlink(run_files[i].c_str());
+      unlink((run_files[i] + FENCE_SUFFIX).c_str());
+    }
+    run_files.assign(1, filename);
+    t2 = chrono::high_resolution_clock::now();
+    cout << "[Phase2] merge pass " << pass << ": " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count()
+         << " (milliseconds)" << endl;
   }
 
-  // For each cycle, we must only extract the keys
-  size_t key_offset = 0;
-  size_t head_offset = 0;
-  for (size_t i = 0; i < num_partitions; i++) {
-    size_t read_amount = i != num_partitions - 1 ? READ_BUFFER_SIZE :
-                         (file_size - 1) % READ_BUFFER_SIZE + 1; // The last part will have remainders
+  // The new records as one run, indexed too, to find where they fall in the base
+  int added_fd = -1;
+  fence::index_t added;
+  fence::init(added, engine, FENCE_INTERVAL);
+  if (!run_files.empty()) {
+    if ((added_fd = io::open_file(run_files[0].c_str(), O_RDONLY, param.io_backend)) == -1) {
+      printf("[Error] failed to open input file %s\n", run_files[0].c_str());
+      return false;
+    }
+    size_t size = lseek(added_fd, 0, SEEK_END);
+    if (!fence::read(added, engine, run_files[0], size / record_size)) {
+      ok = fence::sample(added_fd, size, engine, FENCE_INTERVAL, added);
+    }
+  }
+  vector<incremental::span_t> spans;
+  ok = ok && incremental::plan_spans(param.base_fd, base, added_fd, added, engine, APPEND_MIN_COPY, param.buffer,
+                                     spans);
 
-    for (size_t offset = 0; offset < read_amount;) {
-      size_t ret = pread(fd, buffer + offset, head_offset + read_amount - offset,
-                         head_offset + offset);
-      offset += ret;
+  int fds[2] = {param.base_fd, added_fd};
+  const run_blocks_t *blocks[2] = {NULL, NULL};
+  size_t output_offset = 0, copied = 0;
+  for (size_t i = 0; ok && i < spans.size(); i++) {
+    const incremental::span_t &span = spans[i];
+    size_t base_bytes = span.base_tail - span.base_head;
+    if (span.added_head == span.added_tail) {
+      ok = copy_range(param, param.base_fd, span.base_head, base_bytes, output_offset);
+      copied += base_bytes;
+    } else {
+      section_t runs[2] = {{span.base_head, span.base_tail}, {span.added_head, span.added_tail}};
+      size_t expected = section_bytes(runs, 2);
+      ok = engine->merge(fds, runs, blocks, 2, param.buffer, param.merge_buffer_size,
+                         param.buffer + param.merge_buffer_size, param.output_buffer_size, param.output_fd,
+                         output_offset, param.queue_depth, param.num_threads) == expected;
     }
-    head_offset += read_amount;
+    output_offset += base_bytes + span.added_tail - span.added_head;
+  }
+  if (added_fd != -1) {
+    io::close_file(added_fd);
+  }
+  if (!ok) {
+    printf("[Error] failed to merge into base file %s\n", param.base_filename);
+    return false;
+  }
+  printf("[Phase2] append: %zu spans, %zu of %zu base bytes copied without merging\n", spans.size(), copied,
+         param.base_size);
+  return true;
+}
+
+// While there are more runs than the planned fan-in, merge them in balanced groups of at most
+// param.fan_in into the runs of the next pass (<tmp dir>/<pass>_<i>.data), then merge the rest into the output,
+// by merge path over several workers when the merge buffer holds chunks for them. When appending, the base
+// file takes one place of the fan-in. With -k, every merge stops after the top_k records; with -P, the
+// last merge is cut into the key-range files. Returns false if a merge failed.
+bool phase2(param_t &param) {
+  if (param.num_ranges > 0) {
+    return merge_ranges(param);
+  }
 
-    tuple_t *data = (tuple_t *) buffer;
-    // Need to extract only the keys
-    for (size_t j = 0; j < read_amount / TUPLE_SIZE; j++) {
-      memcpy(&keys[key_offset + j], &data[j], KEY_SIZE);
+  chrono::time_point<chrono::system_clock> t1, t2;
+  vector<string> run_files;
+  vector<const run_blocks_t *> run_blocks; // Only the runs of phase1 may be compressed
+  for (size_t i = 0; i < param.num_partitions; i++) {
+    run_files.push_back(run_filename(param, 0, i));
+    run_blocks.push_back(param.run_blocks != NULL ? &param.run_blocks[i] : NULL);
+  }
+
+  size_t fan_in = param.base_filename != NULL && param.fan_in > 2 ? param.fan_in - 1 : param.fan_in;
+  size_t pass = 1;
+  for (; run_files.size() > fan_in; pass++) {
+    t1 = chrono::high_resolution_clock::now();
+    size_t num_groups = (run_files.size() - 1) / fan_in + 1;
+    vector<string> next_files;
+    vector<const run_blocks_t *> next_blocks;
+    for (size_t group = 0; group < num_groups; group++) {
+      size_t first = group * run_files.size() / num_groups;
+      size_t last = (group + 1) * run_files.size() / num_groups;
+      vector<string> group_files(run_files.begin() + first, run_files.begin() + last);
+      vector<const run_blocks_t *> group_blocks(run_blocks.begin() + first, run_blocks.begin() + last);
+      if (group_files.size() == 1) {
+        next_files.push_back(group_files[0]);
+        next_blocks.push_back(group_blocks[0]);
+        continue;
+      }
+
+      int output_fd;
+      string filename = run_filename(param, pass, group);
+      unlink((filename + FENCE_SUFFIX).c_str()); // Of an earlier sort; these runs are sampled instead
+      if ((output_fd = io::open_file(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, param.io_backend)) == -1) {
+        printf("[Error] failed to open input file %s\n", filename.c_str());
+        return false;
+      }
+      bool merged = param.top_k > 0 ?
+                    merge_path_files(param, group_files, output_fd, NULL, 1, 1, param.top_k) :
+                    merge_files(param, group_files, group_blocks, output_fd);
+      io::close_file(output_fd);
+      if (!merged) {
+        return false;
+      }
+      for (size_t i = 0; i < group_files.size(); i++) {
+        unlink(group_files[i].c_str());
+        unlink((group_files[i] + FENCE_SUFFIX).c_str());
+      }
+      next_files.push_back(filename);
+      next_blocks.push_back(NULL);
     }
-    key_offset += (read_amount / TUPLE_SIZE);
+    run_files = next_files;
+    run_blocks = next_blocks;
+
+    t2 = chrono::high_resolution_clock::now();
+    cout << "[Phase2] merge pass " << pass << ": " << chrono::duration_cast<chrono::milliseconds>(t2 - t1).count()
+         << " (milliseconds)" << endl;
   }
 
-  size_t cnt = 0;
-  for (size_t i = 1; i < num_tuples; i++) {
-    if (keys[i - 1] > keys[i]) {
-      cnt++;
+  if (param.base_filename != NULL) {
+    return merge_append(param, run_files, run_blocks, pass);
+  }
+
+  size_t num_workers = planner::merge_workers(param, run_files.size());
+  bool compressed = false;
+  for (const run_blocks_t *blocks : run_blocks) {
+    compressed = compressed || blocks != NULL;
+  }
+  if (param.num_outputs > 0) {
+    return merge_path_files(param, run_files, -1, param.output_fds, param.num_outputs, max(num_workers, (size_t) 1),
+                            0);
+  } else if (param.top_k > 0) {
+    // A stream takes the records in order, from a single slice
+    num_workers = io::is_stream(param.output_fd) ? 1 : max(num_workers, (size_t) 1);
+    return merge_path_files(param, run_files, param.output_fd, NULL, 0, num_workers, param.top_k);
+  } else if (num_workers > 1 && !compressed && !io::is_stream(param.output_fd)) {
+    return merge_path_files(param, run_files, param.output_fd, NULL, 0, num_workers, 0);
+  }
+  return merge_files(param, run_files, run_blocks, param.output_fd);
+}
+
+// Streams the output files through the memory budget, checking their order, within each file and from one
+// key-range file to the next, and that together they hold the input's records (with -k, that there are as
+// many as it asks for), and writes the fence index of each with write_fence. Returns false if they don't.
+bool check_output(const vector<string> &filenames, const param_t &param, bool write_fence) {
+  const layout_engine_t *engine = param.engine;
+  size_t record_size = engine->record_size;
+  validate::summary_t total;
+  memset(&total, 0, sizeof(total));
+  vector<char> last(record_size), first(record_size);
+  bool any = false; // Record in last
+  for (const string &filename : filenames) {
+    int fd;
+    if ((fd = io::open_file(filename.c_str(), O_RDONLY | O_NONBLOCK, param.io_backend)) == -1) {
+      printf("Can't open output file\n");
+      return false;
+    }
+    size_t size = lseek(fd, 0, SEEK_END);
+    fence::index_t fence;
+    fence::init(fence, engine, FENCE_INTERVAL);
+    validate::summary_t summary;
+    bool ok = validate::check_file(fd, param.buffer, param.memory_budget, engine, param.num_threads,
+                                   param.queue_depth, summary, write_fence ? &fence : NULL);
+    if (ok && size >= record_size) {
+      ok = io::read_fully(fd, first.data(), record_size, 0) == record_size;
+      if (ok && any && engine->compare(last.data(), first.data()) > 0) {
+        summary.descents++;
+      }
+      ok = ok && io::read_fully(fd, last.data(), record_size, size / record_size * record_size - record_size) ==
+                 record_size;
+      any = true;
     }
+    io::close_file(fd);
+    if (!ok) {
+      printf("[Error] failed to read output file %s\n", filename.c_str());
+      return false;
+    }
+    if (write_fence && !fence::write(fence, engine, filename)) {
+      printf("[Error] failed to write fence index of %s\n", filename.c_str());
+    }
+    if (filenames.size() > 1) {
+      printf("[Validation] %s: %zu records\n", filename.c_str(), summary.sum.records);
+    }
+    validate::add(total.sum, summary.sum);
+    total.descents += summary.descents;
+    total.duplicates += summary.duplicates;
   }
-  printf("[Validation] Total of %zu tuples in the wrong place\n", cnt);
-  close(fd);
-  free(keys);
-}
\ No newline at end of file
+
+  char checksum[33];
+  validate::format(total.sum, checksum);
+  printf("[Validation] Records: %zu\n", total.sum.records);
+  printf("[Validation] Checksum: %s\n", checksum);
+  printf("[Validation] Duplicate keys: %zu\n", total.duplicates);
+  printf("[Validation] Total of %zu tuples in the wrong place\n", total.descents);
+  if (param.top_k > 0) {
+    // The checksum of the records that made the cut isn't known up front
+    size_t expected = param.top_k < param.input_sum.records ? param.top_k : param.input_sum.records;
+    if (total.sum.records != expected) {
+      printf("[Error] output holds %zu records instead of the top %zu of %zu\n", total.sum.records, expected,
+             param.input_sum.records);
+      return false;
+    }
+  } else if (total.sum.records != param.input_sum.records || total.sum.low != param.input_sum.low ||
+             total.sum.high != param.input_sum.high) {
+    validate::format(param.input_sum, checksum);
+    printf("[Error] output doesn't hold the input's records (input: %zu records, checksum %s)\n",
+           param.input_sum.records, checksum);
+    return false;
+  }
+  return total.descents == 0;
+}
+
+// Adds the base file's records to the input's checksum, taken from its fence index if it has one that
+// holds it and was written for the file as it is now, else by reading it all, which also checks that it
+// is sorted
+bool check_base(param_t &param) {
+  fence::index_t index;
+  size_t num_records = param.base_size / param.engine->record_size;
+  char checksum[33];
+  if (fence::read(index, param.engine, param.base_filename, num_records) &&
+      index.sum.records == num_records) {
+    validate::add(param.input_sum, index.sum);
+    validate::format(index.sum, checksum);
+    printf("[Append] base file: %zu records, checksum %s, from its fence index\n", num_records, checksum);
+    return true;
+  }
+
+  validate::summary_t summary;
+  if (!validate::check_file(param.base_fd, param.buffer, param.memory_budget, param.engine, param.num_threads,
+                            param.queue_depth, summary, NULL)) {
+    printf("[Error] failed to read base file %s\n", param.base_filename);
+    return false;
+  }
+  if (summary.descents > 0) {
+    printf("[Error] base file %s isn't sorted: %zu records out of place\n", param.base_filename, summary.descents);
+    return false;
+  }
+  validate::add(param.input_sum, summary.sum);
+  validate::format(summary.sum, checksum);
+  printf("[Append] base file: %zu records, checksum %s, checked\n", num_records, checksum);
+  return true;
+}
+
+// Start measuring the peak resident set size anew (Linux: resets VmHWM)
+void reset_peak_rss() {
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+// Peak resident set size in kilobytes since the last reset_peak_rss(), 0 if unknown
+size_t peak_rss() {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL) {
+    return 0;
+  }
+  char line[256];
+  size_t peak = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmHWM:", 6) == 0) {
+      peak = strtoull(line + 6, NULL, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return peak;
+}
@@ -0,0 +1,439 @@
+#include "run_codec.h"
+#include "io_backend.h"
+#include "parallel_radix_sort.h"
+#include "telemetry.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (16)
+#define LZ_LAST_LITERALS (8)  // No match starts this close to the end, so 4 byte reads stay in bounds
+
+namespace codec {
+
+  typedef struct block_header {
+    uint32_t raw_size;      // Tuple bytes
+    uint32_t stored_size;   // Bytes after the header
+    uint32_t encoded_size;  // Front coded keys and payloads before the LZ stage, BLOCK_LZ only
+    uint32_t method;
+  } block_header_t;
+
+  /// Front coding
+
+  // Keys first, each as (shared prefix length, first differing byte - previous byte, rest of the key),
+  // then the payloads back to back. At most num_tuples * (TUPLE_SIZE + 1) bytes.
+  static size_t encode_tuples(const char *tuples, size_t num_tuples, uint8_t *out) {
+    uint8_t prev[KEY_SIZE] = {0};
+    size_t op = 0;
+    for (size_t i = 0; i < num_tuples; i++) {
+      const uint8_t *key = (const uint8_t *) tuples + i * TUPLE_SIZE;
+      size_t shared = 0;
+      while (shared < KEY_SIZE && key[shared] == prev[shared]) {
+        shared++;
+      }
+      out[op++] = shared;
+      if (shared < KEY_SIZE) {
+        out[op++] = key[shared] - prev[shared];
+        memcpy(out + op, key + shared + 1, KEY_SIZE - shared - 1);
+        op += KEY_SIZE - shared - 1;
+      }
+      memcpy(prev, key, KEY_SIZE);
+    }
+    for (size_t i = 0; i < num_tuples; i++) {
+      memcpy(out + op, tuples + i * TUPLE_SIZE + KEY_SIZE, TUPLE_SIZE - KEY_SIZE);
+      op += TUPLE_SIZE - KEY_SIZE;
+    }
+    return op;
+  }
+
+  static bool decode_tuples(const uint8_t *in, size_t size, size_t num_tuples, char *tuples) {
+    uint8_t prev[KEY_SIZE] = {0};
+    size_t ip = 0;
+    for (size_t i = 0; i < num_tuples; i++) {
+      uint8_t *key = (uint8_t *) tuples + i * TUPLE_SIZE;
+      if (ip >= size || in[ip] > KEY_SIZE) {
+        return false;
+      }
+      size_t shared = in[ip++];
+      memcpy(key, prev, shared);
+      if (shared < KEY_SIZE) {
+        if (ip + KEY_SIZE - shared > size) {
+          return false;
+        }
+        key[shared] = prev[shared] + in[ip++];
+        memcpy(key + shared + 1, in + ip, KEY_SIZE - shared - 1);
+        ip += KEY_SIZE - shared - 1;
+      }
+      memcpy(prev, key, KEY_SIZE);
+    }
+    if (size - ip != num_tuples * (TUPLE_SIZE - KEY_SIZE)) {
+      return false;
+    }
+    for (size_t i = 0; i < num_tuples; i++) {
+      memcpy(tuples + i * TUPLE_SIZE + KEY_SIZE, in + ip, TUPLE_SIZE - KEY_SIZE);
+      ip += TUPLE_SIZE - KEY_SIZE;
+    }
+    return true;
+  }
+
+  /// LZ stage: sequences of (token, literal length, literals, 16 bit offset, match length) as in LZ4;
+  /// the token holds the literal length and match length - LZ_MIN_MATCH in 4 bits each, 15 meaning
+  /// that more length bytes follow. The last sequence only has literals.
+
+  static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+  }
+
+  static inline uint8_t *write_length(uint8_t *op, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+      *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+  }
+
+  // Returns false if the sequence doesn't fit before out_end
+  static bool write_sequence(uint8_t *&op, const uint8_t *out_end, const uint8_t *literals, size_t num_literals,
+                             size_t offset, size_t match_length) {
+    size_t worst = 1 + num_literals / 255 + 1 + num_literals + 2 + match_length / 255 + 1;
+    if (worst > (size_t) (out_end - op)) {
+      return false;
+    }
+    uint8_t *token = op++;
+    *token = (num_literals < 15 ? num_literals : 15) << 4;
+    if (num_literals >= 15) {
+      op = write_length(op, num_literals);
+    }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (match_length == 0) {
+      return true;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    size_t length = match_length - LZ_MIN_MATCH;
+    *token |= length < 15 ? length : 15;
+    if (length >= 15) {
+      op = write_length(op, length);
+    }
+    return true;
+  }
+
+  // Returns the compressed size, 0 if it would exceed capacity
+  static size_t lz_compress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity, uint32_t *table) {
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    uint8_t *op = out;
+    const uint8_t *out_end = out + capacity;
+    size_t limit = size > LZ_LAST_LITERALS ? size - LZ_LAST_LITERALS : 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+
+    for (size_t ip = 0; ip + LZ_MIN_MATCH <= limit;) {
+      uint32_t sequence = read32(in + ip);
+      uint32_t h = hash(sequence);
+      size_t candidate = table[h]; // Position + 1, 0 if empty
+      table[h] = ip + 1;
+      if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET || read32(in + candidate - 1) != sequence) {
+        // Skip faster through data that doesn't compress
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+      candidate--;
+      size_t length = LZ_MIN_MATCH;
+      while (ip + length < limit && in[candidate + length] == in[ip + length]) {
+        length++;
+      }
+      if (!write_sequence(op, out_end, in + anchor, ip - anchor, ip - candidate, length)) {
+        return 0;
+      }
+      ip += length;
+      anchor = ip;
+    }
+    if (!write_sequence(op, out_end, in + anchor, size - anchor, 0, 0)) {
+      return 0;
+    }
+    return op - out;
+  }
+
+  static inline bool read_length(const uint8_t *in, size_t size, size_t &ip, size_t &length) {
+    uint8_t byte;
+    do {
+      if (ip >= size) {
+        return false;
+      }
+      byte = in[ip++];
+      length += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  // Returns false on corrupt input or if the output doesn't fit in exactly `capacity` bytes
+  static bool lz_decompress(const uint8_t *in, size_t size, uint8_t *out, size_t capacity) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < size) {
+      uint8_t token = in[ip++];
+      size_t num_literals = token >> 4;
+      if (num_literals == 15 && !read_length(in, size, ip, num_literals)) {
+        return false;
+      }
+      if (num_literals > size - ip || num_literals > capacity - op) {
+        return false;
+      }
+      memcpy(out + op, in + ip, num_literals);
+      ip += num_literals;
+      op += num_literals;
+      if (ip == size) {
+        break;
+      }
+
+      if (size - ip < 2) {
+        return false;
+      }
+      size_t offset = in[ip] | (in[ip + 1] << 8);
+      ip += 2;
+      size_t length = token & 15;
+      if (length == 15 && !read_length(in, size, ip, length)) {
+        return false;
+      }
+      length += LZ_MIN_MATCH;
+      if (offset == 0 || offset > op || length > capacity - op) {
+        return false;
+      }
+      if (offset >= length) {
+        memcpy(out + op, out + op - offset, length);
+      } else {
+        for (size_t i = 0; i < length; i++) {
+          out[op + i] = out[op + i - offset];
+        }
+      }
+      op += length;
+    }
+    return op == capacity;
+  }
+
+  /// Blocks
+
+  size_t compress_block(const char *tuples, size_t size, char *out) {
+    telemetry::scoped_timer timer(telemetry::CODEC_NS);
+    static thread_local std::vector<uint8_t> encoded;
+    static thread_local std::vector<uint32_t> table(1 << LZ_HASH_BITS);
+
+    size_t num_tuples = size / TUPLE_SIZE;
+    encoded.resize(num_tuples * (TUPLE_SIZE + 1));
+    size_t encoded_size = encode_tuples(tuples, num_tuples, encoded.data());
+    // Only worth it if the block gets smaller than the tuples themselves
+    size_t compressed = lz_compress(encoded.data(), encoded_size, (uint8_t *) out + BLOCK_HEADER_SIZE, size,
+                                    table.data());
+
+    block_header_t header;
+    header.raw_size = size;
+    if (compressed > 0 && compressed < size) {
+      header.method = BLOCK_LZ;
+      header.stored_size = compressed;
+      header.encoded_size = encoded_size;
+    } else {
+      header.method = BLOCK_STORED;
+      header.stored_size = size;
+      header.encoded_size = 0;
+      memcpy(out + BLOCK_HEADER_SIZE, tuples, size);
+    }
+    memcpy(out, &header, sizeof(header));
+    return BLOCK_HEADER_SIZE + header.stored_size;
+  }
+
+  size_t decompress_block(const char *block, size_t block_size, char *out, size_t out_capacity) {
+    telemetry::scoped_timer timer(telemetry::CODEC_NS);
+    static thread_local std::vector<uint8_t> encoded;
+
+    block_header_t header;
+    if (block_size < BLOCK_HEADER_SIZE) {
+      return 0;
+    }
+    memcpy(&header, block, sizeof(header));
+    if (header.stored_size > block_size - BLOCK_HEADER_SIZE || header.raw_size > out_capacity ||
+        header.raw_size % TUPLE_SIZE != 0) {
+      return 0;
+    }
+    const char *data = block + BLOCK_HEADER_SIZE;
+
+    if (header.method == BLOCK_STORED) {
+      if (header.stored_size != header.raw_size) {
+        return 0;
+      }
+      memcpy(out, data, header.raw_size);
+      return header.raw_size;
+    }
+    if (header.method != BLOCK_LZ) {
+      return 0;
+    }
+    encoded.resize(header.encoded_size);
+    if (!lz_decompress((const uint8_t *) data, header.stored_size, encoded.data(), header.encoded_size) ||
+        !decode_tuples(encoded.data(), header.encoded_size, header.raw_size / TUPLE_SIZE, out)) {
+      return 0;
+    }
+    return header.raw_size;
+  }
+
+  /// Run files
+
+  bool write_run(int fd, const char *buffer, size_t size, const tuple_ref_t *refs, char *gather_staging,
+                 char *staging, size_t block_size, const size_t *cuts, size_t num_cuts, run_blocks_t &blocks) {
+    // A block holds whole tuples only; decompress_block would reject a partial one
+    if (size % TUPLE_SIZE != 0 || block_size % TUPLE_SIZE != 0 || block_size == 0) {
+      printf("[Error] run of %zu bytes is not split into whole tuples\n", size);
+      return false;
+    }
+    // Block boundaries: every block_size bytes, and at every cut
+    std::vector<size_t> bounds;
+    size_t cut = 0;
+    for (size_t head = 0; head < size;) {
+      bounds.push_back(head);
+      size_t tail = head + block_size < size ? head + block_size : size;
+      while (cut < num_cuts && cuts[cut] <= head) {
+        cut++;
+      }
+      if (cut < num_cuts && cuts[cut] < tail) {
+        tail = cuts[cut];
+      }
+      head = tail;
+    }
+    bounds.push_back(size);
+
+    blocks.num_blocks = bounds.size() - 1;
+    blocks.raw_offsets = (size_t *) malloc(sizeof(size_t) * bounds.size());
+    blocks.file_offsets = (size_t *) malloc(sizeof(size_t) * bounds.size());
+    if (blocks.raw_offsets == NULL || blocks.file_offsets == NULL) {
+      return false;
+    }
+
+    // Batches of consecutive blocks whose compressed bounds (and gathered tuples) fit the staging buffers
+    size_t file_offset = 0;
+    std::vector<size_t> slots;
+    std::vector<size_t> sizes;
+    for (size_t first = 0, last = 0; first < blocks.num_blocks; first = last) {
+      slots.clear();
+      size_t bound = 0;
+      for (last = first; last < blocks.num_blocks; last++) {
+        size_t length = bounds[last + 1] - bounds[last];
+        if (last > first && (bound + block_bound(length) > COMPRESS_BUFFER_SIZE ||
+                             (refs != NULL && bounds[last + 1] - bounds[first] > GATHER_BUFFER_SIZE))) {
+          break;
+        }
+        slots.push_back(bound);
+        bound += block_bound(length);
+      }
+
+      const char *src = buffer + bounds[first];
+      if (refs != NULL) {
+        radix_sort::gather((const tuple_t *) buffer, refs + bounds[first] / TUPLE_SIZE,
+                           (bounds[last] - bounds[first]) / TUPLE_SIZE, (tuple_t *) gather_staging);
+        src = gather_staging;
+      }
+
+      size_t num_blocks = last - first;
+      sizes.resize(num_blocks);
+      #pragma omp parallel for schedule(dynamic, 1)
+      for (size_t i = 0; i < num_blocks; i++) {
+        sizes[i] = compress_block(src + bounds[first + i] - bounds[first], bounds[first + i + 1] - bounds[first + i],
+                                  staging + slots[i]);
+      }
+
+      // Pack the blocks and write them at once
+      size_t packed = 0;
+      for (size_t i = 0; i < num_blocks; i++) {
+        memmove(staging + packed, staging + slots[i], sizes[i]);
+        blocks.raw_offsets[first + i] = bounds[first + i];
+        blocks.file_offsets[first + i] = file_offset + packed;
+        packed += sizes[i];
+      }
+      if (!io::write_fully(fd, staging, packed, file_offset)) {
+        return false;
+      }
+      file_offset += packed;
+    }
+    blocks.raw_offsets[blocks.num_blocks] = size;
+    blocks.file_offsets[blocks.num_blocks] = file_offset;
+    return true;
+  }
+
+  void release(run_blocks_t &blocks) {
+    free(blocks.raw_offsets);
+    free(blocks.file_offsets);
+    blocks.raw_offsets = blocks.file_offsets = NULL;
+    blocks.num_blocks = 0;
+  }
+
+  /// Block reader
+
+  block_reader::block_reader(size_t num_threads) : requests(num_threads > 0 ? num_threads : 1) {
+    for (size_t i = 0; i < num_threads; i++) {
+      threads.push_back(std::thread(&block_reader::work, this));
+    }
+  }
+
+  block_reader::~block_reader() {
+    requests.close();
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+  }
+
+  void block_reader::read(block_request_t &request, int fd, const run_blocks_t &blocks, size_t first, size_t last,
+                          char *staging, char *out) {
+    request.fd = fd;
+    request.blocks = &blocks;
+    request.first = first;
+    request.last = last;
+    request.staging = staging;
+    request.out = out;
+    request.decoded = 0;
+    request.complete = false;
+    requests.push(&request);
+  }
+
+  size_t block_reader::wait(block_request_t &request) {
+    telemetry::scoped_timer timer(telemetry::IO_NS);
+    std::unique_lock<std::mutex> lock(mutex);
+    completed.wait(lock, [&request] { return request.complete; });
+    return request.decoded;
+  }
+
+  void block_reader::work() {
+    telemetry::name_thread("decoder");
+    block_request_t *request;
+    while (requests.pop(request)) {
+      const run_blocks_t &blocks = *request->blocks;
+      size_t base = blocks.file_offsets[request->first];
+      size_t amount = blocks.file_offsets[request->last] - base;
+      size_t decoded = 0;
+      if (io::read_fully(request->fd, request->staging, amount, base) == amount) {
+        for (size_t b = request->first; b < request->last; b++) {
+          size_t length = blocks.raw_offsets[b + 1] - blocks.raw_offsets[b];
+          if (decompress_block(request->staging + blocks.file_offsets[b] - base,
+                               blocks.file_offsets[b + 1] - blocks.file_offsets[b],
+                               request->out + decoded, length) != length) {
+            break;
+          }
+          decoded += length;
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      request->decoded = decoded;
+      request->complete = true;
+      completed.notify_all();
+    }
+  }
+
+}
@@ -0,0 +1,79 @@
+#ifndef MULTICORE_EXTERNAL_SORT_RUN_CODEC_H
+#define MULTICORE_EXTERNAL_SORT_RUN_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "global.h"
+#include "bounded_queue.h"
+
+#define RUN_BLOCK_SIZE (1024000)         // Most tuple bytes per compressed block
+#define COMPRESS_BUFFER_SIZE (16384000)  // Phase1 staging for the compressed blocks of a run
+#define BLOCK_HEADER_SIZE (16)
+
+#define BLOCK_STORED (0)  // Tuples as they are
+#define BLOCK_LZ (1)      // Front coded keys and payloads, LZ compressed
+
+// Compressed run files: a sequence of blocks of whole sorted tuples, each with a header and either
+// stored as is or transformed and compressed. The transform front codes each key against the previous
+// one (shared prefix length, delta of the first differing byte, rest of the key) and puts all payloads
+// after the keys; the LZ stage is a self-contained LZ4-style byte coder with a 64 KB window.
+// The block index of every run (run_blocks_t) is kept in memory, so blocks can be read without a scan.
+namespace codec {
+  // Upper bound of a compressed block of `size` bytes of tuples
+  static inline size_t block_bound(size_t size) {
+    return size + BLOCK_HEADER_SIZE;
+  }
+
+  // Compress `size` bytes of sorted tuples into out (block_bound(size) bytes). Returns the block's size.
+  size_t compress_block(const char *tuples, size_t size, char *out);
+  // Returns the number of tuple bytes written to out, 0 if the block is corrupt or doesn't fit.
+  size_t decompress_block(const char *block, size_t block_size, char *out, size_t out_capacity);
+
+  // Write a sorted run (through refs into gather_staging when given) as compressed blocks of at most
+  // block_size bytes, starting a new block at each of the num_cuts byte offsets in cuts. Blocks are
+  // compressed in parallel, COMPRESS_BUFFER_SIZE bytes of staging at a time. Fills in `blocks`. size and
+  // block_size must be whole tuples.
+  bool write_run(int fd, const char *buffer, size_t size, const tuple_ref_t *refs, char *gather_staging,
+                 char *staging, size_t block_size, const size_t *cuts, size_t num_cuts, run_blocks_t &blocks);
+  void release(run_blocks_t &blocks);
+
+  // Read and decompression of blocks [first, last) of a run, in flight.
+  typedef struct block_request {
+    int fd;
+    const run_blocks_t *blocks;
+    size_t first;
+    size_t last;
+    char *staging;  // Compressed bytes, file_offsets[last] - file_offsets[first]
+    char *out;      // Tuples, raw_offsets[last] - raw_offsets[first]
+    size_t decoded;
+    bool complete;
+  } block_request_t;
+
+  // Threads that read and decompress blocks ahead of a merge, one request at a time each.
+  class block_reader {
+  public:
+    explicit block_reader(size_t num_threads);
+    ~block_reader();
+    block_reader(const block_reader &) = delete;
+    block_reader &operator=(const block_reader &) = delete;
+
+    void read(block_request_t &request, int fd, const run_blocks_t &blocks, size_t first, size_t last,
+              char *staging, char *out);
+    // Returns the number of tuple bytes decoded, less than requested on error
+    size_t wait(block_request_t &request);
+
+  private:
+    bounded_queue<block_request_t *> requests;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable completed;
+
+    void work();
+  };
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_RUN_CODEC_H
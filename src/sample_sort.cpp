@@ -0,0 +1,59 @@
+#include "sample_sort.h"
+#include "io_backend.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace sample_sort {
+
+  bool choose_splitters(int fd, size_t file_size, size_t num_ranges, tuple_key_t *thresholds) {
+    size_t num_tuples = file_size / TUPLE_SIZE;
+    size_t sample_size = std::min(num_tuples, num_ranges * SAMPLE_OVERSAMPLING);
+    if (num_ranges < 2 || sample_size == 0) {
+      return true;
+    }
+
+    // One key from a random position in each of sample_size equal strides of the file
+    std::vector<tuple_key_t> sample(sample_size);
+    std::minstd_rand generator(SAMPLE_SEED);
+    size_t stride = num_tuples / sample_size;
+    for (size_t i = 0; i < sample_size; i++) {
+      size_t tuple_id = i * stride + generator() % stride;
+      if (io::read_fully(fd, (char *) &sample[i], KEY_SIZE, tuple_id * TUPLE_SIZE) != KEY_SIZE) {
+        return false;
+      }
+    }
+    std::sort(sample.begin(), sample.end());
+
+    for (size_t i = 1; i < num_ranges; i++) {
+      thresholds[i - 1] = sample[i * sample_size / num_ranges];
+    }
+    return true;
+  }
+
+  static const char *key_at(const char *buffer, const tuple_ref_t *refs, size_t tuple_id) {
+    return refs != NULL ? refs[tuple_id].key : buffer + tuple_id * TUPLE_SIZE;
+  }
+
+  void segment(const char *buffer, const tuple_ref_t *refs, size_t size,
+               const tuple_key_t *thresholds, size_t num_ranges, size_t *bounds) {
+    size_t num_tuples = size / TUPLE_SIZE;
+    bounds[0] = 0;
+    for (size_t i = 1; i < num_ranges; i++) {
+      // First tuple whose key is not below thresholds[i - 1]
+      size_t lo = bounds[i - 1] / TUPLE_SIZE, hi = num_tuples;
+      while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tuple_layout_t::compare(key_at(buffer, refs, mid), thresholds[i - 1].key) < 0) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      bounds[i] = lo * TUPLE_SIZE;
+    }
+    bounds[num_ranges] = num_tuples * TUPLE_SIZE;
+  }
+
+}
@@ -0,0 +1,19 @@
+#ifndef MULTICORE_EXTERNAL_SORT_SAMPLE_SORT_H
+#define MULTICORE_EXTERNAL_SORT_SAMPLE_SORT_H
+
+#include <cstddef>
+#include "global.h"
+
+namespace sample_sort {
+  // Pick num_ranges - 1 splitters from a random sample of the keys of fd.
+  // Key range i holds the keys k with thresholds[i - 1] <= k < thresholds[i].
+  // Returns false if the sample couldn't be read.
+  bool choose_splitters(int fd, size_t file_size, size_t num_ranges, tuple_key_t *thresholds);
+
+  // Byte offsets of the key range boundaries of a sorted buffer: range i is [bounds[i], bounds[i + 1]).
+  // bounds must hold num_ranges + 1 entries. With refs, the buffer is ordered by refs (indirect sort).
+  void segment(const char *buffer, const tuple_ref_t *refs, size_t size,
+               const tuple_key_t *thresholds, size_t num_ranges, size_t *bounds);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_SAMPLE_SORT_H
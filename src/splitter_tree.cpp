@@ -0,0 +1,106 @@
+#include "splitter_tree.h"
+
+#include <vector>
+
+namespace counting_sort {
+
+  static const normalized_key_t KEY_INFINITY = ~(normalized_key_t) 0; // Above every 10-byte key
+
+  // In-order fill of the implicit tree rooted at node from the sorted splitters
+  static void fill(normalized_key_t *tree, size_t num_leaves, size_t node,
+                   const std::vector<normalized_key_t> &sorted, size_t &idx) {
+    if (node >= num_leaves) {
+      return;
+    }
+    fill(tree, num_leaves, node << 1, sorted, idx);
+    tree[node] = idx < sorted.size() ? sorted[idx] : KEY_INFINITY;
+    idx++;
+    fill(tree, num_leaves, (node << 1) | 1, sorted, idx);
+  }
+
+  splitter_tree::splitter_tree(const tuple_key_t *thresholds, size_t num_thresholds) {
+    std::vector<normalized_key_t> splitters;
+    std::vector<size_t> first, last;
+    for (size_t i = 0; i < num_thresholds; i++) {
+      normalized_key_t key = normalize_key(&thresholds[i]);
+      if (!splitters.empty() && splitters.back() == key) {
+        last.back() = i;
+        continue;
+      }
+      splitters.push_back(key);
+      first.push_back(i);
+      last.push_back(i);
+    }
+
+    num_levels = 0;
+    while (((size_t) 1 << num_levels) < splitters.size() + 1) {
+      num_levels++;
+    }
+    num_leaves = (size_t) 1 << num_levels;
+    tree = new normalized_key_t[num_leaves];
+    tree[0] = KEY_INFINITY;
+    size_t idx = 0;
+    fill(tree, num_leaves, 1, splitters, idx);
+
+    lower = new normalized_key_t[splitters.size() + 1];
+    bucket_above = new size_t[splitters.size() + 1];
+    bucket_equal = new size_t[splitters.size() + 1];
+    lower[0] = KEY_INFINITY;
+    bucket_above[0] = bucket_equal[0] = 0;
+    for (size_t c = 1; c <= splitters.size(); c++) {
+      lower[c] = splitters[c - 1];
+      bucket_above[c] = last[c - 1] + 1;
+      bucket_equal[c] = first[c - 1] != last[c - 1] ? first[c - 1] + 1 : last[c - 1] + 1;
+    }
+  }
+
+  splitter_tree::~splitter_tree() {
+    delete[] tree;
+    delete[] lower;
+    delete[] bucket_above;
+    delete[] bucket_equal;
+  }
+
+  // Number of distinct splitters not above key
+  size_t splitter_tree::descend(normalized_key_t key) const {
+    size_t node = 1;
+    for (size_t level = 0; level < num_levels; level++) {
+      node = (node << 1) | (size_t) (key >= tree[node]);
+    }
+    return node - num_leaves;
+  }
+
+  size_t splitter_tree::leaf_bucket(normalized_key_t key, size_t leaf) const {
+    return key == lower[leaf] ? bucket_equal[leaf] : bucket_above[leaf];
+  }
+
+  size_t splitter_tree::bucket(const tuple_t &data) const {
+    normalized_key_t key = normalize_key(data.data);
+    return leaf_bucket(key, descend(key));
+  }
+
+  void splitter_tree::bucket(const tuple_t *data, size_t count, size_t *buckets) const {
+    const size_t group = 8;
+    size_t i = 0;
+    for (; i + group <= count; i += group) {
+      normalized_key_t keys[group];
+      size_t nodes[group];
+      for (size_t j = 0; j < group; j++) {
+        keys[j] = normalize_key(data[i + j].data);
+        nodes[j] = 1;
+      }
+      for (size_t level = 0; level < num_levels; level++) {
+        for (size_t j = 0; j < group; j++) {
+          nodes[j] = (nodes[j] << 1) | (size_t) (keys[j] >= tree[nodes[j]]);
+        }
+      }
+      for (size_t j = 0; j < group; j++) {
+        buckets[i + j] = leaf_bucket(keys[j], nodes[j] - num_leaves);
+      }
+    }
+    for (; i < count; i++) {
+      buckets[i] = bucket(data[i]);
+    }
+  }
+
+}
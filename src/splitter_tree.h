@@ -0,0 +1,39 @@
+#ifndef MULTICORE_EXTERNAL_SORT_SPLITTER_TREE_H
+#define MULTICORE_EXTERNAL_SORT_SPLITTER_TREE_H
+
+#include <cstddef>
+#include "global.h"
+
+namespace counting_sort {
+  // Bucket classifier over a sorted thresholds array, as in super scalar sample sort.
+  // Bucket i holds the keys below thresholds[i] and not below thresholds[i - 1].
+  // The distinct splitters are stored as normalized keys in an implicit (Eytzinger) search tree,
+  // descended without branches: node = 2 * node + (key >= tree[node]).
+  // A splitter that repeats in thresholds marks a heavily duplicated key; the keys equal to it go to
+  // the bucket right after its first occurrence, which would otherwise stay empty, so they are
+  // separated from their neighbours.
+  class splitter_tree {
+  public:
+    splitter_tree(const tuple_key_t *thresholds, size_t num_thresholds);
+    ~splitter_tree();
+    splitter_tree(const splitter_tree &) = delete;
+    splitter_tree &operator=(const splitter_tree &) = delete;
+
+    size_t bucket(const tuple_t &data) const;
+    // Classify count records at once, interleaving their descents to hide the load latency.
+    void bucket(const tuple_t *data, size_t count, size_t *buckets) const;
+
+  private:
+    size_t num_levels;
+    size_t num_leaves;        // 1 << num_levels
+    normalized_key_t *tree;   // tree[1..num_leaves), padded with keys above any real one
+    normalized_key_t *lower;  // lower[c]: largest distinct splitter not above a key that descends to leaf c
+    size_t *bucket_above;     // Bucket of the keys above lower[c]
+    size_t *bucket_equal;     // Bucket of the keys equal to lower[c]
+
+    size_t descend(normalized_key_t key) const;
+    size_t leaf_bucket(normalized_key_t key, size_t leaf) const;
+  };
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_SPLITTER_TREE_H
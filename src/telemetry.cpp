@@ -0,0 +1,232 @@
+#include "telemetry.h"
+#include "global.h"
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <time.h>
+
+namespace telemetry {
+
+  bool active = false;
+
+  static const char *phase_names[NUM_PHASES] = {"startup", "phase_small_file", "phase1", "phase2", "finish"};
+  static const char *counter_names[NUM_COUNTERS] = {
+      "bytes_read", "bytes_written", "io_ms", "sort_ms", "merge_ms", "codec_ms",
+      "radix_partitions", "buckets_touched", "radix_depth", "merge_refills"};
+
+  static inline bool is_time(int id) {
+    return id == IO_NS || id == SORT_NS || id == MERGE_NS || id == CODEC_NS;
+  }
+
+  // One per thread, on cache lines of its own
+  typedef struct alignas(CACHE_LINE_SIZE) slot {
+    std::atomic<uint64_t> counters[NUM_PHASES][NUM_COUNTERS];
+    const char *name;
+  } slot_t;
+
+  static slot_t slots[TELEMETRY_MAX_THREADS];
+  static std::atomic<size_t> num_slots(0);
+  static std::atomic<int> current_phase(STARTUP);
+  static uint64_t phase_ns[NUM_PHASES];
+  static uint64_t phase_start;
+
+  typedef struct merge_record {
+    int phase;
+    std::vector<size_t> refills;
+  } merge_record_t;
+
+  static std::mutex merges_mutex;
+  static std::vector<merge_record_t> merges;
+
+  // Timer state of the calling thread: the counter being charged, -1 for none, and since when
+  static thread_local int timer_counter = -1;
+  static thread_local uint64_t timer_since = 0;
+  static thread_local slot_t *thread_slot = NULL;
+
+  static uint64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  static slot_t &own_slot() {
+    if (thread_slot == NULL) {
+      size_t index = num_slots.fetch_add(1);
+      thread_slot = &slots[index < TELEMETRY_MAX_THREADS ? index : TELEMETRY_MAX_THREADS - 1];
+    }
+    return *thread_slot;
+  }
+
+  void enable() {
+    for (size_t i = 0; i < TELEMETRY_MAX_THREADS; i++) {
+      for (size_t p = 0; p < NUM_PHASES; p++) {
+        for (size_t c = 0; c < NUM_COUNTERS; c++) {
+          slots[i].counters[p][c].store(0);
+        }
+      }
+      slots[i].name = NULL;
+    }
+    phase_start = now();
+    active = true;
+  }
+
+  void begin_phase(int id) {
+    if (!enabled()) {
+      return;
+    }
+    uint64_t t = now();
+    phase_ns[current_phase.load()] += t - phase_start;
+    phase_start = t;
+    current_phase.store(id);
+  }
+
+  void name_thread(const char *name) {
+    if (enabled()) {
+      own_slot().name = name;
+    }
+  }
+
+  void record(int id, uint64_t value) {
+    own_slot().counters[current_phase.load(std::memory_order_relaxed)][id].fetch_add(value,
+                                                                                     std::memory_order_relaxed);
+  }
+
+  void record_maximum(int id, uint64_t value) {
+    std::atomic<uint64_t> &counter = own_slot().counters[current_phase.load(std::memory_order_relaxed)][id];
+    uint64_t seen = counter.load(std::memory_order_relaxed);
+    while (seen < value && !counter.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  void record_refills(const size_t *refills, size_t num_runs) {
+    if (!enabled()) {
+      return;
+    }
+    merge_record_t merge;
+    merge.phase = current_phase.load();
+    merge.refills.assign(refills, refills + num_runs);
+    std::lock_guard<std::mutex> lock(merges_mutex);
+    merges.push_back(merge);
+  }
+
+  void scoped_timer::start(int id) {
+    uint64_t t = now();
+    if (timer_counter != -1) {
+      record(timer_counter, t - timer_since);
+    }
+    previous = timer_counter;
+    timer_counter = id;
+    timer_since = t;
+  }
+
+  void scoped_timer::stop() {
+    uint64_t t = now();
+    record(timer_counter, t - timer_since);
+    timer_counter = previous;
+    timer_since = t;
+  }
+
+  static double value_of(const slot_t &s, size_t p, size_t c) {
+    uint64_t value = s.counters[p][c].load();
+    return is_time(c) ? value / 1e6 : value;
+  }
+
+  static bool idle(const slot_t &s, size_t p) {
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+      if (s.counters[p][c].load() != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void write_csv(FILE *out, size_t used) {
+    fprintf(out, "record,phase,phase_ms,id,name");
+    for (size_t c = 0; c < NUM_COUNTERS; c++) {
+      fprintf(out, ",%s", counter_names[c]);
+    }
+    fprintf(out, "\n");
+    for (size_t p = 0; p < NUM_PHASES; p++) {
+      for (size_t t = 0; t < used; t++) {
+        if (idle(slots[t], p)) {
+          continue;
+        }
+        fprintf(out, "thread,%s,%.3f,%zu,%s", phase_names[p], phase_ns[p] / 1e6, t,
+                slots[t].name != NULL ? slots[t].name : "worker");
+        for (size_t c = 0; c < NUM_COUNTERS; c++) {
+          fprintf(out, is_time(c) ? ",%.3f" : ",%.0f", value_of(slots[t], p, c));
+        }
+        fprintf(out, "\n");
+      }
+    }
+    // One row per run of every merge, with only the refill count filled in
+    for (size_t m = 0; m < merges.size(); m++) {
+      for (size_t r = 0; r < merges[m].refills.size(); r++) {
+        int p = merges[m].phase;
+        fprintf(out, "run,%s,%.3f,%zu,merge %zu run %zu", phase_names[p], phase_ns[p] / 1e6, r, m, r);
+        for (size_t c = 0; c < NUM_COUNTERS; c++) {
+          if (c == MERGE_REFILLS) {
+            fprintf(out, ",%zu", merges[m].refills[r]);
+          } else {
+            fprintf(out, ",");
+          }
+        }
+        fprintf(out, "\n");
+      }
+    }
+  }
+
+  static void write_json(FILE *out, size_t used) {
+    fprintf(out, "{\n  \"phases\": [");
+    for (size_t p = 0; p < NUM_PHASES; p++) {
+      fprintf(out, "%s\n    {\"name\": \"%s\", \"milliseconds\": %.3f, \"threads\": [", p > 0 ? "," : "",
+              phase_names[p], phase_ns[p] / 1e6);
+      bool first = true;
+      for (size_t t = 0; t < used; t++) {
+        if (idle(slots[t], p)) {
+          continue;
+        }
+        fprintf(out, "%s\n      {\"id\": %zu, \"name\": \"%s\"", first ? "" : ",", t,
+                slots[t].name != NULL ? slots[t].name : "worker");
+        for (size_t c = 0; c < NUM_COUNTERS; c++) {
+          fprintf(out, is_time(c) ? ", \"%s\": %.3f" : ", \"%s\": %.0f", counter_names[c], value_of(slots[t], p, c));
+        }
+        fprintf(out, "}");
+        first = false;
+      }
+      fprintf(out, "%s]}", first ? "" : "\n    ");
+    }
+    fprintf(out, "\n  ],\n  \"merges\": [");
+    for (size_t m = 0; m < merges.size(); m++) {
+      fprintf(out, "%s\n    {\"phase\": \"%s\", \"refills\": [", m > 0 ? "," : "", phase_names[merges[m].phase]);
+      for (size_t r = 0; r < merges[m].refills.size(); r++) {
+        fprintf(out, "%s%zu", r > 0 ? ", " : "", merges[m].refills[r]);
+      }
+      fprintf(out, "]}");
+    }
+    fprintf(out, "%s]\n}\n", merges.empty() ? "" : "\n  ");
+  }
+
+  bool write(const char *filename) {
+    if (!enabled()) {
+      return true;
+    }
+    begin_phase(current_phase.load()); // Close the last phase
+    FILE *out = fopen(filename, "w");
+    if (out == NULL) {
+      return false;
+    }
+    size_t used = num_slots.load() < TELEMETRY_MAX_THREADS ? num_slots.load() : TELEMETRY_MAX_THREADS;
+    size_t length = strlen(filename);
+    if (length >= 4 && strcmp(filename + length - 4, ".csv") == 0) {
+      write_csv(out, used);
+    } else {
+      write_json(out, used);
+    }
+    return fclose(out) == 0;
+  }
+
+}
@@ -0,0 +1,95 @@
+#ifndef MULTICORE_EXTERNAL_SORT_TELEMETRY_H
+#define MULTICORE_EXTERNAL_SORT_TELEMETRY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define TELEMETRY_MAX_THREADS (256)  // Threads beyond this share the last slot
+
+// Counters per phase and per thread, written out as JSON or CSV at exit (-T).
+// Until enable() is called every hook is a single predictable branch on `active`.
+namespace telemetry {
+  enum phase {
+    STARTUP,     // Planning, allocation, splitter sampling
+    SMALL_FILE,  // phase_small_file
+    PHASE1,
+    PHASE2,
+    FINISH,      // Sync and validation
+    NUM_PHASES
+  };
+
+  enum counter {
+    BYTES_READ,
+    BYTES_WRITTEN,
+    IO_NS,             // Blocked on reads, writes and async completions
+    SORT_NS,
+    MERGE_NS,          // Merging, without the I/O waits
+    CODEC_NS,          // Compressing and decompressing run blocks
+    RADIX_PARTITIONS,  // Radix sort levels visited, one per partitioned bucket
+    BUCKETS_TOUCHED,   // Non-empty buckets of those partitions
+    RADIX_DEPTH,       // Deepest key byte partitioned on (maximum, not a sum)
+    MERGE_REFILLS,     // Run chunks consumed by the merge
+    NUM_COUNTERS
+  };
+
+  extern bool active;
+
+  static inline bool enabled() {
+    return __builtin_expect(active, false);
+  }
+
+  void enable();
+  // Ends the current phase; counters are charged to `id` from now on
+  void begin_phase(int id);
+  // Label of the calling thread in the report
+  void name_thread(const char *name);
+
+  void record(int id, uint64_t value);
+  void record_maximum(int id, uint64_t value);
+  // Chunks each of the runs of one merge took
+  void record_refills(const size_t *refills, size_t num_runs);
+
+  static inline void add(int id, uint64_t value) {
+    if (enabled()) {
+      record(id, value);
+    }
+  }
+
+  static inline void maximum(int id, uint64_t value) {
+    if (enabled()) {
+      record_maximum(id, value);
+    }
+  }
+
+  // Writes every phase and thread to filename: CSV if it ends in .csv, JSON otherwise
+  bool write(const char *filename);
+
+  // Charges the time it is in scope to a *_NS counter of the calling thread. A nested timer pauses
+  // the enclosing one, so e.g. merge time excludes the I/O waits inside the merge.
+  class scoped_timer {
+  public:
+    explicit scoped_timer(int id) : on(enabled()), previous(-1) {
+      if (on) {
+        start(id);
+      }
+    }
+
+    ~scoped_timer() {
+      if (on) {
+        stop();
+      }
+    }
+
+    scoped_timer(const scoped_timer &) = delete;
+    scoped_timer &operator=(const scoped_timer &) = delete;
+
+  private:
+    bool on;
+    int previous;
+
+    void start(int id);
+    void stop();
+  };
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_TELEMETRY_H
@@ -0,0 +1,173 @@
+#include "top_k.h"
+#include "io_backend.h"
+#include "validator.h"
+#include "telemetry.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <omp.h>
+
+namespace top_k {
+
+  // A record kept: its normalized key and where it is kept
+  typedef struct entry {
+    normalized_key_t key;
+    uint32_t slot;
+  } entry_t;
+
+  // The records kept first, then their heap, then the input chunk; chunk_size is 0 if they don't fit
+  typedef struct region {
+    size_t heap_offset;
+    size_t chunk_offset;
+    size_t chunk_size;
+  } region_t;
+
+  static region_t place(const param_t &param) {
+    size_t record_size = param.engine->record_size;
+    size_t budget = param.memory_budget / IO_UNIT * IO_UNIT;
+    region_t region = {0, 0, 0};
+    if (param.top_k == 0 || param.top_k > UINT32_MAX || param.top_k > budget / (record_size + sizeof(entry_t))) {
+      return region;
+    }
+    region.heap_offset = align_up(param.top_k * record_size, alignof(entry_t));
+    region.chunk_offset = align_up(region.heap_offset + param.top_k * sizeof(entry_t), IO_BLOCK_SIZE);
+    if (region.chunk_offset + IO_UNIT <= budget) {
+      region.chunk_size = (budget - region.chunk_offset) / IO_UNIT * IO_UNIT;
+      region.chunk_size = region.chunk_size < TOP_K_IO_SIZE ? region.chunk_size : TOP_K_IO_SIZE;
+    }
+    return region;
+  }
+
+  class selection {
+  public:
+    selection(const layout_engine_t *engine, const char *slots) : engine(engine), slots(slots) {}
+
+    // Larger key first, so that the top of the heap is the largest record kept
+    bool after(const entry_t &a, const entry_t &b) const {
+      if (a.key != b.key) {
+        return a.key > b.key;
+      }
+      return engine->key_length > 16 &&
+             engine->compare(slots + a.slot * engine->record_size, slots + b.slot * engine->record_size) > 0;
+    }
+
+    // Whether record, whose normalized key is key, orders before the record kept by e
+    bool below(const char *record, normalized_key_t key, const entry_t &e) const {
+      if (key != e.key) {
+        return key < e.key;
+      }
+      return engine->key_length > 16 && engine->compare(record, slots + e.slot * engine->record_size) < 0;
+    }
+
+    void sift_down(entry_t *heap, size_t size, size_t node) const {
+      entry_t e = heap[node];
+      for (size_t child = 2 * node + 1; child < size; child = 2 * node + 1) {
+        if (child + 1 < size && after(heap[child + 1], heap[child])) {
+          child++;
+        }
+        if (!after(heap[child], e)) {
+          break;
+        }
+        heap[node] = heap[child];
+        node = child;
+      }
+      heap[node] = e;
+    }
+
+  private:
+    const layout_engine_t *engine;
+    const char *slots;
+  };
+
+  bool fits(const param_t &param) {
+    return place(param).chunk_size > 0;
+  }
+
+  bool select(param_t &param, size_t &num_selected, size_t &input_size) {
+    telemetry::scoped_timer timer(telemetry::SORT_NS);
+    const layout_engine_t *engine = param.engine;
+    size_t record_size = engine->record_size;
+    size_t k = param.top_k;
+    region_t region = place(param);
+    num_selected = input_size = 0;
+    if (region.chunk_size == 0) {
+      printf("[Error] memory budget too small for the top %zu records\n", k);
+      return false;
+    }
+    char *slots = param.buffer;
+    entry_t *heap = (entry_t *) (param.buffer + region.heap_offset);
+    char *chunk = param.buffer + region.chunk_offset;
+    selection order(engine, slots);
+    std::vector<std::vector<size_t>> candidates(param.num_threads);
+
+    size_t size = 0, offset = 0;
+    bool ok = true, end = false;
+    while (!end) {
+      size_t amount = region.chunk_size;
+      if (!param.streaming) {
+        amount = param.file_size - offset < amount ? param.file_size - offset : amount;
+      }
+      size_t ret = amount > 0 ? io::read_fully(param.input_fd, chunk, amount, offset) : 0;
+      end = ret < region.chunk_size || (!param.streaming && offset + ret == param.file_size);
+      if (!param.streaming && ret < amount) {
+        printf("[Error] failed to read input at %zu\n", offset + ret);
+        ok = false;
+      }
+      if (ret % record_size != 0) {
+        printf("[Error] input ends with a partial record of %zu bytes, dropped\n", ret % record_size);
+      }
+      offset += ret;
+      size_t num_records = ret / record_size;
+      input_size += num_records * record_size;
+      validate::add(param.input_sum, chunk, num_records * record_size, record_size, param.num_threads);
+
+      // The first k records fill the heap
+      size_t first = 0;
+      for (; size < k && first < num_records; first++, size++) {
+        memcpy(slots + size * record_size, chunk + first * record_size, record_size);
+        heap[size].key = engine->normalize(chunk + first * record_size);
+        heap[size].slot = (uint32_t) size;
+        if (size + 1 == k) {
+          for (size_t node = k / 2; node-- > 0;) {
+            order.sift_down(heap, k, node);
+          }
+        }
+      }
+      if (first == num_records) {
+        continue;
+      }
+
+      // The rest only if they don't order after the top as the chunk came in, then one by one
+      normalized_key_t threshold = heap[0].key;
+      #pragma omp parallel num_threads(param.num_threads)
+      {
+        std::vector<size_t> &mine = candidates[omp_get_thread_num()];
+        mine.clear();
+        #pragma omp for schedule(static)
+        for (size_t r = first; r < num_records; r++) {
+          if (engine->normalize(chunk + r * record_size) <= threshold) {
+            mine.push_back(r);
+          }
+        }
+      }
+      for (const std::vector<size_t> &mine : candidates) {
+        for (size_t r : mine) {
+          const char *record = chunk + r * record_size;
+          normalized_key_t key = engine->normalize(record);
+          if (order.below(record, key, heap[0])) {
+            memcpy(slots + heap[0].slot * record_size, record, record_size);
+            heap[0].key = key;
+            order.sift_down(heap, k, 0);
+          }
+        }
+      }
+    }
+
+    num_selected = size;
+    engine->sort(slots, size * record_size);
+    return ok;
+  }
+
+}
@@ -0,0 +1,24 @@
+#ifndef MULTICORE_EXTERNAL_SORT_TOP_K_H
+#define MULTICORE_EXTERNAL_SORT_TOP_K_H
+
+#include <cstddef>
+#include "global.h"
+#include "layout_engine.h"
+
+#define TOP_K_IO_SIZE (4096000)  // Input chunk of the top-K selection
+
+// Top-K (-k): only the K smallest records are output. If they fit the memory budget, a max-heap of the K
+// smallest records so far is kept during the one pass over the input, and every record read is checked
+// against its top; the checks of a chunk run on all threads against the top as the chunk came in, so that
+// once the heap settles hardly any record reaches it. Nothing goes through runs or a merge.
+namespace top_k {
+  // Whether param.top_k records, their heap and an input chunk fit the memory budget
+  bool fits(const param_t &param);
+
+  // Reads param.input_fd to its end and keeps the param.top_k smallest records, which are left sorted at
+  // the start of param.buffer, num_selected of them (fewer if the input has fewer). Adds the records read
+  // to param.input_sum. Returns false on a read error.
+  bool select(param_t &param, size_t &num_selected, size_t &input_size);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_TOP_K_H
@@ -0,0 +1,159 @@
+#include "validator.h"
+#include "async_io.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <omp.h>
+
+namespace validate {
+
+  // CRC-32 of zlib (reflected polynomial 0xedb88320), as valsort takes it, eight bytes at a time
+  // (slicing-by-8): table[k][b] is the CRC of byte b followed by k zero bytes.
+  static uint32_t table[8][256];
+
+  static bool build_table() {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+      }
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++) {
+        table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+    return true;
+  }
+
+  static const bool table_built = build_table();
+
+  static uint32_t crc32(const char *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+    uint32_t crc = 0xffffffff;
+    for (; size >= 8; p += 8, size -= 8) {
+      uint32_t low, high;
+      memcpy(&low, p, sizeof(low));
+      memcpy(&high, p + 4, sizeof(high));
+      low ^= crc;
+      crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^
+            table[4][low >> 24] ^ table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^
+            table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+    }
+    for (; size > 0; p++, size--) {
+      crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+    }
+    return crc ^ 0xffffffff;
+  }
+
+  void add(record_sum_t &sum, const record_sum_t &other) {
+    sum.records += other.records;
+    sum.low += other.low;
+    sum.high += other.high + (sum.low < other.low);
+  }
+
+  void add(record_sum_t &sum, const char *buffer, size_t size, size_t record_size, size_t num_threads) {
+    size_t num_records = size / record_size;
+    #pragma omp parallel num_threads(num_threads) shared(sum, buffer, num_records, record_size) default(none)
+    {
+      record_sum_t own = {0, 0, 0};
+      #pragma omp for schedule(static)
+      for (size_t i = 0; i < num_records; i++) {
+        uint64_t crc = crc32(buffer + i * record_size, record_size);
+        own.low += crc;
+        own.high += own.low < crc;
+      }
+      own.records = 0;
+      #pragma omp critical
+      add(sum, own);
+    }
+    sum.records += num_records;
+  }
+
+  // Each thread checks a slice of the chunk and the pair across the slice's end
+  static void check_chunk(const layout_engine_t *engine, const char *chunk, size_t num_records, size_t num_threads,
+                          summary_t &summary) {
+    size_t record_size = engine->record_size;
+    size_t descents = 0, duplicates = 0;
+    #pragma omp parallel for num_threads(num_threads) reduction(+:descents, duplicates) \
+        shared(engine, chunk, num_records, num_threads, record_size) default(none)
+    for (size_t thread_id = 0; thread_id < num_threads; thread_id++) {
+      size_t first = thread_id * num_records / num_threads;
+      size_t last = (thread_id + 1) * num_records / num_threads;
+      size_t own_descents, own_duplicates;
+      engine->count_pairs(chunk + first * record_size, last < num_records ? last + 1 - first : last - first,
+                          own_descents, own_duplicates);
+      descents += own_descents;
+      duplicates += own_duplicates;
+    }
+    summary.descents += descents;
+    summary.duplicates += duplicates;
+    add(summary.sum, chunk, num_records * record_size, record_size, num_threads);
+  }
+
+  bool check_file(int fd, char *buffer, size_t buffer_size, const layout_engine_t *engine, size_t num_threads,
+                  size_t queue_depth, summary_t &summary, fence::index_t *fence) {
+    memset(&summary, 0, sizeof(summary));
+    size_t record_size = engine->record_size;
+    size_t file_size = lseek(fd, 0, SEEK_END);
+
+    // Two chunks, the one being checked and the next one read ahead, of whole records and I/O blocks.
+    // The last record of the previous chunk is kept apart, to check the pair across the chunk boundary.
+    size_t chunk_size = buffer_size / 2 >= IO_UNIT ? buffer_size / 2 / IO_UNIT * IO_UNIT :
+                        buffer_size / 2 / record_size * record_size;
+    if (chunk_size == 0) {
+      return false;
+    }
+    char *chunks[2] = {buffer, buffer + chunk_size};
+    char last[record_size];
+
+    io::async_queue queue(queue_depth > 0 ? 1 : 0);
+    io::async_request_t ahead;
+    size_t requested = file_size < chunk_size ? file_size : chunk_size;
+    queue.read(ahead, fd, chunks[0], requested, 0);
+    bool ok = true;
+    for (size_t offset = 0, current = 0; offset < file_size; current ^= 1) {
+      size_t amount = queue.wait(ahead);
+      if (amount < requested) {
+        printf("[Error] failed to read output file at %zu\n", offset + amount);
+        ok = false;
+        break;
+      }
+      offset += amount;
+      if (offset < file_size) {
+        requested = file_size - offset < chunk_size ? file_size - offset : chunk_size;
+        queue.read(ahead, fd, chunks[current ^ 1], requested, offset);
+      }
+
+      size_t num_records = amount / record_size;
+      if (num_records == 0) {
+        continue;
+      }
+      if (summary.sum.records > 0) {
+        int cmp = engine->compare(last, chunks[current]);
+        summary.descents += cmp > 0;
+        summary.duplicates += cmp == 0;
+      }
+      check_chunk(engine, chunks[current], num_records, num_threads, summary);
+      if (fence != NULL) {
+        fence::add(*fence, engine, chunks[current], num_records);
+      }
+      memcpy(last, chunks[current] + (num_records - 1) * record_size, record_size);
+    }
+    if (fence != NULL) {
+      fence->sum = summary.sum;
+    }
+    return ok;
+  }
+
+  void format(const record_sum_t &sum, char *out) {
+    if (sum.high != 0) {
+      sprintf(out, "%llx%016llx", (unsigned long long) sum.high, (unsigned long long) sum.low);
+    } else {
+      sprintf(out, "%llx", (unsigned long long) sum.low);
+    }
+  }
+
+}
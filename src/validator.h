@@ -0,0 +1,36 @@
+#ifndef MULTICORE_EXTERNAL_SORT_VALIDATOR_H
+#define MULTICORE_EXTERNAL_SORT_VALIDATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include "global.h"
+#include "layout_engine.h"
+#include "fence_index.h"
+
+// Checks of the sort's output, cheap enough to run after every sort: the output is streamed through the
+// memory budget in fixed-size chunks, each checked by all threads, while the next chunk is read ahead.
+// The checksum is valsort's, the 128-bit sum of every record's CRC-32, so it doesn't depend on the order
+// of the records; the same sum taken over the input as phase1 reads it shows whether the output holds
+// the same multiset of records.
+namespace validate {
+  typedef struct summary {
+    size_t descents;    // Adjacent records out of order
+    size_t duplicates;  // Adjacent records with equal keys
+    record_sum_t sum;   // Also counts the records
+  } summary_t;
+
+  void add(record_sum_t &sum, const record_sum_t &other);
+  // Add the records of buffer to sum, using num_threads threads
+  void add(record_sum_t &sum, const char *buffer, size_t size, size_t record_size, size_t num_threads);
+
+  // Check the sorted records of fd through buffer, reading ahead with up to queue_depth reads in flight.
+  // Builds the file's fence index on the way, with its checksum, unless fence is NULL.
+  // Returns false if fd couldn't be read.
+  bool check_file(int fd, char *buffer, size_t buffer_size, const layout_engine_t *engine, size_t num_threads,
+                  size_t queue_depth, summary_t &summary, fence::index_t *fence);
+
+  // The 128-bit sum in hex, as valsort prints it; out must hold 33 bytes
+  void format(const record_sum_t &sum, char *out);
+}
+
+#endif //MULTICORE_EXTERNAL_SORT_VALIDATOR_H